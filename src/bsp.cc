@@ -0,0 +1,165 @@
+#include "bsp.hh"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file_t::~mapped_file_t() {
+    this->close();
+}
+
+bool mapped_file_t::open(const std::string& path) {
+    this->close();
+
+#ifdef _WIN32
+    auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart) {
+        CloseHandle(file);
+        return false;
+    }
+
+    auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+
+    auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    this->file_handle    = file;
+    this->mapping_handle = mapping;
+    this->data           = reinterpret_cast<uint8_t*>(view);
+    this->size           = size_t(file_size.QuadPart);
+#else
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || !st.st_size) {
+        ::close(fd);
+        return false;
+    }
+
+    auto view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // mapping keeps the file alive
+    if (view == MAP_FAILED)
+        return false;
+
+    this->data = reinterpret_cast<uint8_t*>(view);
+    this->size = size_t(st.st_size);
+#endif
+
+    return true;
+}
+
+void mapped_file_t::close() {
+    if (!this->data)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(this->data);
+    CloseHandle(this->mapping_handle);
+    CloseHandle(this->file_handle);
+    this->mapping_handle = nullptr;
+    this->file_handle    = nullptr;
+#else
+    munmap(this->data, this->size);
+#endif
+
+    this->data = nullptr;
+    this->size = 0;
+}
+
+BspFile::~BspFile() {
+    this->close();
+}
+
+bool BspFile::open(const std::string& path) {
+    this->close();
+
+    if (!this->file.open(path))
+        return false;
+
+    if (this->file.size < sizeof(bsp_header_t)) {
+        std::cerr << path << " is too small to be a BSP" << std::endl;
+        this->close();
+        return false;
+    }
+
+    this->file_path = path;
+    return true;
+}
+
+void BspFile::close() {
+    this->validated.clear();
+    this->aligned_copies.clear();
+    this->external_lumps.clear();
+    this->file.close();
+    this->file_path.clear();
+}
+
+span<const uint8_t> BspFile::lump_bytes(LUMPS lump) {
+    const auto& entry = this->header().lumps[size_t(lump)];
+
+    std::lock_guard<std::mutex> lock(this->cache_mutex);
+
+    auto external = this->external_lumps.find(uint32_t(lump));
+    if (external == this->external_lumps.end()) {
+        // first time anybody asks, look for <map>.bsp.XXXX.bsp_lump
+        char suffix[20];
+        sprintf(suffix, ".%04x.bsp_lump", uint32_t(lump));
+
+        auto mapping = std::make_unique<mapped_file_t>();
+        if (!mapping->open(this->file_path + suffix))
+            mapping.reset();
+        else if (entry.size != mapping->size) // header still carries the size, trust the file if they disagree
+            std::cerr << "Lump " << uint32_t(lump) << " header says " << entry.size << " bytes, .bsp_lump has " << mapping->size << std::endl;
+
+        external = this->external_lumps.emplace(uint32_t(lump), std::move(mapping)).first;
+    }
+
+    if (external->second) {
+        return span<const uint8_t>{external->second->data, external->second->size};
+    }
+
+    // 64 bit math so offset + size can't wrap
+    if (uint64_t(entry.offset) + entry.size > this->file.size) {
+        std::cerr << "Lump " << uint32_t(lump) << " [" << entry.offset << ", " << entry.size << "] is out of bounds of the file (" << this->file.size << ")" << std::endl;
+        return {};
+    }
+
+    return span<const uint8_t>{this->file.data + entry.offset, entry.size};
+}
+
+void BspFile::validate_lump(const void* key, LUMPS lump, const char* name, size_t element_size, uint32_t version) {
+    {
+        std::lock_guard<std::mutex> lock(this->validated_mutex);
+        if (!this->validated.insert(key).second)
+            return;
+    }
+
+    const auto& entry = this->header().lumps[size_t(lump)];
+    const auto  bytes = this->lump_bytes(lump);
+
+    if (bytes.size() % element_size)
+        std::cerr << "Lump " << name << " size " << bytes.size() << " isn't a multiple of " << element_size << std::endl;
+    if (version != LUMP_VERSION_ANY && entry.version != version)
+        std::cerr << "Lump " << name << " is version " << entry.version << ", expected " << version << std::endl;
+}
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#pragma pack(push, 1)
+enum class LUMPS : uint32_t {
+    ENTITIES      = 0x0,
+    TEXTURE_DATA  = 0x2,
+    MODELS        = 0xE,
+    SURFACE_NAMES = 0xF,
+    GAME_LUMP     = 0x23,
+
+    MESHES        = 0x50,
+    MESH_BOUNDS   = 0x51,
+    MATERIAL_SORT = 0x52,
+
+    VERTEX         = 0x3,
+    VERTEX_NORMALS = 0x1E,
+    PACKED_VERTEX  = 0x14,
+    MESH_INDICIES  = 0x4F,
+
+    VERTEX_BLINN_PHONG = 0x4B,
+    VERTEX_LIT_BUMP    = 0x49,
+    VERTEX_LIT_FLAT    = 0x48,
+    VERTEX_UNLIT       = 0x47,
+    VERTEX_UNLIT_TS    = 0x4A,
+};
+
+enum class VERTEX_FLAGS : uint32_t {
+    // Flags for future colour rendering???
+    SKY_2D  = 0x00002,
+    SKY     = 0x00004,
+    TRIGGER = 0x40000,
+
+    VERTEX_LIT_FLAT = 0x000,
+    VERTEX_LIT_BUMP = 0x200,
+    VERTEX_UNLIT    = 0x400,
+    VERTEX_UNLIT_TS = 0x600,
+
+    MASK = 0x600,
+};
+
+struct lump_t final {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t version;
+    uint32_t cc;
+};
+
+constexpr uint32_t BSP_MAGIC = 0x50534272; // rBSP
+
+// Versions load_map knows the layouts of, anything else is read with the ones of BSP_VERSION_MIN (and a warning)
+constexpr uint32_t BSP_VERSION_MIN = 47;
+constexpr uint32_t BSP_VERSION_MAX = 50;
+
+struct bsp_header_t final {
+    uint32_t header; // BSP_MAGIC
+    uint32_t version; // BSP_VERSION_MIN-BSP_VERSION_MAX
+    uint32_t map_version;
+    uint32_t unkC; // 0x7F
+    lump_t   lumps[0x7F];
+};
+
+// 0x2
+struct texture_data_t final {
+    uint32_t name_index;
+    uint32_t texture_width;
+    uint32_t texture_height;
+    uint32_t flags;
+};
+
+// 0x3
+union vertex_t final {
+    struct {
+        float x;
+        float y;
+        float z;
+    };
+    float coords[3];
+};
+
+// 0x14
+union packed_vertex_t final {
+    struct {
+        int16_t x;
+        int16_t y;
+        int16_t z;
+    };
+    int16_t coords[3];
+};
+
+// 0x50
+struct mesh_t final {
+    uint32_t first_mesh_index;
+    uint16_t num_triangles;
+
+    uint16_t _pad; // ???
+
+    int32_t unk[3];
+    int16_t unk1;
+
+    uint16_t material_sort;
+    uint32_t flags;
+};
+static_assert(sizeof(mesh_t) == 28);
+
+using mesh_index = uint16_t;
+
+// 0x51, one per mesh
+struct mesh_bounds_t final {
+    float    origin[3];
+    float    radius; // of the sphere around the box
+    float    extents[3]; // half size
+    uint32_t unk;
+};
+static_assert(sizeof(mesh_bounds_t) == 32);
+
+// 0xE
+struct model_t final {
+    float mins[3];
+    float maxs[3];
+
+    uint32_t first_mesh;
+    uint32_t num_meshes;
+
+    int32_t unk[8];
+};
+
+struct material_sort_t final {
+    uint16_t texture_data;
+    uint16_t lightmap_idx;
+
+    uint16_t unk[2];
+
+    uint32_t vertex_offset;
+};
+static_assert(sizeof(material_sort_t) == 12);
+
+// --- Vertex lumps, I render them all as one lmfao
+// TODO: seperate shaders for different types? maybe colours for now?
+
+// 0x4B
+struct vertex_blinn_phong_t final {
+    uint32_t pos_index;
+    uint32_t nrm_index;
+    float    uv[2];
+    float    uv2[2];
+};
+static_assert(sizeof(vertex_blinn_phong_t) == 24);
+
+// 0x49
+struct vertex_lit_bump_t final {
+    uint32_t pos_index;
+    uint32_t nrm_index;
+    float    uv[2];
+
+    int32_t unused;
+
+    float unk[3];
+};
+static_assert(sizeof(vertex_lit_bump_t) == 32);
+
+// 0x48
+struct vertex_lit_flat_t final {
+    uint32_t pos_index;
+    uint32_t nrm_index;
+    float    uv[2];
+
+    int32_t unk;
+};
+static_assert(sizeof(vertex_lit_flat_t) == 20);
+
+// 0x47
+// struct vertex_unlit final {
+//     uint32_t pos_index;
+//     uint32_t nrm_index;
+//     float    uv[2];
+// }
+typedef vertex_lit_flat_t vertex_unlit_t;
+static_assert(sizeof(vertex_unlit_t) == 20);
+
+// 0x4A
+struct vertex_unlit_ts_t final {
+    uint32_t pos_index;
+    uint32_t nrm_index;
+    float    uv[2];
+
+    uint64_t unk; // 8 bytes
+};
+static_assert(sizeof(vertex_unlit_ts_t) == 24);
+
+// --- 0x23, a directory of sub lumps by id. Not registered, it's a blob, read with lump_bytes.
+
+constexpr uint32_t GAME_LUMP_STATIC_PROPS = 'sprp';
+
+struct game_lump_header_t final {
+    uint32_t lumps_num;
+    // game_lump_t lumps[lumps_num];
+};
+
+struct game_lump_t final {
+    uint32_t id; // GAME_LUMP_STATIC_PROPS...
+    uint16_t flags;
+    uint16_t version;
+    uint32_t offset; // from the start of the .bsp, see load_static_props for external ones
+    uint32_t size;
+};
+static_assert(sizeof(game_lump_t) == 16);
+
+// sprp is: uint32 names_num, char[names_num][128] model names, uint32 props_num + 2 unknown uint32s, props.
+// Only the start of a prop is the same across versions, the stride comes from the version, see SPRP_LAYOUTS in props.cc.
+struct static_prop_t final {
+    float    origin[3];
+    float    angles[3]; // pitch yaw roll, degrees
+    float    scale;
+    uint16_t model_index; // into the names
+    uint8_t  solid;
+    uint8_t  flags;
+};
+static_assert(sizeof(static_prop_t) == 32);
+
+constexpr size_t STATIC_PROP_NAME_SIZE = 128;
+#pragma pack(pop)
+
+// C++17 has no std::span, this is all we need of it
+template <typename T>
+struct span {
+    T*     ptr   = nullptr;
+    size_t count = 0;
+
+    T*     data() const { return ptr; }
+    size_t size() const { return count; }
+    bool   empty() const { return !count; }
+
+    T* begin() const { return ptr; }
+    T* end() const { return ptr + count; }
+
+    T& operator[](size_t i) const {
+        assert(i < count);
+        return ptr[i];
+    }
+};
+
+// --- lump registry, every lump we read as an array and what of.
+// Reading a lump that isn't in here doesn't compile, lump_bytes is there for the rest.
+// version is what the lump table says on the maps we know, a mismatch only warns (once).
+// alignment is what the element wants naturally, the structs above are packed so alignof says 1.
+
+constexpr uint32_t LUMP_VERSION_ANY = ~uint32_t(0);
+
+template <LUMPS L>
+struct lump_traits;
+
+#define R5BSP_LUMP(ID, TYPE, VERSION, ALIGNMENT)                 \
+    template <>                                                  \
+    struct lump_traits<LUMPS::ID> {                              \
+        using type                              = TYPE;          \
+        static constexpr const char* name       = #ID;           \
+        static constexpr uint32_t    version    = VERSION;       \
+        static constexpr size_t      alignment  = ALIGNMENT;     \
+        static_assert(ALIGNMENT >= alignof(TYPE));               \
+        static_assert((ALIGNMENT & (ALIGNMENT - 1)) == 0);       \
+    };
+
+R5BSP_LUMP(ENTITIES, char, 0, 1)
+R5BSP_LUMP(TEXTURE_DATA, texture_data_t, 1, 4)
+R5BSP_LUMP(VERTEX, vertex_t, 0, 4)
+R5BSP_LUMP(MODELS, model_t, 0, 4)
+R5BSP_LUMP(SURFACE_NAMES, char, 0, 1)
+R5BSP_LUMP(PACKED_VERTEX, packed_vertex_t, 0, 2)
+R5BSP_LUMP(VERTEX_NORMALS, vertex_t, 0, 4)
+R5BSP_LUMP(VERTEX_UNLIT, vertex_unlit_t, 0, 4)
+R5BSP_LUMP(VERTEX_LIT_FLAT, vertex_lit_flat_t, 0, 4)
+R5BSP_LUMP(VERTEX_LIT_BUMP, vertex_lit_bump_t, 0, 4)
+R5BSP_LUMP(VERTEX_UNLIT_TS, vertex_unlit_ts_t, 0, 4)
+R5BSP_LUMP(MESH_INDICIES, mesh_index, 0, 2)
+R5BSP_LUMP(MESHES, mesh_t, 0, 4)
+R5BSP_LUMP(MESH_BOUNDS, mesh_bounds_t, 0, 4)
+R5BSP_LUMP(MATERIAL_SORT, material_sort_t, 0, 4)
+
+#undef R5BSP_LUMP
+
+template <LUMPS L>
+using lump_type_t = typename lump_traits<L>::type;
+
+// Per BSP version layouts, every version reads the registry above unless it specializes a lump here.
+// A season that changes a struct gets its own struct and a specialization for just that lump and version,
+// parsing code is instantiated per version so it never branches on it.
+template <uint32_t V, LUMPS L>
+struct bsp_lump_traits : lump_traits<L> {};
+
+template <uint32_t V, LUMPS L>
+using bsp_lump_type_t = typename bsp_lump_traits<V, L>::type;
+
+// Read only file mapping
+struct mapped_file_t {
+    mapped_file_t() = default;
+    ~mapped_file_t();
+
+    mapped_file_t(const mapped_file_t&) = delete;
+    mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    uint8_t* data = nullptr;
+    size_t   size = 0;
+
+#ifdef _WIN32
+    void* file_handle    = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+};
+
+// Memory mapped BSP, lumps are handed out as views straight into the mapping.
+// Shipped maps keep most lumps in <map>.bsp.<lump id, 4 hex digits>.bsp_lump next to the .bsp,
+// those get found and mapped the first time somebody asks for the lump, so lumps nobody reads cost nothing.
+class BspFile {
+public:
+    BspFile() = default;
+    ~BspFile();
+
+    BspFile(const BspFile&) = delete;
+    BspFile& operator=(const BspFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    bool                is_open() const { return this->file.data != nullptr; }
+    const bsp_header_t& header() const { return *reinterpret_cast<const bsp_header_t*>(this->file.data); }
+    const std::string&  path() const { return this->file_path; }
+
+    // Raw bytes of a lump, empty if it's out of the file's bounds. Safe to call from multiple threads.
+    span<const uint8_t> lump_bytes(LUMPS lump);
+
+    // Registered lump as an array of its type, trailing bytes that don't make up a whole element are ignored.
+    // Size and version get checked the first time the lump is asked for.
+    // Lumps that aren't aligned enough get copied once (and kept around) instead of read misaligned.
+    template <LUMPS L>
+    span<const lump_type_t<L>> lump();
+
+    // Same with the layout of BSP version V
+    template <uint32_t V, LUMPS L>
+    span<const bsp_lump_type_t<V, L>> lump();
+
+private:
+    // Once per layout, key tells them apart (see validated)
+    void validate_lump(const void* key, LUMPS lump, const char* name, size_t element_size, uint32_t version);
+
+    template <typename T>
+    span<const T> lump_as(LUMPS lump, size_t alignment);
+
+    mapped_file_t file;
+    std::string   file_path;
+
+    // lumps get requested from multiple threads while loading
+    std::mutex cache_mutex;
+
+    // nullptr for lumps that turned out to be inline
+    std::unordered_map<uint32_t, std::unique_ptr<mapped_file_t>> external_lumps;
+    std::unordered_map<uint32_t, std::vector<uint8_t>>           aligned_copies;
+
+    // Keyed by &traits::name, versions that don't specialize a lump inherit it from lump_traits and share the check,
+    // ones that do get theirs no matter which accessor ran first
+    std::mutex                      validated_mutex;
+    std::unordered_set<const void*> validated;
+};
+
+template <LUMPS L>
+span<const lump_type_t<L>> BspFile::lump() {
+    using traits = lump_traits<L>;
+
+    this->validate_lump(&traits::name, L, traits::name, sizeof(lump_type_t<L>), traits::version);
+
+    return this->lump_as<lump_type_t<L>>(L, traits::alignment);
+}
+
+template <uint32_t V, LUMPS L>
+span<const bsp_lump_type_t<V, L>> BspFile::lump() {
+    using traits = bsp_lump_traits<V, L>;
+    static_assert(V >= BSP_VERSION_MIN && V <= BSP_VERSION_MAX);
+
+    this->validate_lump(&traits::name, L, traits::name, sizeof(bsp_lump_type_t<V, L>), traits::version);
+
+    return this->lump_as<bsp_lump_type_t<V, L>>(L, traits::alignment);
+}
+
+template <typename T>
+span<const T> BspFile::lump_as(LUMPS lump, size_t alignment) {
+    const auto bytes = this->lump_bytes(lump);
+    const auto count = bytes.size() / sizeof(T);
+
+    auto ptr = bytes.data();
+    if (uintptr_t(ptr) % alignment) {
+        std::lock_guard<std::mutex> lock(this->cache_mutex);
+
+        auto& copy = this->aligned_copies[uint32_t(lump)];
+        if (copy.empty()) {
+            // new'd storage is aligned for anything we have, all of the lump so layouts of other versions can share it
+            copy.resize(bytes.size());
+            memcpy(copy.data(), ptr, copy.size());
+        }
+        ptr = copy.data();
+    }
+
+    return span<const T>{reinterpret_cast<const T*>(ptr), count};
+}
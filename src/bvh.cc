@@ -0,0 +1,398 @@
+#include "bvh.hh"
+
+#include "map.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+
+// Subtrees with more triangles than this get built as their own job
+constexpr size_t BVH_TASK_SIZE = 16 * 1024;
+
+struct aabb_t {
+    float mins[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+    float maxs[3] = {-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+
+    void grow(const float p[3]) {
+        for (int i = 0; i < 3; i++) {
+            this->mins[i] = std::min(this->mins[i], p[i]);
+            this->maxs[i] = std::max(this->maxs[i], p[i]);
+        }
+    }
+
+    void grow(const aabb_t& other) {
+        for (int i = 0; i < 3; i++) {
+            this->mins[i] = std::min(this->mins[i], other.mins[i]);
+            this->maxs[i] = std::max(this->maxs[i], other.maxs[i]);
+        }
+    }
+
+    bool valid() const { return this->mins[0] <= this->maxs[0]; }
+
+    float area() const {
+        if (!this->valid())
+            return 0.f;
+        const float x = this->maxs[0] - this->mins[0], y = this->maxs[1] - this->mins[1], z = this->maxs[2] - this->mins[2];
+        return 2.f * (x * y + y * z + z * x);
+    }
+};
+
+// What the builder splits, a triangle or a whole mesh
+struct bvh_prim_t {
+    aabb_t   bounds;
+    float    centroid[3];
+    uint32_t first = 0; // meshes: their triangles in tri_order
+    uint32_t count = 1; // triangles
+};
+
+struct bvh_split_t {
+    int   axis = -1;
+    float pos  = 0.f; // centroids below go left
+};
+
+// Binned SAH over the centroids of order[0, count), weighted by triangle count.
+// Small nodes get fewer bins, there's no point in 16 of them for 6 triangles.
+static bvh_split_t find_split(const std::vector<bvh_prim_t>& prims, const uint32_t* order, size_t count, const aabb_t& centroids, size_t weight, float area) {
+    struct bin_t {
+        aabb_t bounds;
+        size_t count = 0;
+    };
+
+    const auto bins_num = uint32_t(std::min<size_t>(BVH_BINS, std::max<size_t>(count, 2)));
+
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        const auto extent = centroids.maxs[axis] - centroids.mins[axis];
+        scale[axis]       = extent > 0.f ? bins_num / extent : 0.f;
+    }
+
+    // all axes in one pass over the prims
+    bin_t bins[3][BVH_BINS];
+    for (size_t i = 0; i < count; i++) {
+        const auto& prim = prims[order[i]];
+        for (int axis = 0; axis < 3; axis++) {
+            const auto bin = std::min(bins_num - 1, uint32_t((prim.centroid[axis] - centroids.mins[axis]) * scale[axis]));
+            bins[axis][bin].bounds.grow(prim.bounds);
+            bins[axis][bin].count += prim.count;
+        }
+    }
+
+    bvh_split_t best;
+    float       best_cost = float(weight); // a leaf
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.f)
+            continue;
+
+        // sweep from the right so every split plane is one more pass from the left
+        float  right_area[BVH_BINS];
+        size_t right_count[BVH_BINS];
+        aabb_t right;
+        size_t right_num = 0;
+        for (uint32_t i = bins_num - 1; i > 0; i--) {
+            right.grow(bins[axis][i].bounds);
+            right_num += bins[axis][i].count;
+            right_area[i]  = right.area();
+            right_count[i] = right_num;
+        }
+
+        aabb_t left;
+        size_t left_num = 0;
+        for (uint32_t i = 0; i < bins_num - 1; i++) {
+            left.grow(bins[axis][i].bounds);
+            left_num += bins[axis][i].count;
+            if (!left_num || !right_count[i + 1])
+                continue;
+
+            const auto cost = 1.f + (left.area() * left_num + right_area[i + 1] * right_count[i + 1]) / area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best.axis = axis;
+                best.pos  = centroids.mins[axis] + (i + 1) / scale[axis];
+            }
+        }
+    }
+
+    return best;
+}
+
+class bvh_builder_t {
+public:
+    bvh_builder_t(JobPool& jobs, bvh_t* res) : jobs(jobs), res(res) {}
+
+    void build(const bvh_input_t& input);
+
+private:
+    template <typename F>
+    void spawn(F fn, size_t weight);
+    void bounds_of(const std::vector<bvh_prim_t>& prims, const uint32_t* order, size_t count, aabb_t* bounds, aabb_t* centroids, size_t* weight) const;
+    uint32_t split(const std::vector<bvh_prim_t>& prims, uint32_t* order, uint32_t begin, uint32_t end, const aabb_t& bounds, const aabb_t& centroids, size_t weight);
+    void     set_node(uint32_t node, const aabb_t& bounds, uint32_t first, uint32_t count);
+
+    void build_meshes(uint32_t node, uint32_t depth, uint32_t begin, uint32_t end);
+    void build_triangles(uint32_t node, uint32_t depth, uint32_t begin, uint32_t end);
+
+    JobPool& jobs;
+    bvh_t*   res;
+
+    std::vector<bvh_prim_t> meshes;
+    std::vector<uint32_t>   mesh_order;
+    std::vector<bvh_prim_t> triangles;
+    std::vector<uint32_t>   tri_order; // leaves point in here
+
+    std::atomic<uint32_t> nodes_used = 1;
+    std::atomic<uint32_t> max_depth  = 0;
+    std::atomic<size_t>   tasks_left = 0;
+};
+
+template <typename F>
+void bvh_builder_t::spawn(F fn, size_t weight) {
+    if (weight < BVH_TASK_SIZE) {
+        fn();
+        return;
+    }
+    this->tasks_left++;
+    this->jobs.submit([this, fn = std::move(fn)]() {
+        fn();
+        this->tasks_left--;
+    });
+}
+
+void bvh_builder_t::bounds_of(const std::vector<bvh_prim_t>& prims, const uint32_t* order, size_t count, aabb_t* bounds, aabb_t* centroids, size_t* weight) const {
+    *weight = 0;
+    for (size_t i = 0; i < count; i++) {
+        const auto& prim = prims[order[i]];
+        bounds->grow(prim.bounds);
+        centroids->grow(prim.centroid);
+        *weight += prim.count;
+    }
+}
+
+// Where order[begin, end) gets split, the middle if SAH has nothing better
+uint32_t bvh_builder_t::split(const std::vector<bvh_prim_t>& prims, uint32_t* order, uint32_t begin, uint32_t end, const aabb_t& bounds, const aabb_t& centroids, size_t weight) {
+    const auto best = find_split(prims, order + begin, end - begin, centroids, weight, bounds.area());
+
+    uint32_t mid = begin;
+    if (best.axis >= 0) {
+        mid = uint32_t(std::partition(order + begin, order + end, [&](uint32_t i) { return prims[i].centroid[best.axis] < best.pos; }) - order);
+    }
+    if (mid == begin || mid == end) {
+        // same centroids all over or a leaf would've been cheaper but it's too big, still has to split
+        int axis = 0;
+        for (int i = 1; i < 3; i++) {
+            if (bounds.maxs[i] - bounds.mins[i] > bounds.maxs[axis] - bounds.mins[axis])
+                axis = i;
+        }
+        mid = begin + (end - begin) / 2;
+        std::nth_element(order + begin, order + mid, order + end, [&](uint32_t a, uint32_t b) { return prims[a].centroid[axis] < prims[b].centroid[axis]; });
+    }
+    return mid;
+}
+
+void bvh_builder_t::set_node(uint32_t node, const aabb_t& bounds, uint32_t first, uint32_t count) {
+    auto& res = this->res->nodes[node];
+    memcpy(res.mins, bounds.mins, sizeof(res.mins));
+    memcpy(res.maxs, bounds.maxs, sizeof(res.maxs));
+    res.first = first;
+    res.count = count;
+}
+
+void bvh_builder_t::build_meshes(uint32_t node, uint32_t depth, uint32_t begin, uint32_t end) {
+    if (end - begin == 1) {
+        const auto& mesh = this->meshes[this->mesh_order[begin]];
+        this->build_triangles(node, depth, mesh.first, mesh.first + mesh.count);
+        return;
+    }
+
+    aabb_t bounds, centroids;
+    size_t weight;
+    this->bounds_of(this->meshes, this->mesh_order.data() + begin, end - begin, &bounds, &centroids, &weight);
+
+    const auto mid      = this->split(this->meshes, this->mesh_order.data(), begin, end, bounds, centroids, weight);
+    const auto children = this->nodes_used.fetch_add(2);
+    this->set_node(node, bounds, children, 0);
+
+    size_t left_weight = 0;
+    for (uint32_t i = begin; i < mid; i++) {
+        left_weight += this->meshes[this->mesh_order[i]].count;
+    }
+    this->spawn([=]() { this->build_meshes(children, depth + 1, begin, mid); }, left_weight);
+    this->build_meshes(children + 1, depth + 1, mid, end);
+}
+
+void bvh_builder_t::build_triangles(uint32_t node, uint32_t depth, uint32_t begin, uint32_t end) {
+    aabb_t bounds, centroids;
+    size_t weight;
+    this->bounds_of(this->triangles, this->tri_order.data() + begin, end - begin, &bounds, &centroids, &weight);
+
+    if (end - begin <= BVH_LEAF_SIZE) {
+        this->set_node(node, bounds, begin, end - begin);
+        auto deepest = this->max_depth.load();
+        while (depth > deepest && !this->max_depth.compare_exchange_weak(deepest, depth)) {
+        }
+        return;
+    }
+
+    const auto mid      = this->split(this->triangles, this->tri_order.data(), begin, end, bounds, centroids, weight);
+    const auto children = this->nodes_used.fetch_add(2);
+    this->set_node(node, bounds, children, 0);
+
+    this->spawn([=]() { this->build_triangles(children, depth + 1, begin, mid); }, mid - begin);
+    this->build_triangles(children + 1, depth + 1, mid, end);
+}
+
+void gather_bvh_input(const stk_map_t& map, JobPool& jobs, bvh_input_t* res) {
+    *res = {};
+
+    // flat list of meshes with where their triangles go
+    std::vector<bvh_ref_t> mesh_refs;
+    uint32_t               raw_total = 0;
+    for (uint32_t model = 0; model < map.models.size(); model++) {
+        for (uint32_t mesh = 0; mesh < map.models[model].meshes.size(); mesh++) {
+            mesh_refs.push_back({model, mesh, 0});
+            res->meshes.push_back({raw_total, 0});
+            raw_total += map.models[model].meshes[mesh].dec.indices / 3;
+        }
+    }
+
+    // triangles where the mesh wants them, invalid ones get skipped and counted per mesh
+    res->refs.resize(raw_total);
+    res->triangles.resize(raw_total);
+
+    jobs.parallel_for(mesh_refs.size(), 64, [&](size_t begin, size_t end) {
+        for (size_t m = begin; m < end; m++) {
+            const auto& mesh = map.models[mesh_refs[m].model].meshes[mesh_refs[m].mesh];
+            auto        at   = res->meshes[m].first;
+            for (uint32_t t = 0; t < mesh.dec.indices / 3; t++) {
+                bvh_triangle_t triangle;
+                auto           ok = true;
+                for (int corner = 0; corner < 3 && ok; corner++) {
+                    ok = mesh_vertex_position(map, mesh, mesh_index_at(map, mesh, size_t(t) * 3 + corner), &triangle.v[corner]);
+                }
+                if (!ok)
+                    continue;
+
+                aabb_t bounds;
+                for (int corner = 0; corner < 3; corner++) {
+                    bounds.grow(triangle.v[corner].coords);
+                }
+                if (!(bounds.area() > 0.f)) // zero area or NaNs
+                    continue;
+
+                res->refs[at]      = {mesh_refs[m].model, mesh_refs[m].mesh, t};
+                res->triangles[at] = triangle;
+                at++;
+            }
+            res->meshes[m].count = at - res->meshes[m].first;
+        }
+    });
+}
+
+void bvh_builder_t::build(const bvh_input_t& input) {
+    *this->res = {};
+
+    this->triangles.resize(input.triangles.size());
+    this->jobs.parallel_for(input.meshes.size(), 64, [&](size_t begin, size_t end) {
+        for (size_t m = begin; m < end; m++) {
+            for (uint32_t t = input.meshes[m].first; t < input.meshes[m].first + input.meshes[m].count; t++) {
+                auto& prim = this->triangles[t];
+                for (int corner = 0; corner < 3; corner++) {
+                    prim.bounds.grow(input.triangles[t].v[corner].coords);
+                }
+                for (int i = 0; i < 3; i++) {
+                    prim.centroid[i] = (prim.bounds.mins[i] + prim.bounds.maxs[i]) * 0.5f;
+                }
+            }
+        }
+    });
+
+    // valid triangles of every mesh packed together, meshes are the top level prims
+    for (const auto& mesh : input.meshes) {
+        if (!mesh.count)
+            continue;
+
+        bvh_prim_t prim;
+        prim.first = uint32_t(this->tri_order.size());
+        prim.count = mesh.count;
+        for (uint32_t t = mesh.first; t < mesh.first + mesh.count; t++) {
+            this->tri_order.push_back(t);
+            prim.bounds.grow(this->triangles[t].bounds);
+        }
+        for (int i = 0; i < 3; i++) {
+            prim.centroid[i] = (prim.bounds.mins[i] + prim.bounds.maxs[i]) * 0.5f;
+        }
+
+        this->mesh_order.push_back(uint32_t(this->meshes.size()));
+        this->meshes.push_back(prim);
+    }
+    if (this->meshes.empty())
+        return;
+
+    // a binary tree with at least one triangle a leaf can't have more nodes than this
+    this->res->nodes.resize(this->tri_order.size() * 2);
+    this->build_meshes(0, 0, 0, uint32_t(this->meshes.size()));
+    while (this->tasks_left) {
+        if (!this->jobs.help())
+            std::this_thread::yield();
+    }
+    this->res->nodes.resize(this->nodes_used);
+    this->res->depth = this->max_depth;
+
+    this->res->refs.resize(this->tri_order.size());
+    this->res->triangles.resize(this->tri_order.size());
+    this->jobs.parallel_for(this->tri_order.size(), 64 * 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            this->res->refs[i]      = input.refs[this->tri_order[i]];
+            this->res->triangles[i] = input.triangles[this->tri_order[i]];
+        }
+    });
+}
+
+void build_bvh(const bvh_input_t& input, JobPool& jobs, bvh_t* res) {
+    bvh_builder_t builder(jobs, res);
+    builder.build(input);
+}
+
+void build_bvh(const stk_map_t& map, JobPool& jobs, bvh_t* res) {
+    bvh_input_t input;
+    gather_bvh_input(map, jobs, &input);
+    build_bvh(input, jobs, res);
+}
+
+void print_bvh_stats(const bvh_t& bvh, std::ostream& out) {
+    if (bvh.empty()) {
+        out << "BVH: empty" << std::endl;
+        return;
+    }
+
+    auto area = [](const bvh_node_t& node) {
+        const float x = node.maxs[0] - node.mins[0], y = node.maxs[1] - node.mins[1], z = node.maxs[2] - node.mins[2];
+        return 2.f * (x * y + y * z + z * x);
+    };
+
+    size_t leaves = 0, max_depth = 0;
+    double cost = 0.0;
+
+    const auto                                root_area = area(bvh.nodes[0]);
+    std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        const auto [index, depth] = stack.back();
+        stack.pop_back();
+
+        const auto& node = bvh.nodes[index];
+        max_depth        = std::max<size_t>(max_depth, depth);
+        if (node.leaf()) {
+            leaves++;
+            cost += area(node) / root_area * node.count;
+        } else {
+            cost += area(node) / root_area;
+            stack.push_back({node.first, depth + 1});
+            stack.push_back({node.first + 1, depth + 1});
+        }
+    }
+
+    out << "BVH: " << bvh.nodes.size() << " nodes, " << leaves << " leaves, " << bvh.triangles.size() << " triangles (" << std::fixed << std::setprecision(2)
+        << double(bvh.triangles.size()) / leaves << " a leaf), depth " << max_depth << ", SAH cost " << cost << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+}
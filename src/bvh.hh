@@ -0,0 +1,73 @@
+#pragma once
+
+#include "bsp.hh"
+#include "jobs.hh"
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+struct stk_map_t;
+
+// Leaves get split until they're at most this many triangles
+constexpr uint32_t BVH_LEAF_SIZE = 4;
+// SAH candidates per axis
+constexpr uint32_t BVH_BINS = 16;
+
+// 32 bytes, two to a cache line. Children are allocated in pairs so a node only stores the first one.
+struct bvh_node_t {
+    float    mins[3];
+    uint32_t first; // left child (right is first + 1) when count is 0, first triangle otherwise
+    float    maxs[3];
+    uint32_t count; // triangles in the leaf, 0 for inner nodes
+
+    bool leaf() const { return this->count != 0; }
+};
+static_assert(sizeof(bvh_node_t) == 32);
+
+// Which triangle of the map a BVH triangle is
+struct bvh_ref_t {
+    uint32_t model;
+    uint32_t mesh; // in the model
+    uint32_t triangle; // in the mesh
+};
+
+// Positions in leaf order so queries never go through the index or vertex buffers
+struct bvh_triangle_t {
+    vertex_t v[3];
+};
+
+// SAH BVH over the world triangles. The top is built over mesh bounds until a node is down to one mesh,
+// from there on it splits that mesh's triangles, so the expensive part only ever sees a few thousand boxes.
+// Everything is flat arrays, it goes into the map cache as is.
+struct bvh_t {
+    std::vector<bvh_node_t>     nodes; // [0] is the root
+    std::vector<bvh_ref_t>      refs;
+    std::vector<bvh_triangle_t> triangles; // same order as refs
+    uint32_t                    depth = 0; // of the deepest leaf, the root is 0
+
+    bool empty() const { return this->nodes.empty(); }
+};
+
+// The map's triangles as the build wants them. Gathering is one pass over the meshes, the build after it doesn't touch
+// the map, so the map can be handed on while the BVH is still being built.
+struct bvh_input_t {
+    struct mesh_t {
+        uint32_t first; // in refs/triangles
+        uint32_t count; // the valid ones, the rest of the mesh's slots are left unused
+    };
+
+    std::vector<bvh_ref_t>      refs;
+    std::vector<bvh_triangle_t> triangles; // same order as refs
+    std::vector<mesh_t>         meshes; // every mesh of every model in order
+};
+
+// Degenerate triangles and ones with indices outside of the vertex buffer are left out
+void gather_bvh_input(const stk_map_t& map, JobPool& jobs, bvh_input_t* res);
+void build_bvh(const bvh_input_t& input, JobPool& jobs, bvh_t* res);
+
+// Both of the above
+void build_bvh(const stk_map_t& map, JobPool& jobs, bvh_t* res);
+
+// Nodes, leaves, depth and SAH cost
+void print_bvh_stats(const bvh_t& bvh, std::ostream& out);
@@ -0,0 +1,92 @@
+#include "cull.hh"
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+void cull_bounds_push(cull_bounds_t* bounds, const float mins[3], const float maxs[3]) {
+    for (int axis = 0; axis < 3; axis++) {
+        bounds->center[axis].push_back((mins[axis] + maxs[axis]) * 0.5f);
+        bounds->extent[axis].push_back((maxs[axis] - mins[axis]) * 0.5f);
+    }
+    bounds->count++;
+}
+
+void cull_bounds_pad(cull_bounds_t* bounds) {
+    // a negative extent can't reach any plane
+    while (bounds->center[0].size() % 4) {
+        for (int axis = 0; axis < 3; axis++) {
+            bounds->center[axis].push_back(0.f);
+            bounds->extent[axis].push_back(-1e30f);
+        }
+    }
+}
+
+void frustum_from_matrix(const float m[16], frustum_t* res) {
+    // Gribb/Hartmann, row i of the matrix is m[i], m[4 + i], m[8 + i], m[12 + i]
+    for (int i = 0; i < 3; i++) {
+        for (int c = 0; c < 4; c++) {
+            res->planes[i * 2 + 0][c] = m[c * 4 + 3] + m[c * 4 + i];
+            res->planes[i * 2 + 1][c] = m[c * 4 + 3] - m[c * 4 + i];
+        }
+    }
+}
+
+size_t cull_frustum(const cull_bounds_t& bounds, const frustum_t& frustum, uint8_t* visible) {
+    const auto padded = bounds.padded();
+
+#if defined(__SSE2__) || defined(_M_X64)
+    const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const auto zero     = _mm_setzero_ps();
+
+    __m128 planes[6][4], abs_planes[6][3];
+    for (int p = 0; p < 6; p++) {
+        for (int c = 0; c < 4; c++) {
+            planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+            if (c < 3)
+                abs_planes[p][c] = _mm_and_ps(planes[p][c], abs_mask);
+        }
+    }
+
+    for (size_t i = 0; i < padded; i += 4) {
+        const auto cx = _mm_loadu_ps(&bounds.center[0][i]), cy = _mm_loadu_ps(&bounds.center[1][i]), cz = _mm_loadu_ps(&bounds.center[2][i]);
+        const auto ex = _mm_loadu_ps(&bounds.extent[0][i]), ey = _mm_loadu_ps(&bounds.extent[1][i]), ez = _mm_loadu_ps(&bounds.extent[2][i]);
+
+        // outside once the corner furthest along a plane's normal is behind it
+        auto inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; p++) {
+            const auto d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], cx), _mm_mul_ps(planes[p][1], cy)), _mm_add_ps(_mm_mul_ps(planes[p][2], cz), planes[p][3]));
+            const auto r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abs_planes[p][0], ex), _mm_mul_ps(abs_planes[p][1], ey)), _mm_mul_ps(abs_planes[p][2], ez));
+            inside       = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+        }
+
+        const auto bits = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; lane++) {
+            visible[i + lane] = (bits >> lane) & 1;
+        }
+    }
+#else
+    for (size_t i = 0; i < padded; i++) {
+        auto inside = true;
+        for (int p = 0; p < 6 && inside; p++) {
+            const auto& plane = frustum.planes[p];
+
+            auto d = plane[3], r = 0.f;
+            for (int axis = 0; axis < 3; axis++) {
+                d += plane[axis] * bounds.center[axis][i];
+                r += std::abs(plane[axis]) * bounds.extent[axis][i];
+            }
+            inside = d + r >= 0.f;
+        }
+        visible[i] = inside;
+    }
+#endif
+
+    size_t count = 0;
+    for (size_t i = 0; i < bounds.count; i++) {
+        count += visible[i];
+    }
+    return count;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Boxes of every mesh, in the order of stk_map_t::models and their meshes.
+// SoA so they get tested 4 at a time, padded to a multiple of 4 with boxes that are never visible.
+struct cull_bounds_t {
+    std::vector<float> center[3];
+    std::vector<float> extent[3]; // half size
+    size_t             count = 0; // without the padding
+
+    size_t padded() const { return this->center[0].size(); }
+};
+
+// a*x + b*y + c*z + d >= 0 is inside, not normalized
+struct frustum_t {
+    float planes[6][4];
+};
+
+void cull_bounds_push(cull_bounds_t* bounds, const float mins[3], const float maxs[3]);
+// After the last push
+void cull_bounds_pad(cull_bounds_t* bounds);
+
+// Planes of a clip matrix, column major like glm and GL, with -w <= z <= w. Boxes are in the space it transforms from.
+void frustum_from_matrix(const float m[16], frustum_t* res);
+
+// visible gets 1 or 0 per box and needs bounds.padded() of them, returns how many of the real ones are visible
+size_t cull_frustum(const cull_bounds_t& bounds, const frustum_t& frustum, uint8_t* visible);
@@ -7,8 +7,8 @@ using __int64 = int64_t;
 #endif
 
 extern "C" {
-char decompress_rpak(__int64* a1, unsigned __int64 a2, unsigned __int64 a3);
+char decompress_rpak(__int64* a1, uint64_t a2, uint64_t a3);
 // next line has incorrect definition but who the fuck cares...
 __int64          get_decompressed_size(__int64 params, uint8_t* file_buf, __int64 some_magic_shit, __int64 file_size, __int64 off_without_header_qm, __int64 header_size);
-unsigned __int64 hash_string(unsigned int* a1);
+uint64_t         hash_string(unsigned int* a1);
 }
\ No newline at end of file
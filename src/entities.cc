@@ -0,0 +1,298 @@
+#include "entities.hh"
+
+#include "hash.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline uint32_t first_bit(uint64_t mask) {
+    unsigned long index;
+    if (_BitScanForward(&index, uint32_t(mask)))
+        return index;
+    _BitScanForward(&index, uint32_t(mask >> 32));
+    return index + 32;
+}
+#else
+static inline uint32_t first_bit(uint64_t mask) {
+    return __builtin_ctzll(mask);
+}
+#endif
+
+// --- scanning. Pairs are a few bytes apart so going one load per hop is slow, instead every '{', '}', '"' and NUL
+// of 64 bytes goes into a mask at once (16 at a time when we can) and the hops are bit scans.
+// The text is NUL terminated in the lump, the first NUL counts as the end.
+class entity_scanner_t {
+public:
+    entity_scanner_t(const char* begin, const char* end) : block(begin), end(end) { this->fill(); }
+
+    // Next '{', '}' or '"', end when there are none left
+    const char* next() {
+        while (!this->mask) {
+            if (this->end - this->block <= 64)
+                return this->end;
+            this->block += 64;
+            this->fill();
+        }
+
+        const auto p = this->block + first_bit(this->mask);
+        this->mask &= this->mask - 1;
+        if (!*p) {
+            this->block = this->end;
+            return this->end;
+        }
+        return p;
+    }
+
+    // Closing quote of a string, braces in it are just text
+    const char* next_quote() {
+        for (;;) {
+            const auto p = this->next();
+            if (p == this->end || *p == '"')
+                return p;
+        }
+    }
+
+private:
+    void fill() {
+        this->mask = 0;
+        const auto size = std::min<ptrdiff_t>(this->end - this->block, 64);
+        ptrdiff_t  i    = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        const auto open  = _mm_set1_epi8('{');
+        const auto close = _mm_set1_epi8('}');
+        const auto quote = _mm_set1_epi8('"');
+        const auto zero  = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(this->block + i));
+            const auto hits  = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, open), _mm_cmpeq_epi8(chunk, close)), _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, zero)));
+            this->mask |= uint64_t(uint32_t(_mm_movemask_epi8(hits))) << i;
+        }
+#endif
+        for (; i < size; i++) {
+            const auto c = this->block[i];
+            if (c == '{' || c == '}' || c == '"' || !c)
+                this->mask |= uint64_t(1) << i;
+        }
+    }
+
+    const char* block; // the 64 bytes mask is of
+    const char* end;
+    uint64_t    mask = 0; // bits of the ones next() hasn't handed out yet
+};
+
+bool EntitySet::parse(span<const char> text) {
+    const char*      end = text.data() + text.size();
+    entity_scanner_t scanner(text.data(), end);
+
+    // ~40 bytes a pair, saves regrowing kvs over and over
+    this->kvs.reserve(this->kvs.size() + text.size() / 40);
+
+    for (;;) {
+        const auto p = scanner.next();
+        if (p == end)
+            return true;
+        if (*p != '{') {
+            std::cerr << "Entities: expected '{' at " << (p - text.data()) << std::endl;
+            return false;
+        }
+
+        entity_t entity;
+        entity.first_kv = uint32_t(this->kvs.size());
+        entity.kvs_num  = 0;
+
+        // first one wins like in value()
+        const auto id             = uint32_t(this->entities.size());
+        bool       has_classname  = false;
+        bool       has_targetname = false;
+
+        // an entity that doesn't parse takes its kvs and refs with it, the next file's first entity gets the same id
+        const auto kvs_num         = this->kvs.size();
+        const auto classnames_num  = this->classnames.refs.size();
+        const auto targetnames_num = this->targetnames.refs.size();
+        const auto fail            = [&]() {
+            this->kvs.resize(kvs_num);
+            this->classnames.refs.resize(classnames_num);
+            this->targetnames.refs.resize(targetnames_num);
+            return false;
+        };
+
+        for (;;) {
+            const auto key_at = scanner.next();
+            if (key_at == end) {
+                std::cerr << "Entities: unterminated entity " << this->entities.size() << std::endl;
+                return fail();
+            }
+            if (*key_at == '}')
+                break;
+            if (*key_at != '"') {
+                std::cerr << "Entities: expected a key at " << (key_at - text.data()) << std::endl;
+                return fail();
+            }
+
+            // "key" then "value", anything between them is whitespace
+            const auto key_begin = key_at + 1;
+            const auto key_end   = scanner.next_quote();
+            const auto value_at  = key_end == end ? end : scanner.next();
+            if (value_at == end || *value_at != '"') {
+                std::cerr << "Entities: key without a value at " << (key_begin - text.data()) << std::endl;
+                return fail();
+            }
+            const auto value_begin = value_at + 1;
+            const auto value_end   = scanner.next_quote();
+            if (value_end == end) {
+                std::cerr << "Entities: unterminated value at " << (value_begin - text.data()) << std::endl;
+                return fail();
+            }
+
+            const entity_kv_t kv = {std::string_view(key_begin, key_end - key_begin), std::string_view(value_begin, value_end - value_begin)};
+            if (!has_classname && kv.key == "classname") {
+                has_classname = true;
+                if (!kv.value.empty())
+                    this->classnames.refs.push_back({kv.value, id, hash_bytes(kv.value.data(), kv.value.size())});
+            } else if (!has_targetname && kv.key == "targetname") {
+                has_targetname = true;
+                if (!kv.value.empty())
+                    this->targetnames.refs.push_back({kv.value, id, hash_bytes(kv.value.data(), kv.value.size())});
+            }
+
+            this->kvs.push_back(kv);
+            entity.kvs_num++;
+        }
+
+        this->entities.push_back(entity);
+    }
+}
+
+constexpr uint32_t ENTITY_NO_GROUP = ~uint32_t(0);
+
+const entity_index_t::group_t* entity_index_t::find(std::string_view value, uint64_t hash) const {
+    if (this->slots.empty())
+        return nullptr;
+
+    const auto mask = this->slots.size() - 1;
+    for (auto slot = size_t(hash) & mask;; slot = (slot + 1) & mask) {
+        const auto group = this->slots[slot];
+        if (group == ENTITY_NO_GROUP)
+            return nullptr;
+        if (this->groups[group].hash == hash && this->groups[group].value == value)
+            return &this->groups[group];
+    }
+}
+
+// Counting sort by value, refs come in entity order so they stay in it within a group
+static void group_index(entity_index_t* index) {
+    auto& refs   = index->refs;
+    auto& groups = index->groups;
+    auto& slots  = index->slots;
+
+    // at most half full
+    size_t slots_num = 16;
+    while (slots_num < refs.size() * 2)
+        slots_num *= 2;
+
+    groups.clear();
+    slots.assign(slots_num, ENTITY_NO_GROUP);
+
+    std::vector<uint32_t> ref_groups(refs.size());
+    for (size_t i = 0; i < refs.size(); i++) {
+        const auto value = refs[i].value;
+        const auto hash  = refs[i].hash;
+
+        auto slot = size_t(hash) & (slots_num - 1);
+        while (slots[slot] != ENTITY_NO_GROUP && (groups[slots[slot]].hash != hash || groups[slots[slot]].value != value))
+            slot = (slot + 1) & (slots_num - 1);
+        if (slots[slot] == ENTITY_NO_GROUP) {
+            slots[slot] = uint32_t(groups.size());
+            groups.push_back({value, hash, 0, 0});
+        }
+
+        ref_groups[i] = slots[slot];
+        groups[slots[slot]].count++;
+    }
+
+    uint32_t first = 0;
+    for (auto& group : groups) {
+        group.first = first;
+        first += group.count;
+        group.count = 0;
+    }
+
+    std::vector<entity_ref_t> grouped(refs.size());
+    for (size_t i = 0; i < refs.size(); i++) {
+        auto& group                          = groups[ref_groups[i]];
+        grouped[group.first + group.count++] = refs[i];
+    }
+    refs = std::move(grouped);
+}
+
+void EntitySet::build_indexes(JobPool* jobs) {
+    entity_index_t* indexes[] = {&this->classnames, &this->targetnames};
+    if (!jobs) {
+        for (auto index : indexes) {
+            group_index(index);
+        }
+        return;
+    }
+
+    jobs->parallel_for(std::size(indexes), 1, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; i++) {
+            group_index(indexes[i]);
+        }
+    });
+}
+
+span<const entity_kv_t> EntitySet::keyvalues(size_t entity) const {
+    const auto& ent = this->entities[entity];
+    return span<const entity_kv_t>{this->kvs.data() + ent.first_kv, ent.kvs_num};
+}
+
+std::string_view EntitySet::value(size_t entity, std::string_view key) const {
+    for (const auto& kv : this->keyvalues(entity)) {
+        if (kv.key == key)
+            return kv.value;
+    }
+    return {};
+}
+
+static span<const entity_ref_t> lookup(const entity_index_t& index, std::string_view value) {
+    const auto group = index.find(value, hash_bytes(value.data(), value.size()));
+    if (!group)
+        return {};
+    return span<const entity_ref_t>{index.refs.data() + group->first, group->count};
+}
+
+span<const entity_ref_t> EntitySet::by_classname(std::string_view classname) const {
+    return lookup(this->classnames, classname);
+}
+
+span<const entity_ref_t> EntitySet::by_targetname(std::string_view targetname) const {
+    return lookup(this->targetnames, targetname);
+}
+
+bool EntitySet::open(const std::string& bsp_path, JobPool* jobs) {
+    if (!this->bsp.open(bsp_path))
+        return false;
+
+    auto succ = this->parse(this->bsp.lump<LUMPS::ENTITIES>());
+
+    // mp_rr_canyonlands.bsp -> mp_rr_canyonlands_env.ent...
+    const auto stem = bsp_path.substr(0, bsp_path.rfind('.'));
+    for (const auto suffix : {"_env.ent", "_fx.ent", "_script.ent", "_snd.ent", "_spawn.ent"}) {
+        auto file = std::make_unique<mapped_file_t>();
+        if (!file->open(stem + suffix))
+            continue;
+
+        succ &= this->parse(span<const char>{reinterpret_cast<const char*>(file->data), file->size});
+        this->files.push_back(std::move(file));
+    }
+
+    this->build_indexes(jobs);
+    return succ;
+}
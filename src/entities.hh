@@ -0,0 +1,80 @@
+#pragma once
+
+#include "bsp.hh"
+#include "jobs.hh"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct entity_kv_t {
+    std::string_view key;
+    std::string_view value;
+};
+
+// Entry of the classname/targetname indexes
+struct entity_ref_t {
+    std::string_view value;
+    uint32_t         entity;
+    uint64_t         hash; // of value, taken while parse has the text in cache
+};
+
+struct entity_t {
+    uint32_t first_kv; // into EntitySet::keyvalues
+    uint32_t kvs_num;
+};
+
+// refs of one value are next to each other, in entity order
+struct entity_index_t {
+    struct group_t {
+        std::string_view value;
+        uint64_t         hash;
+        uint32_t         first; // into refs
+        uint32_t         count;
+    };
+
+    std::vector<entity_ref_t> refs;
+    std::vector<group_t>      groups;
+    std::vector<uint32_t>     slots; // open addressing into groups, power of two sized, ENTITY_NO_GROUP when free
+
+    const group_t* find(std::string_view value, uint64_t hash) const;
+};
+
+// Entities from the ENTITIES lump and the .ent files next to the BSP.
+// Everything is a view into the mapped files, which the set keeps open, so nothing gets allocated per key.
+// Text is the usual { "key" "value" ... } blocks, .ent files have an ENTITIES0x line in front that gets skipped.
+class EntitySet {
+public:
+    EntitySet() = default;
+
+    EntitySet(const EntitySet&) = delete;
+    EntitySet& operator=(const EntitySet&) = delete;
+
+    // ENTITIES lump of the BSP and <stem>_env/_fx/_script/_snd/_spawn.ent if they exist
+    bool open(const std::string& bsp_path, JobPool* jobs = nullptr);
+    // text has to outlive the set, classnames and targetnames get picked up on the way for the indexes
+    bool parse(span<const char> text);
+    // Has to be called after the last parse, lookups use the indexes. Groups what parse picked up,
+    // one hash lookup per entity and no sorting. The two indexes get built side by side on jobs if there is one.
+    void build_indexes(JobPool* jobs = nullptr);
+
+    size_t                   size() const { return this->entities.size(); }
+    const entity_t&          operator[](size_t i) const { return this->entities[i]; }
+    span<const entity_kv_t>  keyvalues(size_t entity) const;
+    std::string_view         value(size_t entity, std::string_view key) const; // empty if there's no such key
+    span<const entity_ref_t> by_classname(std::string_view classname) const;
+    span<const entity_ref_t> by_targetname(std::string_view targetname) const;
+
+    size_t keyvalues_num() const { return this->kvs.size(); }
+
+private:
+    std::vector<entity_kv_t> kvs;
+    std::vector<entity_t>    entities;
+
+    entity_index_t classnames;
+    entity_index_t targetnames;
+
+    BspFile                                     bsp;
+    std::vector<std::unique_ptr<mapped_file_t>> files;
+};
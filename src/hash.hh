@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Not cryptographic, just fast and good enough to tell pages/files apart.
+// Chews 8 bytes at a time, mixing is the usual multiply-xorshift.
+
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 32;
+    x *= 0xD6E8FEB86659FD93ull;
+    x ^= x >> 32;
+    x *= 0xD6E8FEB86659FD93ull;
+    x ^= x >> 32;
+    return x;
+}
+
+static inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0) {
+    auto     ptr = reinterpret_cast<const uint8_t*>(data);
+    uint64_t h   = seed ^ (size * 0x9E3779B97F4A7C15ull);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, ptr + i, 8);
+        h = hash_mix(h ^ v) + 0x9E3779B97F4A7C15ull;
+    }
+    if (i < size) {
+        uint64_t v = 0;
+        memcpy(&v, ptr + i, size - i);
+        h = hash_mix(h ^ v);
+    }
+
+    return hash_mix(h);
+}
+
+struct hash128_t {
+    uint64_t lo;
+    uint64_t hi;
+
+    bool operator==(const hash128_t& o) const { return lo == o.lo && hi == o.hi; }
+};
+
+static inline hash128_t hash_bytes128(const void* data, size_t size) {
+    return {hash_bytes(data, size, 0x243F6A8885A308D3ull), hash_bytes(data, size, 0x13198A2E03707344ull)};
+}
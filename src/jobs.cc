@@ -0,0 +1,166 @@
+#include "jobs.hh"
+
+#include <algorithm>
+#include <iomanip>
+
+JobPool::JobPool(size_t threads) {
+    for (size_t i = 0; i < threads; i++) {
+        this->workers.emplace_back(&JobPool::worker, this);
+    }
+}
+
+JobPool::~JobPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stop = true;
+    }
+    this->cv.notify_all();
+    for (auto& worker : this->workers) {
+        worker.join();
+    }
+}
+
+void JobPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.push_back(std::move(job));
+    }
+    this->cv.notify_one();
+}
+
+bool JobPool::help() {
+    std::function<void()> job;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->queue.empty())
+            return false;
+        job = std::move(this->queue.front());
+        this->queue.pop_front();
+    }
+    job();
+    return true;
+}
+
+void JobPool::parallel_for(size_t count, size_t chunk_size, const std::function<void(size_t, size_t)>& fn) {
+    if (!count)
+        return;
+    chunk_size = std::max<size_t>(chunk_size, 1);
+
+    const size_t        chunks = (count + chunk_size - 1) / chunk_size;
+    std::atomic<size_t> left(chunks);
+
+    // first chunk is ours
+    for (size_t i = 1; i < chunks; i++) {
+        this->submit([&, i]() {
+            fn(i * chunk_size, std::min(count, (i + 1) * chunk_size));
+            left--;
+        });
+    }
+    fn(0, std::min(count, chunk_size));
+    left--;
+
+    while (left) {
+        if (!this->help())
+            std::this_thread::yield();
+    }
+}
+
+void JobPool::worker() {
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.wait(lock, [this]() { return this->stop || !this->queue.empty(); });
+            if (this->stop && this->queue.empty())
+                return;
+            job = std::move(this->queue.front());
+            this->queue.pop_front();
+        }
+        job();
+    }
+}
+
+TaskGraph::task_id TaskGraph::add(const std::string& name, std::function<void()> fn, const std::vector<task_id>& deps) {
+    const auto id = this->tasks.size();
+
+    auto& task    = this->tasks.emplace_back();
+    task.name     = name;
+    task.fn       = std::move(fn);
+    task.deps_num = deps.size();
+
+    for (const auto dep : deps) {
+        this->tasks[dep].dependents.push_back(id);
+    }
+
+    return id;
+}
+
+void TaskGraph::submit(JobPool& pool, task_id id) {
+    pool.submit([this, &pool, id]() {
+        auto& task = this->tasks[id];
+
+        const auto begin = std::chrono::steady_clock::now();
+        task.fn();
+        const auto end = std::chrono::steady_clock::now();
+
+        task.start_ms    = std::chrono::duration<double, std::milli>(begin - this->start).count();
+        task.duration_ms = std::chrono::duration<double, std::milli>(end - begin).count();
+
+        for (const auto dependent : task.dependents) {
+            if (--this->tasks[dependent].deps_left == 0)
+                this->submit(pool, dependent);
+        }
+        if (this->finished)
+            (*this->finished)++;
+
+        // under the lock so run() can't return while we still touch the graph
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (--this->tasks_left == 0)
+            this->cv.notify_all();
+    });
+}
+
+void TaskGraph::run(JobPool& pool, std::atomic<size_t>* finished) {
+    if (this->tasks.empty())
+        return;
+
+    this->finished   = finished;
+    this->start      = std::chrono::steady_clock::now();
+    this->tasks_left = this->tasks.size();
+    for (auto& task : this->tasks) {
+        task.deps_left = task.deps_num;
+    }
+
+    for (task_id id = 0; id < this->tasks.size(); id++) {
+        if (!this->tasks[id].deps_num)
+            this->submit(pool, id);
+    }
+
+    // help out instead of sleeping, we might be one of the workers ourselves
+    while (this->tasks_left) {
+        if (!pool.help()) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.wait_for(lock, std::chrono::milliseconds(1), [this]() { return this->tasks_left == 0; });
+        }
+    }
+
+    // last task might still be holding it
+    std::lock_guard<std::mutex> lock(this->mutex);
+}
+
+void TaskGraph::print_timings(std::ostream& out) const {
+    std::vector<const task_t*> sorted;
+    for (const auto& task : this->tasks) {
+        sorted.push_back(&task);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const task_t* a, const task_t* b) { return a->start_ms < b->start_ms; });
+
+    double total = 0.0;
+    for (const auto task : sorted) {
+        out << std::setw(24) << std::left << task->name << std::right << " start " << std::setw(9) << std::fixed << std::setprecision(2) << task->start_ms
+            << "ms took " << std::setw(9) << task->duration_ms << "ms" << std::endl;
+        total = std::max(total, task->start_ms + task->duration_ms);
+    }
+    out << "Total: " << total << "ms" << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Dumb worker pool, nothing fancy. Whoever waits on something helps out with the queue
+// so jobs can wait on other jobs without deadlocking the pool.
+class JobPool {
+public:
+    // threads can be 0, jobs then only run on whoever waits on them or calls help()
+    JobPool(size_t threads = std::max(1u, std::thread::hardware_concurrency()));
+    ~JobPool();
+
+    JobPool(const JobPool&) = delete;
+    JobPool& operator=(const JobPool&) = delete;
+
+    size_t threads() const { return this->workers.size(); }
+
+    void submit(std::function<void()> job);
+
+    // fn(begin, end) over [0, count) in chunks of chunk_size, returns when all of them are done
+    void parallel_for(size_t count, size_t chunk_size, const std::function<void(size_t, size_t)>& fn);
+
+    // Runs one queued job on the calling thread, false if there was nothing to do
+    bool help();
+
+private:
+    void worker();
+
+    std::vector<std::thread>          workers;
+    std::deque<std::function<void()>> queue;
+    std::mutex                        mutex;
+    std::condition_variable           cv;
+    bool                              stop = false;
+};
+
+// Tasks with dependencies, every task gets submitted to the pool as soon as everything it needs is done.
+class TaskGraph {
+public:
+    using task_id = size_t;
+
+    task_id add(const std::string& name, std::function<void()> fn, const std::vector<task_id>& deps = {});
+
+    size_t size() const { return this->tasks.size(); }
+
+    // Blocks until everything ran, finished gets bumped after every task if not null
+    void run(JobPool& pool, std::atomic<size_t>* finished = nullptr);
+
+    // name, start and duration in ms relative to run()
+    void print_timings(std::ostream& out) const;
+
+private:
+    struct task_t {
+        std::string           name;
+        std::function<void()> fn;
+        std::vector<task_id>  dependents;
+        size_t                deps_num = 0;
+
+        std::atomic<size_t> deps_left;
+
+        double start_ms    = 0.0;
+        double duration_ms = 0.0;
+    };
+
+    void submit(JobPool& pool, task_id id);
+
+    std::deque<task_t> tasks; // deque since atomics don't move
+
+    std::chrono::steady_clock::time_point start;
+    std::atomic<size_t>                   tasks_left;
+    std::atomic<size_t>*                  finished = nullptr;
+    std::mutex                            mutex;
+    std::condition_variable               cv;
+};
@@ -18,14 +18,32 @@
 #include <glm/mat4x4.hpp> // glm::mat4
 
 #include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <iomanip>
+#include <limits>
 #include <locale>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "bsp.hh"
 #include "decomp.hh"
+#include "entities.hh"
+#include "jobs.hh"
+#include "map.hh"
+#include "map_cache.hh"
+#include "meshlet.hh"
+#include "occlusion.hh"
+#include "page_store.hh"
+#include "props.hh"
+#include "raster.hh"
+#include "raycast.hh"
 #include "rpak.hh"
+#include "stream.hh"
+#include "rpak_tool.hh"
 
 constexpr int DEFAULT_W = 1280;
 constexpr int DEFAULT_H = 720;
@@ -35,529 +53,496 @@ struct pipeline_t {
     GLuint pipeline;
 };
 
-// dac wasn't used because this game is based on indicies
-// struct dac_t final {
-//     uint32_t vertices;
-//     uint32_t instances = 1; // I never set this...
-//     uint32_t base_vertex;
-//     uint32_t base_instance = 0; // I never set this...
-// };
-
-struct dec_t final {
-    uint32_t indices; // count
-    uint32_t instances = 1; // I never set this...
-    uint32_t base_index;
-    uint32_t base_vertex;
-    uint32_t base_instance = 0; // I never set this...
-};
-
-#pragma pack(push, 1)
-enum class LUMPS : uint32_t {
-    TEXTURE_DATA  = 0x2,
-    MODELS        = 0xE,
-    SURFACE_NAMES = 0xF,
-
-    MESHES        = 0x50,
-    MATERIAL_SORT = 0x52,
-
-    VERTEX         = 0x3,
-    VERTEX_NORMALS = 0x1E,
-    PACKED_VERTEX  = 0x14,
-    MESH_INDICIES  = 0x4F,
-
-    VERTEX_BLINN_PHONG = 0x4B,
-    VERTEX_LIT_BUMP    = 0x49,
-    VERTEX_LIT_FLAT    = 0x48,
-    VERTEX_UNLIT       = 0x47,
-    VERTEX_UNLIT_TS    = 0x4A,
-};
-
-enum class VERTEX_FLAGS : uint32_t {
-    // Flags for future colour rendering???
-    SKY_2D  = 0x00002,
-    SKY     = 0x00004,
-    TRIGGER = 0x40000,
-
-    VERTEX_LIT_FLAT = 0x000,
-    VERTEX_LIT_BUMP = 0x200,
-    VERTEX_UNLIT    = 0x400,
-    VERTEX_UNLIT_TS = 0x600,
-
-    MASK = 0x600,
-};
-
-struct lump_t final {
-    uint32_t offset;
-    uint32_t size;
-    uint32_t version;
-    uint32_t cc;
-};
-
-struct bsp_header_t final {
-    uint32_t header; // 0x50534272
-    uint32_t version; // 47-50?
-    uint32_t map_version;
-    uint32_t unkC; // 0x7F
-    lump_t   lumps[0x7F];
-};
-
-// 0x2
-struct texture_data_t final {
-    uint32_t name_index;
-    uint32_t texture_width;
-    uint32_t texture_height;
-    uint32_t flags;
-};
-
-// 0x3
-union vertex_t final {
-    struct {
-        float x;
-        float y;
-        float z;
-    };
-    float coords[3];
-};
-
-// 0x14
-union packed_vertex_t final {
-    struct {
-        int16_t x;
-        int16_t y;
-        int16_t z;
-    };
-    int16_t coords[3];
-};
-
-// 0x50
-struct mesh_t final {
-    uint32_t first_mesh_index;
-    uint16_t num_triangles;
-
-    uint16_t _pad; // ???
-
-    int32_t unk[3];
-    int16_t unk1;
-
-    uint16_t material_sort;
-    uint32_t flags;
-};
-static_assert(sizeof(mesh_t) == 28);
-
-using mesh_index = uint16_t;
+struct {
+    RPak*                common = nullptr;
+    std::vector<uint8_t> common_data;
 
-// 0xE
-struct model_t final {
-    float mins[3];
-    float maxs[3];
+    RPak*                common_mp = nullptr;
+    std::vector<uint8_t> common_mp_data;
 
-    uint32_t first_mesh;
-    uint32_t num_meshes;
+    RPak*                common_early = nullptr;
+    std::vector<uint8_t> common_early_data;
 
-    int32_t unk[8];
-};
+    RPak*                map = nullptr;
+    std::vector<uint8_t> map_data;
 
-struct material_sort_t final {
-    uint16_t texture_data;
-    uint16_t lightmap_idx;
+    // patch paks mounted over the common ones, kept alive here
+    std::vector<RPak*>                patches;
+    std::vector<std::vector<uint8_t>> patches_data;
 
-    uint16_t unk[2];
+    // and over map, they go when it does
+    std::vector<RPak*>                map_patches;
+    std::vector<std::vector<uint8_t>> map_patches_data;
 
-    uint32_t vertex_offset;
-};
-static_assert(sizeof(material_sort_t) == 12);
+    PageStore* store = nullptr; // --page-store
 
-// --- Vertex lumps, I render them all as one lmfao
-// TODO: seperate shaders for different types? maybe colours for now?
+    GLuint sampler;
+    GLuint error_texture;
+} rpaks;
 
-// 0x4B
-struct vertex_blinn_phong_t final {
-    uint32_t pos_index;
-    uint32_t nrm_index;
-    float    uv[2];
-    float    uv2[2];
-};
-static_assert(sizeof(vertex_blinn_phong_t) == 24);
+// Resolves a surface name through the loaded rpaks and uploads whatever mip is stored in the rpak itself
+void load_texture(stk_map_t& stk_map, const std::string& surface_name) {
+    if (stk_map.textures.find(surface_name) != stk_map.textures.end())
+        return;
+
+    bool found = false;
+    auto elem  = rpaks.common_early->materials.find(surface_name);
+    auto rpak  = rpaks.common_early;
+    if (rpaks.common_early && (elem != rpaks.common_early->materials.end())) {
+        found = true;
+        std::cout << "COMMON EARLY ";
+    } else if (rpaks.common && ((elem = rpaks.common->materials.find(surface_name)) != rpaks.common->materials.end())) {
+        found = true;
+        rpak  = rpaks.common;
+        std::cout << "COMMON ";
+    } else if (rpaks.common_mp && ((elem = rpaks.common_mp->materials.find(surface_name)) != rpaks.common_mp->materials.end())) {
+        found = true;
+        rpak  = rpaks.common_mp;
+        std::cout << "COMMON MP ";
+    } else if (rpaks.map && ((elem = rpaks.map->materials.find(surface_name)) != rpaks.map->materials.end())) {
+        found = true;
+        rpak  = rpaks.map;
+        std::cout << "MAP ";
+    }
+    std::cout << surface_name << ' '; // << std::endl;
+
+    if (found) {
+        auto guids  = elem->second ? *(uint64_t**)(uintptr_t(elem->second) + 0x60) : nullptr;
+        auto albedo = guids ? guids[0] : 0;
+        if (!albedo) {
+            std::cout << guids ? "NO_ALBEDO " : "FUCK ";
+        } else if (rpak->files.find(albedo) != rpak->files.end()) {
+            const auto& file          = rpak->files[albedo];
+            auto        txtr          = (txtr_t*)file.description.ptr;
+            auto        data          = file.data.ptr;
+            auto        total_mipmaps = +txtr->rpak_mipmaps_num + txtr->starpak_opt_mipmaps_num + txtr->starpak_mipmaps_num; // - 1; // mb -1, mb not?
+
+            auto rpak_width  = std::max(txtr->width >> total_mipmaps, 4);
+            auto rpak_height = std::max(txtr->height >> total_mipmaps, 4);
+            std::cout << txtr->texture_type << ' ' << txtr->width << 'x' << txtr->height << ' ' << rpak_width << 'x' << rpak_height << ' ' << total_mipmaps << ' ';
+            std::cout << ' ' << +txtr->starpak_opt_mipmaps_num << ' ' << +txtr->starpak_mipmaps_num << ' ' << +txtr->rpak_mipmaps_num << ' ';
+
+            GLsizei rhsz = 0;
+
+            auto   format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            size_t v14    = 4; // block w
+            size_t v16    = 4; // block h
+            size_t v15    = 8; // block size?
+            switch (txtr->texture_type) {
+            case 1: {
+                format   = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+                auto rwb = (rpak_width + 3) / 4;
+                auto rhb = (rpak_height + 3) / 4;
+                rhsz     = (rwb * rhb) * 8ull;
+            } break;
+            case 13: {
+                format   = GL_COMPRESSED_RGBA_BPTC_UNORM;
+                auto rwb = (rpak_width + 3) / 4;
+                auto rhb = (rpak_height + 3) / 4;
+                rhsz     = (rwb * rhb) * 16ull;
+                v15      = 16ull;
+            } break;
+            default:
+                std::cout << " UNK" << +txtr->texture_type << ' ';
+                break;
+            }
+            const auto unk1e = txtr->layers_count ? txtr->layers_count : 1;
+            for (long long i = total_mipmaps; i > (total_mipmaps - txtr->rpak_mipmaps_num); i--) {
+                const auto v17 = ((txtr->width >> i) > 1) ? (txtr->width >> i) : 1;
+                const auto v22 = ((txtr->height >> i) > 1) ? (txtr->height >> i) : 1;
+
+                const auto v21 = (v14 + v17 - 1) / v14;
+                const auto v23 = v21 * ((v16 + v22 - 1) / v16);
+                const auto v25 = v15 * v23;
+
+                const auto sizee     = ((v25 + 15) & 0xFFFFFFF0);
+                const auto skip_size = unk1e * sizee;
+                data += skip_size;
+
+                rpak_width  = v17;
+                rpak_height = v22;
+                rhsz        = sizee;
+            }
+            std::cout << ' ' << rpak_width << 'x' << rpak_height << ' ';
+
+            GLuint gl_texture = 0;
+            glCreateTextures(GL_TEXTURE_2D, 1, &gl_texture);
+            glTextureStorage2D(gl_texture, 5, format, rpak_width, rpak_height);
+            glCompressedTextureSubImage2D(gl_texture, 0, 0, 0, rpak_width, rpak_height, format, rhsz, data);
+            glGenerateTextureMipmap(gl_texture);
+
+            texture_t texture;
+            texture.material_name          = surface_name;
+            texture.texture                = gl_texture;
+            stk_map.textures[surface_name] = std::move(texture);
+        } else {
+            std::cout << "FUCK_FILE " << std::hex << albedo << std::dec << ' ';
+        }
+    }
 
-// 0x49
-struct vertex_lit_bump_t final {
-    uint32_t pos_index;
-    uint32_t nrm_index;
-    float    uv[2];
+    std::cout << std::endl; // it has flush but who cares about speed
+}
 
-    int32_t unused;
+// Per frame caps while a map is being uploaded, the rest of the frame still has to happen
+constexpr size_t UPLOAD_BYTES_PER_FRAME    = 32 * 1024 * 1024;
+constexpr size_t UPLOAD_TEXTURES_PER_FRAME = 8;
+
+// GL side of load_map spread over frames. Buffers are created empty and filled a slice per frame,
+// a model becomes drawable as soon as the parts of the buffers its level 0 uses are in and switches LODs once theirs are,
+// textures trickle in last.
+struct map_upload_t {
+    struct buffer_t {
+        GLuint      buffer;
+        const void* data;
+        size_t      size;
+        size_t      done = 0;
+    };
+    std::vector<buffer_t> buffers; // in upload order
 
-    float unk[3];
-};
-static_assert(sizeof(vertex_lit_bump_t) == 32);
+    size_t bytes_total    = 0;
+    size_t bytes_done     = 0;
+    size_t models_done    = 0;
+    size_t materials_done = 0;
 
-// 0x48
-struct vertex_lit_flat_t final {
-    uint32_t pos_index;
-    uint32_t nrm_index;
-    float    uv[2];
+    // the map's rpak gets swapped in after the geometry is handed over, textures wait for it
+    bool paks_mounted = false;
 
-    int32_t unk;
-};
-static_assert(sizeof(vertex_lit_flat_t) == 20);
-
-// 0x47
-// struct vertex_unlit final {
-//     uint32_t pos_index;
-//     uint32_t nrm_index;
-//     float    uv[2];
-// }
-typedef vertex_lit_flat_t vertex_unlit_t;
-static_assert(sizeof(vertex_unlit_t) == 20);
-
-// 0x4A
-struct vertex_unlit_ts_t final {
-    uint32_t pos_index;
-    uint32_t nrm_index;
-    float    uv[2];
-
-    uint64_t unk; // 8 bytes
-};
-static_assert(sizeof(vertex_unlit_ts_t) == 24);
-#pragma pack(pop)
-
-struct mesh_parsed_t {
-    dec_t        dec; // move to implement MDI?
-    GLuint       dec_buf; // buffer associated with the dec
-    VERTEX_FLAGS flag;
-    GLuint       texture;
-    bool         textured = false;
-    bool         draw     = true;
+    bool active = false;
 };
 
-struct model_parsed_t {
-    std::vector<mesh_parsed_t> meshes;
-};
+// Attributes of the non pulling vertex modes, reading from buffer
+static void map_vertex_format(stk_map_t& map, GLuint buffer) {
+    if (map.vertex_mode == VERTEX_MODE::COMPACT) {
+        glVertexArrayVertexBuffer(map.gl_vertex_array, 0, buffer, 0, sizeof(stk_vertex_compact_t));
+
+        // layout(location = 0) in vec3 vertPos;
+        glEnableVertexArrayAttrib(map.gl_vertex_array, 0);
+        glVertexArrayAttribFormat(map.gl_vertex_array, 0, 3, GL_UNSIGNED_SHORT, GL_FALSE, offsetof(stk_vertex_compact_t, pos));
+        glVertexArrayAttribBinding(map.gl_vertex_array, 0, 0);
+        // layout(location = 1) in vec2 vertOct;
+        glEnableVertexArrayAttrib(map.gl_vertex_array, 1);
+        glVertexArrayAttribFormat(map.gl_vertex_array, 1, 2, GL_SHORT, GL_TRUE, offsetof(stk_vertex_compact_t, normal));
+        glVertexArrayAttribBinding(map.gl_vertex_array, 1, 0);
+
+        // layout(location = 3) in vec2 vertUV;
+        glEnableVertexArrayAttrib(map.gl_vertex_array, 3);
+        glVertexArrayAttribFormat(map.gl_vertex_array, 3, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(stk_vertex_compact_t, uv));
+        glVertexArrayAttribBinding(map.gl_vertex_array, 3, 0);
+        return;
+    }
 
-struct stk_vertex_t {
-    vertex_t pos;
-    vertex_t normal;
-    float    uv[2];
-    // bool     texture = false;
-};
+    glVertexArrayVertexBuffer(map.gl_vertex_array, 0, buffer, 0, sizeof(stk_vertex_t));
+
+    // layout(location = 0) in vec3 vertPos;
+    glEnableVertexArrayAttrib(map.gl_vertex_array, 0);
+    glVertexArrayAttribFormat(map.gl_vertex_array, 0, 3, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, pos));
+    glVertexArrayAttribBinding(map.gl_vertex_array, 0, 0);
+    // layout(location = 1) in vec3 vertNorm;
+    glEnableVertexArrayAttrib(map.gl_vertex_array, 1);
+    glVertexArrayAttribFormat(map.gl_vertex_array, 1, 3, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, normal));
+    glVertexArrayAttribBinding(map.gl_vertex_array, 1, 0);
+
+    // layout(location = 3) in vec2 vertUV;
+    glEnableVertexArrayAttrib(map.gl_vertex_array, 3);
+    glVertexArrayAttribFormat(map.gl_vertex_array, 3, 2, GL_FLOAT, GL_TRUE, offsetof(stk_vertex_t, uv));
+    glVertexArrayAttribBinding(map.gl_vertex_array, 3, 0);
+}
 
-struct texture_t {
-    std::string material_name;
-    GLuint      texture;
-};
+// has to run on the thread with the context
+// streamed - geometry comes from stream_map_begin, only the textures are left for this
+void upload_map_begin(stk_map_t& map, map_upload_t* upload, bool streamed = false) {
+    *upload        = {};
+    upload->active = true;
+    if (streamed)
+        return;
+
+    // zero sized storage isn't allowed and binding it wouldn't be either
+    auto create_storage = [&](GLuint* buffer, const void* data, size_t size) {
+        glCreateBuffers(1, buffer);
+        glNamedBufferStorage(*buffer, static_cast<GLsizeiptr>(std::max<size_t>(size, 4)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        upload->buffers.push_back({*buffer, data, size});
+        upload->bytes_total += size;
+    };
 
-struct stk_map_t {
-    GLuint gl_vertex_array;
+    // indices first, they're small and every model needs them
+    create_storage(&map.index_buffer, map.index_vec.data(), map.index_vec.size() * sizeof(uint16_t));
 
-    GLuint                index_buffer;
-    std::vector<uint32_t> index_vec;
+    glCreateVertexArrays(1, &map.gl_vertex_array);
+    glVertexArrayElementBuffer(map.gl_vertex_array, map.index_buffer);
 
-    GLuint                    vertex_buffer;
-    std::vector<stk_vertex_t> vertex_vec;
+    if (map.vertex_mode == VERTEX_MODE::PULLING) {
+        // no attributes, the shader reads these as SSBOs
+        create_storage(&map.positions_buffer, map.positions.data(), map.positions.size() * sizeof(vertex_t));
+        create_storage(&map.normals_buffer, map.normals.data(), map.normals.size() * sizeof(vertex_t));
+        for (size_t i = 0; i < size_t(VERTEX_LUMP::COUNT); i++) {
+            create_storage(&map.vertex_lump_buffers[i], map.vertex_lumps[i].data(), map.vertex_lumps[i].size() * sizeof(uint32_t));
+        }
+        return;
+    }
 
-    std::vector<model_parsed_t> models;
+    if (map.vertex_mode == VERTEX_MODE::COMPACT)
+        create_storage(&map.vertex_buffer, map.compact_vec.data(), map.compact_vec.size() * sizeof(stk_vertex_compact_t));
+    else
+        create_storage(&map.vertex_buffer, map.vertex_vec.data(), map.vertex_vec.size() * sizeof(stk_vertex_t));
+    map_vertex_format(map, map.vertex_buffer);
+}
 
-    std::unordered_map<std::string, texture_t> textures;
+// GL side of stream.hh, the geometry lives in one buffer of gpu_budget bytes and only the cells around the camera are in it,
+// the CPU copy of the map stays whole
+struct map_stream_t {
+    stream_grid_t                    grid;
+    std::unique_ptr<StreamResidency> residency;
+    GLuint                           arena = 0;
+    std::vector<stream_op_t>         ops;
+    std::vector<uint8_t>             block;
 
-    bool loaded = false;
+    bool active = false;
 };
 
-struct {
-    RPak*                common = nullptr;
-    std::vector<uint8_t> common_data;
-
-    RPak*                common_mp = nullptr;
-    std::vector<uint8_t> common_mp_data;
+// Instead of the vertex and index buffers of upload_map_begin, which still has to run (streamed) for the textures
+void stream_map_begin(stk_map_t& map, map_stream_t& stream, size_t gpu_budget) {
+    stream.residency = std::make_unique<StreamResidency>(stream.grid, gpu_budget);
+    stream.active    = true;
 
-    RPak*                common_early = nullptr;
-    std::vector<uint8_t> common_early_data;
+    glCreateBuffers(1, &stream.arena);
+    glNamedBufferStorage(stream.arena, static_cast<GLsizeiptr>(std::max<size_t>(gpu_budget, 4)), nullptr, GL_DYNAMIC_STORAGE_BIT);
 
-    RPak*                map = nullptr;
-    std::vector<uint8_t> map_data;
+    glCreateVertexArrays(1, &map.gl_vertex_array);
+    glVertexArrayElementBuffer(map.gl_vertex_array, stream.arena);
+    map_vertex_format(map, stream.arena);
 
-    GLuint sampler;
-    GLuint error_texture;
-} rpaks;
+    // every level's command gets patched in when the cell comes in
+    for (auto& model : map.models) {
+        for (auto& mp : model.meshes) {
+            glCreateBuffers(1, &mp.dec_buf);
+            glNamedBufferStorage(mp.dec_buf, static_cast<GLsizeiptr>(sizeof(dec_t) * MAP_LODS), nullptr, GL_DYNAMIC_STORAGE_BIT);
+            mp.resident = false;
+        }
+        model.drawable      = true;
+        model.lods_drawable = true;
+    }
+}
 
-template <typename T>
-inline std::vector<T> read_lump(std::ifstream& file, bsp_header_t& header, LUMPS lump) {
-    const auto seekdir = std::ios_base::_Seekdir::_Seekbeg;
+// Evictions and loads for where the camera is, capped like the rest of the uploads
+void stream_map_step(stk_map_t& map, map_stream_t& stream, const float camera[3]) {
+    if (!stream.active)
+        return;
+
+    stream.residency->update(camera, UPLOAD_BYTES_PER_FRAME, &stream.ops);
+    for (const auto& op : stream.ops) {
+        const auto& cell = stream.grid.cells[op.cell];
+        if (op.load) {
+            stream.block.resize(cell.bytes());
+            stream_cell_block(map, stream.grid, op.cell, stream.block.data());
+            glNamedBufferSubData(stream.arena, static_cast<GLintptr>(op.offset), static_cast<GLsizeiptr>(cell.bytes()), stream.block.data());
+        }
 
-    std::vector<T> ret(header.lumps[(size_t)lump].size / sizeof(T));
-    file.seekg(header.lumps[(size_t)lump].offset, seekdir);
-    file.read((char*)ret.data(), ret.size() * sizeof(T));
+        for (uint32_t m = 0; m < cell.meshes_num; m++) {
+            const auto& sm = stream.grid.meshes[cell.first_mesh + m];
+            auto&       mp = map.models[sm.model].meshes[sm.mesh];
+            mp.resident    = op.load;
+            if (!op.load)
+                continue;
 
-    return ret;
+            dec_t decs[MAP_LODS];
+            for (uint32_t level = 0; level < MAP_LODS; level++) {
+                decs[level] = stream_mesh_dec(stream.grid, sm, level, op.offset);
+            }
+            glNamedBufferSubData(mp.dec_buf, 0, static_cast<GLsizeiptr>(sizeof(decs)), decs);
+        }
+    }
 }
 
-std::pair<bool, stk_map_t> load_map(std::ifstream& file) {
-    bsp_header_t header;
-    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+void free_stream(map_stream_t& stream) {
+    if (stream.arena)
+        glDeleteBuffers(1, &stream.arena);
+    stream = {};
+}
 
-    auto texture_data  = read_lump<texture_data_t>(file, header, LUMPS::TEXTURE_DATA);
-    auto surface_names = read_lump<char>(file, header, LUMPS::SURFACE_NAMES);
+// One frame worth of uploading, false once everything is in
+bool upload_map_step(stk_map_t& map, map_upload_t& upload) {
+    if (!upload.active)
+        return false;
 
-    auto models = read_lump<model_t>(file, header, LUMPS::MODELS);
-    // for (const auto& model : models) {
-    //     std::printf("model %d [%d]\n", model.first_mesh, model.num_meshes);
-    // }
-    auto meshes = read_lump<mesh_t>(file, header, LUMPS::MESHES);
-    // for (const auto& mesh : meshes) {
-    //     std::printf("mesh %d [%d] %X\n", mesh.first_mesh_index, mesh.num_triangles, mesh.flags & 0x600);
-    // }
-    auto material_sorts = read_lump<material_sort_t>(file, header, LUMPS::MATERIAL_SORT);
-
-    auto mesh_indicies = read_lump<mesh_index>(file, header, LUMPS::MESH_INDICIES);
-
-    auto vertex_unlit    = read_lump<vertex_unlit_t>(file, header, LUMPS::VERTEX_UNLIT);
-    auto vertex_lit_flat = read_lump<vertex_lit_flat_t>(file, header, LUMPS::VERTEX_LIT_FLAT);
-    auto vertex_lit_bump = read_lump<vertex_lit_bump_t>(file, header, LUMPS::VERTEX_LIT_BUMP);
-    auto vertex_unlit_ts = read_lump<vertex_unlit_ts_t>(file, header, LUMPS::VERTEX_UNLIT_TS);
-    //auto vertex_blinn_phong = read_lump<vertex_unlit_t>(file, header, LUMPS::VERTEX_BLINN_PHONG); // unused???
-
-    auto vertex         = read_lump<vertex_t>(file, header, LUMPS::VERTEX);
-    auto vertex_normals = read_lump<vertex_t>(file, header, LUMPS::VERTEX_NORMALS);
-
-    // combine into one buffer???
-    // Start is needed when converting into big buffer indicies?
-    size_t vertex_unlit_start    = 0;
-    auto   vertex_lit_flat_start = vertex_unlit_start + vertex_unlit.size();
-    auto   vertex_lit_bump_start = vertex_lit_flat_start + vertex_lit_flat.size();
-    auto   vertex_unlit_ts_start = vertex_lit_bump_start + vertex_lit_bump.size();
-    auto   total_size            = vertex_unlit_ts_start + vertex_unlit_ts.size();
-    std::printf("[%llu]: %llu %llu %llu %llu\n", total_size, vertex_unlit_start, vertex_lit_flat_start, vertex_lit_bump_start, vertex_unlit_ts_start);
-
-    // I feel like packin' today...
-    // Wait I can't pack... or can I???
-    // This is legit dumb...
-    std::vector<stk_vertex_t> vertex_big(total_size);
-    for (size_t i = 0; i < vertex_unlit.size(); i++) {
-        const auto&  vert = vertex_unlit[i];
-        stk_vertex_t tmp_unlit;
-        tmp_unlit.pos                      = vertex[vert.pos_index];
-        tmp_unlit.normal                   = vertex_normals[vert.nrm_index];
-        tmp_unlit.uv[0]                    = vert.uv[0];
-        tmp_unlit.uv[2]                    = vert.uv[1];
-        vertex_big[vertex_unlit_start + i] = tmp_unlit;
-    }
-    for (size_t i = 0; i < vertex_lit_flat.size(); i++) {
-        const auto&  vert = vertex_lit_flat[i];
-        stk_vertex_t tmp_lit_flat;
-        tmp_lit_flat.pos                      = vertex[vert.pos_index];
-        tmp_lit_flat.normal                   = vertex_normals[vert.nrm_index];
-        tmp_lit_flat.uv[0]                    = vert.uv[0];
-        tmp_lit_flat.uv[2]                    = vert.uv[1];
-        vertex_big[vertex_lit_flat_start + i] = tmp_lit_flat;
-    }
-    for (size_t i = 0; i < vertex_lit_bump.size(); i++) {
-        const auto&  vert = vertex_lit_bump[i];
-        stk_vertex_t tmp_lit_bump;
-        tmp_lit_bump.pos                      = vertex[vert.pos_index];
-        tmp_lit_bump.normal                   = vertex_normals[vert.nrm_index];
-        tmp_lit_bump.uv[0]                    = vert.uv[0];
-        tmp_lit_bump.uv[2]                    = vert.uv[1];
-        vertex_big[vertex_lit_bump_start + i] = tmp_lit_bump;
-    }
-    for (size_t i = 0; i < vertex_unlit_ts.size(); i++) {
-        const auto&  vert = vertex_unlit_ts[i];
-        stk_vertex_t tmp_unlit_ts;
-        tmp_unlit_ts.pos                      = vertex[vert.pos_index];
-        tmp_unlit_ts.normal                   = vertex_normals[vert.nrm_index];
-        tmp_unlit_ts.uv[0]                    = vert.uv[0];
-        tmp_unlit_ts.uv[2]                    = vert.uv[1];
-        vertex_big[vertex_unlit_ts_start + i] = tmp_unlit_ts;
+    size_t budget = UPLOAD_BYTES_PER_FRAME;
+    for (auto& buffer : upload.buffers) {
+        if (!budget)
+            break;
+        const auto size = std::min(budget, buffer.size - buffer.done);
+        if (!size)
+            continue;
+        glNamedBufferSubData(buffer.buffer, static_cast<GLintptr>(buffer.done), static_cast<GLsizeiptr>(size), (const uint8_t*)buffer.data + buffer.done);
+        buffer.done += size;
+        upload.bytes_done += size;
+        budget -= size;
     }
 
-    stk_map_t stk_map;
-    stk_map.vertex_vec = std::move(vertex_big);
-    stk_map.index_vec  = std::vector<uint32_t>(mesh_indicies.begin(), mesh_indicies.end());
-
-    std::vector<model_parsed_t> models_parsed;
-    models_parsed.reserve(models.size());
-    for (const auto& model : models) {
-        std::vector<mesh_parsed_t> meshes_parsed(model.num_meshes);
-        for (size_t mesh_idx = model.first_mesh; mesh_idx < (model.first_mesh + model.num_meshes); mesh_idx++) {
-            const auto& mesh          = meshes[mesh_idx];
-            const auto& material_sort = material_sorts[mesh.material_sort];
-
-            const auto start  = mesh.first_mesh_index;
-            const auto finish = start + (mesh.num_triangles * 3);
-
-            const auto  texture_data_index = material_sort.texture_data;
-            const auto& texture_data_elem  = texture_data[texture_data_index];
-            const auto  surface_name_raw   = surface_names.data() + texture_data_elem.name_index;
-            const auto  surface_name_std   = std::string(surface_name_raw);
-            auto        surface_name       = std::string(surface_name_std);
-
-            std::transform(surface_name_std.begin(), surface_name_std.end(), surface_name.begin(), [](char c) {if (c == '\\') return (int)'/'; else return ::tolower(c); });
-
-            const auto  type             = mesh.flags & uint32_t(VERTEX_FLAGS::MASK);
-            const char* type_string      = "";
-            size_t      additional_start = 0;
-            switch (VERTEX_FLAGS(type)) {
-            case VERTEX_FLAGS::VERTEX_UNLIT:
-                type_string      = "unlit";
-                additional_start = vertex_unlit_start;
-                break;
-            case VERTEX_FLAGS::VERTEX_UNLIT_TS:
-                type_string      = "unlit_ts";
-                additional_start = vertex_unlit_ts_start;
+    // how much of every buffer a mesh can already use
+    const auto buffers_done  = upload.bytes_done == upload.bytes_total;
+    // streamed maps have no buffers in here and every model is drawable already
+    const auto indices_done  = upload.buffers.empty() ? 0 : upload.buffers[0].done / sizeof(uint16_t);
+    const auto vertex_size   = map.vertex_mode == VERTEX_MODE::COMPACT ? sizeof(stk_vertex_compact_t) : sizeof(stk_vertex_t);
+    const auto vertices_done = map.vertex_mode == VERTEX_MODE::PULLING || upload.buffers.empty() ? 0 : upload.buffers.back().done / vertex_size;
+
+    for (auto& model : map.models) {
+        if (model.lods_drawable)
+            continue;
+
+        // level 0 draws as soon as its own range is in, the LOD switch waits for the ranges build_lods appended
+        auto ready      = true;
+        auto lods_ready = true;
+        for (const auto& mesh : model.meshes) {
+            if (!buffers_done && (map.vertex_mode == VERTEX_MODE::PULLING || indices_done < size_t(mesh.dec.base_index) + mesh.dec.indices ||
+                                     vertices_done < mesh.vertex_end)) {
+                ready = false;
                 break;
-            case VERTEX_FLAGS::VERTEX_LIT_FLAT:
-                type_string      = "lit_flat";
-                additional_start = vertex_lit_flat_start;
-                break;
-            case VERTEX_FLAGS::VERTEX_LIT_BUMP:
-                type_string      = "lit_bump";
-                additional_start = vertex_lit_bump_start;
-                break;
-            default:
-                std::cerr << "WHAT???" << std::endl;
-                return {false, stk_map_t{}};
             }
+            for (uint32_t level = 0; level < mesh.lods_num; level++) {
+                if (!buffers_done && indices_done < size_t(mesh.lods[level].base_index) + mesh.lods[level].indices)
+                    lods_ready = false;
+            }
+        }
+        if (!ready)
+            continue;
+        model.lods_drawable = lods_ready;
+        if (model.drawable)
+            continue;
 
-            // const auto base_vertex = material_sort.vertex_offset;
-            // const auto indicies
-            dec_t dec;
-            dec.indices     = mesh.num_triangles * 3;
-            dec.base_index  = start;
-            dec.base_vertex = additional_start + material_sort.vertex_offset;
-            // base_index = vertex_unlit + vertex_lit_flat + vertex_lit_bump + vertex_unlit_ts
-            // base_vertex = NEEDED_BUFFER_START + vertex_offset
-            // index = base_vertex + base_index[i] = NEEDED_BUFFER_START + vertex_offset + base_index[i] = vertex_offset + NEEDED_BUFFER[i]
-            // vertex = indicies[index]
-
-            mesh_parsed_t mp;
-            mp.dec  = dec;
-            mp.flag = VERTEX_FLAGS(type);
-
-            auto texture_map_elem = stk_map.textures.find(surface_name);
-            if (texture_map_elem == stk_map.textures.end()) {
-                bool found = false;
-                auto elem  = rpaks.common_early->materials.find(surface_name);
-                auto rpak  = rpaks.common_early;
-                if (rpaks.common_early && (elem != rpaks.common_early->materials.end())) {
-                    found = true;
-                    std::cout << "COMMON EARLY ";
-                } else if (rpaks.common && ((elem = rpaks.common->materials.find(surface_name)) != rpaks.common->materials.end())) {
-                    found = true;
-                    rpak  = rpaks.common;
-                    std::cout << "COMMON ";
-                } else if (rpaks.common_mp && ((elem = rpaks.common_mp->materials.find(surface_name)) != rpaks.common_mp->materials.end())) {
-                    found = true;
-                    rpak  = rpaks.common_mp;
-                    std::cout << "COMMON MP ";
-                } else if (rpaks.map && ((elem = rpaks.map->materials.find(surface_name)) != rpaks.map->materials.end())) {
-                    found = true;
-                    rpak  = rpaks.map;
-                    std::cout << "MAP ";
-                }
-                std::cout << surface_name << ' '; // << std::endl;
-
-                if (found) {
-                    auto guids  = elem->second ? *(uint64_t**)(uintptr_t(elem->second) + 0x60) : nullptr;
-                    auto albedo = guids ? guids[0] : 0;
-                    if (!albedo) {
-                        std::cout << guids ? "NO_ALBEDO " : "FUCK ";
-                    } else if (rpak->files.find(albedo) != rpak->files.end()) {
-                        const auto& file          = rpak->files[albedo];
-                        auto        txtr          = (txtr_t*)file.description.ptr;
-                        auto        data          = file.data.ptr;
-                        auto        total_mipmaps = +txtr->rpak_mipmaps_num + txtr->starpak_opt_mipmaps_num + txtr->starpak_mipmaps_num; // - 1; // mb -1, mb not?
-
-                        auto rpak_width  = std::max(txtr->width >> total_mipmaps, 4);
-                        auto rpak_height = std::max(txtr->height >> total_mipmaps, 4);
-                        std::cout << txtr->texture_type << ' ' << txtr->width << 'x' << txtr->height << ' ' << rpak_width << 'x' << rpak_height << ' ' << total_mipmaps << ' ';
-                        std::cout << ' ' << +txtr->starpak_opt_mipmaps_num << ' ' << +txtr->starpak_mipmaps_num << ' ' << +txtr->rpak_mipmaps_num << ' ';
-
-                        GLsizei rhsz = 0;
-
-                        auto   format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
-                        size_t v14    = 4; // block w
-                        size_t v16    = 4; // block h
-                        size_t v15    = 8; // block size?
-                        switch (txtr->texture_type) {
-                        case 1: {
-                            format   = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
-                            auto rwb = (rpak_width + 3) / 4;
-                            auto rhb = (rpak_height + 3) / 4;
-                            rhsz     = (rwb * rhb) * 8ull;
-                        } break;
-                        case 13: {
-                            format   = GL_COMPRESSED_RGBA_BPTC_UNORM;
-                            auto rwb = (rpak_width + 3) / 4;
-                            auto rhb = (rpak_height + 3) / 4;
-                            rhsz     = (rwb * rhb) * 16ull;
-                            v15      = 16ull;
-                        } break;
-                        default:
-                            std::cout << " UNK" << +txtr->texture_type << ' ';
-                            break;
-                        }
-                        const auto unk1e = txtr->layers_count ? txtr->layers_count : 1;
-                        for (long long i = total_mipmaps; i > (total_mipmaps - txtr->rpak_mipmaps_num); i--) {
-                            const auto v17 = ((txtr->width >> i) > 1) ? (txtr->width >> i) : 1;
-                            const auto v22 = ((txtr->height >> i) > 1) ? (txtr->height >> i) : 1;
-
-                            const auto v21 = (v14 + v17 - 1) / v14;
-                            const auto v23 = v21 * ((v16 + v22 - 1) / v16);
-                            const auto v25 = v15 * v23;
-
-                            const auto sizee     = ((v25 + 15) & 0xFFFFFFF0);
-                            const auto skip_size = unk1e * sizee;
-                            data += skip_size;
-
-                            rpak_width  = v17;
-                            rpak_height = v22;
-                            rhsz        = sizee;
-                        }
-                        std::cout << ' ' << rpak_width << 'x' << rpak_height << ' ';
-
-                        GLuint gl_texture = 0;
-                        glCreateTextures(GL_TEXTURE_2D, 1, &gl_texture);
-                        glTextureStorage2D(gl_texture, 5, format, rpak_width, rpak_height);
-                        glCompressedTextureSubImage2D(gl_texture, 0, 0, 0, rpak_width, rpak_height, format, rhsz, data);
-                        glGenerateTextureMipmap(gl_texture);
-
-                        texture_t texture;
-                        texture.material_name          = surface_name;
-                        texture.texture                = gl_texture;
-                        stk_map.textures[surface_name] = std::move(texture);
-                    } else {
-                        std::cout << "FUCK_FILE " << std::hex << albedo << std::dec << ' ';
-                    }
-                }
-
-                std::cout << std::endl; // it has flush but who cares about speed
+        for (auto& mp : model.meshes) {
+            // TODO: subdata of a big buffer
+            dec_t decs[MAP_LODS];
+            for (uint32_t level = 0; level <= mp.lods_num; level++) {
+                decs[level] = mesh_lod_dec(mp, level);
             }
+            glCreateBuffers(1, &mp.dec_buf);
+            glNamedBufferData(mp.dec_buf, static_cast<GLsizeiptr>(sizeof(dec_t) * (mp.lods_num + 1)), decs, GL_STATIC_DRAW);
+        }
+        model.drawable = true;
+        upload.models_done++;
+    }
+
+    // geometry first, meshes draw with the error texture until theirs shows up
+    if (!buffers_done || !upload.paks_mounted)
+        return true;
+
+    const auto materials_end = std::min(map.materials.size(), upload.materials_done + UPLOAD_TEXTURES_PER_FRAME);
+    for (; upload.materials_done < materials_end; upload.materials_done++) {
+        load_texture(map, map.materials[upload.materials_done]);
+    }
 
-            texture_map_elem = stk_map.textures.find(surface_name);
-            if (texture_map_elem != stk_map.textures.end()) {
+    for (auto& model : map.models) {
+        for (auto& mp : model.meshes) {
+            if (mp.textured)
+                continue;
+            auto texture_map_elem = map.textures.find(map.materials[mp.material]);
+            if (texture_map_elem != map.textures.end()) {
                 mp.texture  = texture_map_elem->second.texture;
                 mp.textured = true;
             }
+        }
+    }
 
-            constexpr auto unwanted_flags = uint32_t(VERTEX_FLAGS::SKY) | uint32_t(VERTEX_FLAGS::SKY_2D) | uint32_t(VERTEX_FLAGS::TRIGGER);
-            if (mesh.flags & unwanted_flags) {
-                memset(&mp.dec, 0, sizeof(mp.dec));
-                std::cerr << "DISCARDING UNWANTED MESH WITH SIZE OF " << mesh.num_triangles << std::endl;
-            }
+    upload.active = upload.materials_done < map.materials.size();
+    return upload.active;
+}
 
-            // TODO: subdata of a big buffer
-            glCreateBuffers(1, &mp.dec_buf);
-            glNamedBufferData(mp.dec_buf, static_cast<GLsizeiptr>(sizeof(mp.dec)), &mp.dec, GL_STATIC_DRAW);
+// Everything upload_map_begin/upload_map_step created, textures stay around
+void free_map(stk_map_t& map) {
+    glDeleteBuffers(1, &map.index_buffer);
+    glDeleteVertexArrays(1, &map.gl_vertex_array);
+    if (map.vertex_buffer)
+        glDeleteBuffers(1, &map.vertex_buffer);
+    if (map.positions_buffer)
+        glDeleteBuffers(1, &map.positions_buffer);
+    if (map.normals_buffer)
+        glDeleteBuffers(1, &map.normals_buffer);
+    for (const auto buffer : map.vertex_lump_buffers) {
+        if (buffer)
+            glDeleteBuffers(1, &buffer);
+    }
+
+    for (const auto& model : map.models) {
+        for (const auto& mesh : model.meshes) {
+            glDeleteBuffers(1, &mesh.dec_buf);
+        }
+    }
+
+    // I guess keeping them around is nice cuz they are just 2-4KiB at max?
+    // for (const auto& texture : map.textures) {
+    //     glDeleteTextures(1, &texture.second.texture);
+    // }
+}
 
-            meshes_parsed[mesh_idx - model.first_mesh] = std::move(mp);
+// Model bounds from the studio header of the model asset, props whose model isn't in the paks keep the placeholder.
+// map_rpak - the one of the map being loaded, rpaks.map is still the old map's until it gets swapped
+size_t resolve_prop_models(stk_props_t& props, RPak* map_rpak) {
+    size_t resolved = 0;
+    for (size_t i = 0; i < props.models.size(); i++) {
+        mdl_t* mdl = nullptr;
+        for (const auto rpak : {rpaks.common_early, rpaks.common, rpaks.common_mp, map_rpak}) {
+            if (!rpak)
+                continue;
+            const auto elem = rpak->models.find(props.models[i]);
+            if (elem != rpak->models.end()) {
+                mdl = elem->second;
+                break;
+            }
         }
 
-        model_parsed_t model_parsed;
-        model_parsed.meshes = std::move(meshes_parsed);
-        models_parsed.push_back(model_parsed);
+        const auto studio = mdl ? reinterpret_cast<const studio_hdr_t*>(mdl->data) : nullptr;
+        if (!studio || studio->id != STUDIO_MAGIC)
+            continue;
+
+        auto& bounds = props.bounds[i];
+        memcpy(bounds.mins.coords, studio->hull_min, sizeof(bounds.mins.coords));
+        memcpy(bounds.maxs.coords, studio->hull_max, sizeof(bounds.maxs.coords));
+        props.resolved[i] = 1;
+        resolved++;
     }
 
-    stk_map.models = std::move(models_parsed);
+    return resolved;
+}
+
+// Small enough to go in one go
+void upload_props(stk_props_t& props) {
+    // no sprp lump or nothing in it, zero sized storage isn't allowed so there's nothing to create
+    if (props.draws.empty())
+        return;
+
+    glCreateBuffers(1, &props.vertex_buffer);
+    glNamedBufferStorage(props.vertex_buffer, static_cast<GLsizeiptr>(props.vertex_vec.size() * sizeof(stk_vertex_t)), props.vertex_vec.data(), 0);
+    glCreateBuffers(1, &props.index_buffer);
+    glNamedBufferStorage(props.index_buffer, static_cast<GLsizeiptr>(props.index_vec.size() * sizeof(uint16_t)), props.index_vec.data(), 0);
+    glCreateBuffers(1, &props.transform_buffer);
+    glNamedBufferStorage(props.transform_buffer, static_cast<GLsizeiptr>(std::max<size_t>(props.transforms.size() * sizeof(prop_transform_t), 4)), props.transforms.data(), 0);
+    glCreateBuffers(1, &props.draw_buffer);
+    glNamedBufferStorage(props.draw_buffer, static_cast<GLsizeiptr>(std::max<size_t>(props.draws.size() * sizeof(dec_t), 4)), props.draws.data(), 0);
+
+    glCreateVertexArrays(1, &props.gl_vertex_array);
+    glVertexArrayElementBuffer(props.gl_vertex_array, props.index_buffer);
+    glVertexArrayVertexBuffer(props.gl_vertex_array, 0, props.vertex_buffer, 0, sizeof(stk_vertex_t));
+
+    // layout(location = 0) in vec3 vertPos;
+    glEnableVertexArrayAttrib(props.gl_vertex_array, 0);
+    glVertexArrayAttribFormat(props.gl_vertex_array, 0, 3, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, pos));
+    glVertexArrayAttribBinding(props.gl_vertex_array, 0, 0);
+    // layout(location = 1) in vec3 vertNorm;
+    glEnableVertexArrayAttrib(props.gl_vertex_array, 1);
+    glVertexArrayAttribFormat(props.gl_vertex_array, 1, 3, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, normal));
+    glVertexArrayAttribBinding(props.gl_vertex_array, 1, 0);
+    // layout(location = 3) in vec2 vertUV;
+    glEnableVertexArrayAttrib(props.gl_vertex_array, 3);
+    glVertexArrayAttribFormat(props.gl_vertex_array, 3, 2, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, uv));
+    glVertexArrayAttribBinding(props.gl_vertex_array, 3, 0);
+
+    props.loaded = true;
+}
 
-    return {true, stk_map}; // ???
+void free_props(stk_props_t& props) {
+    glDeleteVertexArrays(1, &props.gl_vertex_array);
+    const GLuint buffers[] = {props.vertex_buffer, props.index_buffer, props.transform_buffer, props.draw_buffer};
+    glDeleteBuffers(4, buffers);
+    props.loaded = false;
 }
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
@@ -632,44 +617,450 @@ auto pipeline_gen(const std::string& v, const std::string& f) {
 }
 
 bool load_rpak(const char* name, RPak** res, std::vector<uint8_t>* res_data) {
-    std::ifstream f(name, std::ifstream::binary);
-    if (!f.fail()) {
-        rpak_header_t header;
-        f.read((char*)&header, sizeof(header));
-        std::vector<uint8_t> fd(header.size_disk);
-        f.read((char*)fd.data() + RPAK_HEADER_SIZE, fd.size() - RPAK_HEADER_SIZE);
-        memcpy(fd.data(), &header, sizeof(header));
-        uint64_t parameters[18];
-
-        auto dsize = get_decompressed_size(uint64_t(parameters), fd.data(), -1i64, fd.size(), 0, RPAK_HEADER_SIZE);
-        if (dsize != header.size_decompressed) {
-            std::cerr << "Failed to load: " << name << ", DSIZE MISSMATCH!" << std::endl;
-            *res = nullptr;
-            return false;
+    std::vector<uint8_t> decompress_buffer;
+    if (!rpak_decompress_cached(rpaks.store, name, &decompress_buffer)) {
+        *res = nullptr;
+        return false;
+    }
+
+    *res_data = std::move(decompress_buffer);
+    *res      = new RPak(res_data->data());
+
+    return true;
+};
+
+// common.rpak -> common(01).rpak, common(02).rpak...
+// Every one that exists gets mounted in order so the newest asset versions win, they go into patches/patches_data
+size_t load_rpak_patches(const char* name, RPak* base, std::vector<RPak*>* patches, std::vector<std::vector<uint8_t>>* patches_data) {
+    if (!base)
+        return 0;
+
+    const auto name_std = std::string(name);
+    const auto dot_pos  = name_std.rfind('.');
+    const auto stem     = name_std.substr(0, dot_pos);
+
+    size_t mounted = 0;
+    for (int i = 1; i < 100; i++) {
+        char suffix[8];
+        sprintf(suffix, "(%02d)", i);
+        const auto patch_name = stem + suffix + ".rpak";
+
+        RPak*                patch = nullptr;
+        std::vector<uint8_t> patch_data;
+        if (!load_rpak(patch_name.c_str(), &patch, &patch_data))
+            continue; // gaps are fine, older patches get deleted
+
+        std::cout << "Mounting " << patch_name << " [" << patch->files.size() << " files] over " << name << std::endl;
+        base->mount(patch);
+
+        patches->push_back(patch);
+        patches_data->push_back(std::move(patch_data));
+        mounted++;
+    }
+
+    return mounted;
+}
+
+void free_rpak(RPak** rpak, std::vector<uint8_t>* data, std::vector<RPak*>* patches, std::vector<std::vector<uint8_t>>* patches_data) {
+    delete *rpak;
+    *rpak = nullptr;
+    for (auto patch : *patches) {
+        delete patch;
+    }
+    patches->clear();
+    patches_data->clear();
+    *data = {};
+}
+
+// Headless stuff, no window needed
+int tool_main(int argc, char* argv[]) {
+    const auto mode = std::string(argv[1]);
+    if (mode == "--analyze" && argc > 2) {
+        std::vector<uint8_t> data;
+        if (!rpak_decompress(argv[2], &data))
+            return -1;
+
+        rpak_analyze(data.data(), std::cout);
+        return 0;
+    } else if (mode == "--repack" && argc > 3) {
+        std::vector<uint8_t> data;
+        if (!rpak_decompress(argv[2], &data))
+            return -1;
+
+        std::vector<uint8_t> repacked;
+        if (!rpak_repack(data.data(), &repacked)) {
+            std::cerr << "Can't repack " << argv[2] << std::endl;
+            return -1;
         }
 
-        std::vector<uint8_t> decompress_buffer(header.size_decompressed);
-        parameters[1] = uint64_t(decompress_buffer.data());
-        parameters[3] = -1;
-        auto dret     = decompress_rpak((long long*)parameters, fd.size(), decompress_buffer.size());
-        if (dret != 1) {
-            std::cerr << "Failed to load: " << name << ", DRet was " << (+dret) << "!" << std::endl;
-            *res = nullptr;
-            return false;
+        std::ofstream out(argv[3], std::ofstream::binary);
+        out.write((const char*)repacked.data(), repacked.size());
+        std::cout << "Repacked " << argv[2] << " -> " << argv[3] << std::endl;
+        return 0;
+    } else if (mode == "--store" && argc > 3) {
+        PageStore store(argv[2], true);
+        for (int i = 3; i < argc; i++) {
+            std::vector<uint8_t> data;
+            if (!rpak_decompress_cached(&store, argv[i], &data))
+                std::cerr << "Failed to store " << argv[i] << std::endl;
+        }
+        std::cout << "Pages written: " << store.pages_written << " (" << store.bytes_written << " bytes), deduped: " << store.pages_deduped << " (" << store.bytes_deduped << " bytes)" << std::endl;
+        return 0;
+    } else if (mode == "--rebuild" && argc > 5) {
+        PageStore            store(argv[2]);
+        std::vector<uint8_t> data;
+        if (!store.get(argv[3], std::stoull(argv[4], nullptr, 16), &data)) {
+            std::cerr << "No " << argv[3] << " in " << argv[2] << std::endl;
+            return -1;
         }
 
-        memcpy(decompress_buffer.data(), &header, sizeof(header));
-        *res_data = std::move(decompress_buffer);
-        *res      = new RPak(res_data->data());
+        // written uncompressed, rpak_decompress takes those as is
+        reinterpret_cast<rpak_header_t*>(data.data())->size_disk = data.size();
+
+        std::ofstream out(argv[5], std::ofstream::binary);
+        out.write((const char*)data.data(), data.size());
+        return 0;
+    } else if (mode == "--mesh-opt" && argc > 2) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
 
-        return true;
-    } else {
-        *res = nullptr;
-        return false;
+        JobPool            jobs;
+        map_load_options_t options;
+        options.optimize_meshes = true;
+
+        auto [succ, map] = load_map(bsp, jobs, options, &std::cout);
+        return succ ? 0 : -1;
+    } else if (mode == "--selftest") {
+        BspFile bsp;
+        if (argc > 2 && !bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto    succ = expand_selftest(argc > 2 ? &bsp : nullptr, jobs, std::cout);
+        succ &= occlusion_selftest(std::cout);
+        return succ ? 0 : -1;
+    } else if (mode == "--bvh" && argc > 2) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto [succ, map] = load_map(bsp, jobs, {}, &std::cout);
+        if (!succ)
+            return -1;
+
+        print_bvh_stats(map.bvh, std::cout);
+        return 0;
+    } else if (mode == "--meshlets" && argc > 2) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto [succ, map] = load_map(bsp, jobs);
+        if (!succ)
+            return -1;
+
+        meshlets_t meshlets;
+        const auto begin = std::chrono::steady_clock::now();
+        build_meshlets(map, jobs, &meshlets);
+        const auto end = std::chrono::steady_clock::now();
+
+        print_meshlet_stats(meshlets, std::cout);
+        std::cout << "Built in " << std::chrono::duration<double, std::milli>(end - begin).count() << "ms" << std::endl;
+        return 0;
+    } else if (mode == "--stream" && argc > 2) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto [succ, map] = load_map(bsp, jobs);
+        if (!succ)
+            return -1;
+
+        stream_grid_t grid;
+        build_stream_grid(map, STREAM_CELL_SIZE, &grid);
+        const auto gpu_budget = argc > 3 ? size_t(std::stod(argv[3]) * 1024 * 1024) : grid.bytes / 4;
+        std::cout << "Cells: " << grid.cells.size() << ", meshes: " << grid.meshes.size() << ", " << grid.bytes / 1024 << " KiB, GPU budget "
+                  << gpu_budget / 1024 << " KiB" << std::endl;
+        if (grid.cells.empty())
+            return 0;
+
+        // corner to corner over the map like a camera would
+        float mins[2] = {grid.cells[0].mins[0], grid.cells[0].mins[1]}, maxs[2] = {grid.cells[0].maxs[0], grid.cells[0].maxs[1]};
+        for (const auto& cell : grid.cells) {
+            for (int axis = 0; axis < 2; axis++) {
+                mins[axis] = std::min(mins[axis], cell.mins[axis]);
+                maxs[axis] = std::max(maxs[axis], cell.maxs[axis]);
+            }
+        }
+        StreamResidency          residency(grid, gpu_budget);
+        std::vector<stream_op_t> ops;
+        constexpr int            steps = 16;
+        for (int step = 0; step <= steps; step++) {
+            const auto  t         = float(step) / steps;
+            const float camera[3] = {mins[0] + (maxs[0] - mins[0]) * t, mins[1] + (maxs[1] - mins[1]) * t, 0.f};
+            // everything it wants at once, frames would spread it out
+            residency.update(camera, gpu_budget, &ops);
+            std::cout << std::setw(3) << step << ": " << std::count_if(ops.begin(), ops.end(), [](const stream_op_t& op) { return op.load; }) << " loads, "
+                      << std::count_if(ops.begin(), ops.end(), [](const stream_op_t& op) { return !op.load; }) << " evictions, " << residency.resident_cells
+                      << " cells " << residency.arena().used() / 1024 << " KiB in" << std::endl;
+        }
+        std::cout << "Loads: " << residency.loads << ", evictions: " << residency.evictions << ", " << residency.bytes_loaded / 1024 << " KiB copied" << std::endl;
+        return 0;
+    } else if (mode == "--occlusion" && argc > 2) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto [succ, map] = load_map(bsp, jobs);
+        if (!succ)
+            return -1;
+        if (!map.cull_bounds.count)
+            return 0;
+
+        occluders_t occluders;
+        build_occluders(map, OCCLUSION_MAX_TRIANGLES, &occluders);
+
+        float mins[3], maxs[3];
+        for (int axis = 0; axis < 3; axis++) {
+            mins[axis] = std::numeric_limits<float>::max();
+            maxs[axis] = -std::numeric_limits<float>::max();
+            for (size_t i = 0; i < map.cull_bounds.count; i++) {
+                mins[axis] = std::min(mins[axis], map.cull_bounds.center[axis][i] - map.cull_bounds.extent[axis][i]);
+                maxs[axis] = std::max(maxs[axis], map.cull_bounds.center[axis][i] + map.cull_bounds.extent[axis][i]);
+            }
+        }
+
+        // corner to corner over the map a quarter of the way up, looking where it's going
+        const auto           proj  = glm::perspective(glm::radians(90.f), float(DEFAULT_W) / DEFAULT_H, 16.f, 102400.f);
+        const auto           steps = argc > 3 ? std::max(1, std::stoi(argv[3])) : 16;
+        OcclusionCuller      occlusion;
+        std::vector<uint8_t> visible(map.cull_bounds.padded());
+        size_t               total_frustum = 0, total_occlusion = 0;
+        double               total_ms      = 0.0;
+        for (int step = 0; step <= steps; step++) {
+            const auto t      = float(step) / steps;
+            const auto camera = glm::vec3(mins[0] + (maxs[0] - mins[0]) * t, mins[1] + (maxs[1] - mins[1]) * t, mins[2] + (maxs[2] - mins[2]) * 0.25f);
+            const auto view   = glm::lookAt(camera, camera + glm::vec3(maxs[0] - mins[0], maxs[1] - mins[1], 0.f), glm::vec3(0.f, 0.f, 1.f));
+            const auto clip   = proj * view;
+
+            frustum_t frustum;
+            frustum_from_matrix(&clip[0][0], &frustum);
+            const auto in_frustum = cull_frustum(map.cull_bounds, frustum, visible.data());
+
+            const auto begin = std::chrono::steady_clock::now();
+            occlusion.render(occluders, &clip[0][0]);
+            const auto unoccluded = occlusion.cull(map.cull_bounds, &clip[0][0], visible.data());
+            const auto ms         = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+            total_frustum += in_frustum;
+            total_occlusion += unoccluded;
+            total_ms += ms;
+            std::cout << std::setw(3) << step << ": " << in_frustum << " in frustum, " << unoccluded << " unoccluded, " << occlusion.triangles_rasterized << " triangles, " << ms
+                      << "ms" << std::endl;
+        }
+        std::cout << "Occluders: " << occluders.count() << ", unoccluded " << total_occlusion << " of " << total_frustum << " in frustum, " << total_ms / (steps + 1)
+                  << "ms a frame" << std::endl;
+        return 0;
+    } else if (mode == "--render" && argc > 3) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto [succ, map] = load_map(bsp, jobs);
+        if (!succ)
+            return -1;
+        if (!map.cull_bounds.count)
+            return 0;
+
+        float mins[3], maxs[3];
+        for (int axis = 0; axis < 3; axis++) {
+            mins[axis] = std::numeric_limits<float>::max();
+            maxs[axis] = -std::numeric_limits<float>::max();
+            for (size_t i = 0; i < map.cull_bounds.count; i++) {
+                mins[axis] = std::min(mins[axis], map.cull_bounds.center[axis][i] - map.cull_bounds.extent[axis][i]);
+                maxs[axis] = std::max(maxs[axis], map.cull_bounds.center[axis][i] + map.cull_bounds.extent[axis][i]);
+            }
+        }
+
+        // over a corner of the map looking at the middle of it
+        const auto center = glm::vec3((mins[0] + maxs[0]) * 0.5f, (mins[1] + maxs[1]) * 0.5f, (mins[2] + maxs[2]) * 0.5f);
+        const auto camera = glm::vec3(mins[0], mins[1], maxs[2] + (maxs[2] - mins[2]) * 0.5f);
+        const auto proj   = glm::perspective(glm::radians(90.f), float(DEFAULT_W) / DEFAULT_H, 16.f, 102400.f);
+        const auto clip   = proj * glm::lookAt(camera, center, glm::vec3(0.f, 0.f, 1.f));
+
+        raster_view_t view;
+        std::copy(&clip[0][0], &clip[0][0] + 16, view.clip);
+        view.camera[0] = camera.x;
+        view.camera[1] = camera.y;
+        view.camera[2] = camera.z;
+        view.shading   = argc > 4 && std::string(argv[4]) == "normal" ? RASTER_SHADING::NORMAL : RASTER_SHADING::FLAT;
+
+        // the calling thread works too, so a pool of n - 1 and none for 1
+        SoftwareRasterizer raster(DEFAULT_W, DEFAULT_H);
+        const auto         hardware = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1;; threads = std::min(threads * 2, hardware)) {
+            JobPool pool(threads - 1);
+            raster.render(map, view, pool); // warm up the allocations
+
+            constexpr int  frames = 5;
+            raster_stats_t stats, sum;
+            for (int frame = 0; frame < frames; frame++) {
+                raster.render(map, view, pool, &stats);
+                sum.setup_ms += stats.setup_ms;
+                sum.bin_ms += stats.bin_ms;
+                sum.raster_ms += stats.raster_ms;
+                sum.total_ms += stats.total_ms;
+            }
+            std::cout << std::setw(3) << threads << " threads: " << sum.total_ms / frames << "ms (setup " << sum.setup_ms / frames << ", bin " << sum.bin_ms / frames
+                      << ", raster " << sum.raster_ms / frames << "), " << stats.triangles << " triangles, " << stats.setup << " set up, " << stats.refs << " in tiles"
+                      << std::endl;
+            if (threads == hardware)
+                break;
+        }
+
+        if (!raster.write_ppm(argv[3])) {
+            std::cerr << "Can't write " << argv[3] << std::endl;
+            return -1;
+        }
+        return 0;
+    } else if (mode == "--raycast" && argc > 3) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        JobPool jobs;
+        auto [succ, map] = load_map(bsp, jobs);
+        if (!succ)
+            return -1;
+
+        // origin xyz, direction xyz a line
+        std::ifstream     file;
+        std::istream*     in        = &std::cin;
+        const std::string rays_path = argv[3];
+        if (rays_path != "-") {
+            file.open(rays_path);
+            in = &file;
+        }
+        std::vector<ray_t> rays;
+        for (std::string line; std::getline(*in, line);) {
+            std::istringstream fields(line);
+            ray_t              ray;
+            if (fields >> ray.origin.x >> ray.origin.y >> ray.origin.z >> ray.dir.x >> ray.dir.y >> ray.dir.z)
+                rays.push_back(ray);
+        }
+
+        RayCaster              caster(map.bvh, jobs);
+        std::vector<ray_hit_t> hits(rays.size());
+        const auto             begin = std::chrono::steady_clock::now();
+        caster.cast(rays.data(), rays.size(), hits.data(), jobs);
+        const auto end = std::chrono::steady_clock::now();
+
+        for (const auto& hit : hits) {
+            if (!hit.hit()) {
+                std::cout << "miss" << std::endl;
+                continue;
+            }
+            const auto& mesh = map.models[hit.model].meshes[hit.mesh];
+            std::cout << "hit model " << hit.model << " mesh " << hit.mesh << " triangle " << hit.triangle << " material " << map.materials[mesh.material] << " at "
+                      << hit.point.x << ' ' << hit.point.y << ' ' << hit.point.z << " t " << hit.t << std::endl;
+        }
+        std::cerr << rays.size() << " rays in " << std::chrono::duration<double, std::milli>(end - begin).count() << "ms" << std::endl;
+        return 0;
+    } else if (mode == "--entities" && argc > 2) {
+        JobPool    jobs;
+        const auto begin = std::chrono::steady_clock::now();
+        EntitySet  entities;
+        if (!entities.open(argv[2], &jobs)) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        std::cout << "Entities: " << entities.size() << ", key/values: " << entities.keyvalues_num() << " in "
+                  << std::chrono::duration<double, std::milli>(end - begin).count() << "ms" << std::endl;
+        if (argc > 3) {
+            for (const auto& ref : entities.by_classname(argv[3])) {
+                std::cout << "{" << std::endl;
+                for (const auto& kv : entities.keyvalues(ref.entity)) {
+                    std::cout << "  \"" << kv.key << "\" \"" << kv.value << "\"" << std::endl;
+                }
+                std::cout << "}" << std::endl;
+            }
+        }
+        return 0;
+    } else if (mode == "--props" && argc > 2) {
+        BspFile bsp;
+        if (!bsp.open(argv[2])) {
+            std::cerr << "Can't open " << argv[2] << std::endl;
+            return -1;
+        }
+
+        stk_props_t props;
+        if (!load_static_props(bsp, &props))
+            return -1;
+
+        std::cout << "Static props: " << props.props.size() << " (sprp v" << props.version << ", " << props.stride << " bytes each), models: " << props.models.size()
+                  << ", draws: " << props.draws.size() << std::endl;
+        for (const auto& draw : props.draws) {
+            const auto model = props.props[draw.base_instance].model_index;
+            std::cout << std::setw(6) << draw.instances << ' ' << props.models[model] << std::endl;
+        }
+        return 0;
     }
-};
+
+    std::cerr << "Usage: r5bsp [--page-store <dir>] [--map-cache <dir>]" << std::endl;
+    std::cerr << "       r5bsp --analyze <rpak>" << std::endl;
+    std::cerr << "       r5bsp --repack <rpak> <out rpak>" << std::endl;
+    std::cerr << "       r5bsp --store <dir> <rpak>..." << std::endl;
+    std::cerr << "       r5bsp --rebuild <dir> <name> <timestamp> <out rpak>" << std::endl;
+    std::cerr << "       r5bsp --mesh-opt <bsp>" << std::endl;
+    std::cerr << "       r5bsp --selftest [bsp]" << std::endl;
+    std::cerr << "       r5bsp --bvh <bsp>" << std::endl;
+    std::cerr << "       r5bsp --meshlets <bsp>" << std::endl;
+    std::cerr << "       r5bsp --stream <bsp> [GPU budget MiB]" << std::endl;
+    std::cerr << "       r5bsp --occlusion <bsp> [steps]" << std::endl;
+    std::cerr << "       r5bsp --render <bsp> <out ppm> [flat|normal]" << std::endl;
+    std::cerr << "       r5bsp --raycast <bsp> <rays file or -, origin xyz and direction xyz a line>" << std::endl;
+    std::cerr << "       r5bsp --entities <bsp> [classname]" << std::endl;
+    std::cerr << "       r5bsp --props <bsp>" << std::endl;
+    return -1;
+}
 
 int main(int argc, char* argv[]) {
+    MapCache* map_cache = nullptr; // --map-cache
+    for (int i = 1; i < argc; i += 2) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--page-store" && i + 1 < argc) {
+            rpaks.store = new PageStore(argv[i + 1], true);
+        } else if (arg == "--map-cache" && i + 1 < argc) {
+            map_cache = new MapCache(argv[i + 1]);
+        } else {
+            return tool_main(argc, argv);
+        }
+    }
+
     if (!glfwInit()) {
         std::cerr << "GLFW fail!" << std::endl;
         return -1;
@@ -695,7 +1086,10 @@ int main(int argc, char* argv[]) {
 
     // we generate all the necessary shit here before rendering
     // first is of course us
-    auto pipeline = pipeline_gen(VERTEX_SHADER, FRAGMENT_SHADER);
+    auto pipeline         = pipeline_gen(VERTEX_SHADER, FRAGMENT_SHADER);
+    auto pipeline_pulling = pipeline_gen(VERTEX_SHADER_PULLING, FRAGMENT_SHADER);
+    auto pipeline_compact = pipeline_gen(VERTEX_SHADER_COMPACT, FRAGMENT_SHADER);
+    auto pipeline_props   = pipeline_gen(VERTEX_SHADER_PROPS, FRAGMENT_SHADER);
 
     // second - ImGui
     IMGUI_CHECKVERSION();
@@ -709,9 +1103,74 @@ int main(int argc, char* argv[]) {
     bool show_demo_window = true;
     bool show_menu        = true;
 
-    stk_map_t map;
+    JobPool jobs;
+
+    stk_map_t    map;
+    map_upload_t upload;
+    stk_props_t  props;
+
+    // picking, hovered follows the cursor and a click makes it the selected one
+    std::unique_ptr<RayCaster> raycaster;
+    ray_hit_t                  hovered, selected;
+    bool                       was_down = false;
+
+    // all of the drawn meshes and what their lods came down to, last frame
+    std::pair<size_t, size_t> lod_triangles;
+
+    // per mesh, last frame's frustum cull, flat over the models like stk_map_t::cull_bounds
+    std::vector<uint8_t> visible;
+    size_t               visible_meshes = 0;
+
+    // software hi-z, occluders get picked on the pool with the rest of the map
+    occluders_t     occluders;
+    OcclusionCuller occlusion;
+    size_t          unoccluded_meshes = 0;
+    double          occlusion_ms      = 0.0;
+
+    // Map being loaded on the pool by two jobs. The render loop takes the geometry as soon as the map job has it
+    // and starts uploading it, the BVH follows once the map job has built it, the rpak, entities and props once
+    // the other one is done.
+    struct pending_map_t {
+        map_load_progress_t progress;
+        std::atomic<int>    jobs_left = 2;
+        std::atomic<bool>   map_done  = false;
+        bool                map_taken = false; // render thread only
+        bool                succ      = false;
+        stk_map_t           map;
+
+        bool          streamed = false;
+        size_t        gpu_budget;
+        stream_grid_t stream_grid;
+
+        occluders_t occluders;
+
+        // the biggest stage on large maps, so it's built after the geometry is handed on. Comes with the map on a
+        // cache hit, bvh_later is false then.
+        bvh_input_t         bvh_input;
+        bvh_t               bvh;
+        bool                bvh_later = false;
+        std::atomic<bool>   bvh_done  = false;
+        bool                bvh_taken = false; // render thread only
+        map_cache_pending_t cache_put;
+
+        // swapped into rpaks on the render thread, load_texture reads those
+        RPak*                             rpak = nullptr;
+        std::vector<uint8_t>              rpak_data;
+        std::vector<RPak*>                patches;
+        std::vector<std::vector<uint8_t>> patches_data;
+
+        std::unique_ptr<EntitySet> entities;
+        stk_props_t                props;
+    };
+    std::unique_ptr<pending_map_t> pending;
+
+    map_stream_t stream;
+
+    std::unique_ptr<EntitySet> entities;
+
     struct {
-        bool cull = false;
+        bool cull      = false;
+        bool occlusion = false; // on top of cull
         // TODO???
         bool ignore_sky     = true;
         bool ignore_sky2d   = true;
@@ -719,6 +1178,22 @@ int main(int argc, char* argv[]) {
 
         bool flat     = false;
         bool flat_nrm = false;
+
+        bool props = true;
+
+        bool  lod        = true;
+        float lod_pixels = 1.f; // how far a level's surface may be off on screen
+
+        // these apply to the next map opened
+        int  vertex_mode      = int(VERTEX_MODE::EXPANDED);
+        bool optimize_meshes  = false;
+        bool lods             = true;
+        bool streaming        = false;
+        int  gpu_budget_mb    = 256; // of streaming, the CPU side keeps the whole map
+
+        // Entities window
+        char entity_lookup[128] = "info_player_start";
+        bool entity_by_target   = false;
     } settings;
 
     {
@@ -764,6 +1239,9 @@ int main(int argc, char* argv[]) {
     load_rpak("common_early.rpak", &rpaks.common_early, &rpaks.common_early_data);
     load_rpak("common.rpak", &rpaks.common, &rpaks.common_data);
     load_rpak("common_mp.rpak", &rpaks.common_mp, &rpaks.common_mp_data);
+    load_rpak_patches("common_early.rpak", rpaks.common_early, &rpaks.patches, &rpaks.patches_data);
+    load_rpak_patches("common.rpak", rpaks.common, &rpaks.patches, &rpaks.patches_data);
+    load_rpak_patches("common_mp.rpak", rpaks.common_mp, &rpaks.patches, &rpaks.patches_data);
 
     const auto vec_up    = glm::vec3(0.f, 0.f, 1.f);
     const auto view_base = glm::lookAt(glm::vec3(0.f, 0.f, 0.f), glm::vec3(1000.f, 0.f, 0.f), vec_up);
@@ -878,20 +1356,156 @@ int main(int argc, char* argv[]) {
         // glCullFace(GL_FRONT);
         // glFrontFace(GL_CCW);
 
+        if (pending && pending->map_done && !pending->map_taken) {
+            pending->map_taken = true;
+            if (pending->succ) {
+                raycaster.reset(); // points into the old map
+                hovered  = {};
+                selected = {};
+                if (map.loaded)
+                    free_map(map);
+                free_stream(stream);
+
+                // they belong to the old map, the new ones come with the rpak
+                if (props.loaded)
+                    free_props(props);
+                entities.reset();
+
+                map = std::move(pending->map);
+                if (pending->streamed) {
+                    stream.grid = std::move(pending->stream_grid);
+                    stream_map_begin(map, stream, pending->gpu_budget);
+                }
+                upload_map_begin(map, &upload, pending->streamed);
+                if (!pending->bvh_later)
+                    raycaster = std::make_unique<RayCaster>(map.bvh, jobs);
+                occluders = std::move(pending->occluders);
+
+                map.loaded = true;
+            }
+        }
+        if (pending && pending->map_taken && pending->bvh_done && !pending->bvh_taken) {
+            pending->bvh_taken = true;
+            if (pending->succ && pending->bvh_later) {
+                map.bvh   = std::move(pending->bvh);
+                raycaster = std::make_unique<RayCaster>(map.bvh, jobs);
+            }
+        }
+        if (pending && pending->map_taken && pending->bvh_taken && !pending->jobs_left) {
+            if (pending->succ) {
+                // nothing reads the old map's textures out of it anymore, they're all on the GPU by now
+                free_rpak(&rpaks.map, &rpaks.map_data, &rpaks.map_patches, &rpaks.map_patches_data);
+                rpaks.map              = pending->rpak;
+                rpaks.map_data         = std::move(pending->rpak_data);
+                rpaks.map_patches      = std::move(pending->patches);
+                rpaks.map_patches_data = std::move(pending->patches_data);
+                upload.paks_mounted    = true;
+
+                entities = std::move(pending->entities);
+                props    = std::move(pending->props);
+                upload_props(props);
+            } else {
+                free_rpak(&pending->rpak, &pending->rpak_data, &pending->patches, &pending->patches_data);
+            }
+            pending.reset();
+        }
+        upload_map_step(map, upload);
+        {
+            const float camera[3] = {pos_delta.x, pos_delta.y, pos_delta.z};
+            stream_map_step(map, stream, camera);
+        }
+
+        if (raycaster && !io.WantCaptureMouse) {
+            double mouse_x, mouse_y;
+            int    width, height;
+            glfwGetCursorPos(window, &mouse_x, &mouse_y);
+            glfwGetWindowSize(window, &width, &height);
+
+            // cursor on the near and far planes, back into map space
+            const auto inverse  = glm::inverse(shader_shit.opaque.proj * shader_shit.opaque.view * shader_shit.model);
+            const auto ndc_x    = float(2.0 * mouse_x / std::max(width, 1) - 1.0);
+            const auto ndc_y    = float(1.0 - 2.0 * mouse_y / std::max(height, 1));
+            auto       near_pos = inverse * glm::vec4(ndc_x, ndc_y, -1.f, 1.f);
+            auto       far_pos  = inverse * glm::vec4(ndc_x, ndc_y, 1.f, 1.f);
+            near_pos /= near_pos.w;
+            far_pos /= far_pos.w;
+
+            ray_t ray;
+            ray.origin = {{near_pos.x, near_pos.y, near_pos.z}};
+            ray.dir    = {{far_pos.x - near_pos.x, far_pos.y - near_pos.y, far_pos.z - near_pos.z}};
+            ray.max_t  = 1.f;
+            raycaster->cast(ray, &hovered, &map);
+
+            const auto down = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+            if (down && !was_down)
+                selected = hovered;
+            was_down = down;
+        } else {
+            hovered  = {};
+            was_down = false;
+        }
+        const auto picked_mesh = [&](const ray_hit_t& hit) -> const mesh_parsed_t* {
+            return hit.hit() ? &map.models[hit.model].meshes[hit.mesh] : nullptr;
+        };
+        const auto hovered_mesh  = picked_mesh(hovered);
+        const auto selected_mesh = picked_mesh(selected);
+
         if (map.loaded) {
-            glBindProgramPipeline(pipeline.pipeline);
+            const auto  pulling = map.vertex_mode == VERTEX_MODE::PULLING;
+            const auto  compact = map.vertex_mode == VERTEX_MODE::COMPACT;
+            const auto& current = pulling ? pipeline_pulling : (compact ? pipeline_compact : pipeline);
+
+            glBindProgramPipeline(current.pipeline);
             glBindVertexArray(map.gl_vertex_array);
 
             glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubuffer);
-            glProgramUniformMatrix4fv(pipeline.program, 1, 1, GL_FALSE, (const GLfloat*)&shader_shit.model);
+            glProgramUniformMatrix4fv(current.program, 1, 1, GL_FALSE, (const GLfloat*)&shader_shit.model);
 
             glBindTextureUnit(0, rpaks.error_texture);
             glBindSampler(0, rpaks.sampler);
-            glProgramUniform1i(pipeline.program, 2, settings.flat ? (settings.flat_nrm ? 2 : 0) : 1);
+            glProgramUniform1i(current.program, 2, settings.flat ? (settings.flat_nrm ? 2 : 0) : 1);
+
+            if (pulling) {
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, map.positions_buffer);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, map.normals_buffer);
+            }
+            auto bound_lump   = VERTEX_LUMP::COUNT;
+            auto bound_bounds = ~uint32_t(0);
+
+            // size of a world unit on screen at distance 1
+            int width, height;
+            glfwGetFramebufferSize(window, &width, &height);
+            const float camera[3]       = {pos_delta.x, pos_delta.y, pos_delta.z};
+            const auto  pixels_per_unit = shader_shit.opaque.proj[1][1] * float(height) * 0.5f;
+            lod_triangles               = {};
+
+            const auto culling = settings.cull && map.cull_bounds.count;
+            if (culling) {
+                const auto clip = shader_shit.opaque.proj * shader_shit.opaque.view * shader_shit.model;
+                frustum_t  frustum;
+                frustum_from_matrix(&clip[0][0], &frustum);
+                visible.resize(map.cull_bounds.padded());
+                visible_meshes = cull_frustum(map.cull_bounds, frustum, visible.data());
+
+                if (settings.occlusion) {
+                    const auto begin = std::chrono::steady_clock::now();
+                    occlusion.render(occluders, &clip[0][0], &map);
+                    unoccluded_meshes = occlusion.cull(map.cull_bounds, &clip[0][0], visible.data());
+                    occlusion_ms      = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                }
+            }
 
+            size_t first_mesh = 0;
             for (const auto& models : map.models) {
+                const auto model_first = first_mesh;
+                first_mesh += models.meshes.size();
+                if (!models.drawable)
+                    continue;
                 for (const auto& mesh : models.meshes) {
-                    if (mesh.draw) {
+                    const auto id = model_first + (&mesh - models.meshes.data());
+                    if (culling && id < map.cull_bounds.count && !visible[id])
+                        continue;
+                    if (mesh.draw && mesh.resident) {
                         if (!settings.flat) {
                             if (mesh.textured) {
                                 glBindTextureUnit(0, mesh.texture);
@@ -902,19 +1516,73 @@ int main(int argc, char* argv[]) {
                                 // continue;
                             }
                         }
+                        // meshes of a model are mostly one vertex type, only rebind when it changes
+                        if (pulling && mesh.vertex_lump != bound_lump) {
+                            bound_lump = mesh.vertex_lump;
+                            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, map.vertex_lump_buffers[size_t(bound_lump)]);
+                            glProgramUniform1ui(current.program, 3, map.vertex_lump_strides[size_t(bound_lump)]);
+                        }
+                        if (compact && mesh.quant_bounds != bound_bounds) {
+                            bound_bounds       = mesh.quant_bounds;
+                            const auto& bounds = map.quant_bounds[bound_bounds];
+                            glProgramUniform3fv(current.program, 4, 1, bounds.offset.coords);
+                            glProgramUniform3fv(current.program, 5, 1, bounds.scale.coords);
+                        }
+                        const auto highlight = &mesh == hovered_mesh || &mesh == selected_mesh;
+                        if (highlight)
+                            glProgramUniform1i(current.program, 2, 3);
+                        const auto lod = settings.lod && models.lods_drawable ? mesh_pick_lod(mesh, camera, pixels_per_unit, settings.lod_pixels) : 0;
+                        lod_triangles.first += mesh.dec.indices / 3;
+                        lod_triangles.second += mesh_lod_dec(mesh, lod).indices / 3;
                         glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.dec_buf);
-                        glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr);
+                        glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (const void*)(std::min(lod, mesh.lods_num) * sizeof(dec_t)));
+                        if (highlight)
+                            glProgramUniform1i(current.program, 2, settings.flat ? (settings.flat_nrm ? 2 : 0) : 1);
                     }
                 }
             }
         }
 
+        // every model's instances in one go, one command per model
+        if (props.loaded && settings.props && !props.draws.empty()) {
+            glBindProgramPipeline(pipeline_props.pipeline);
+            glBindVertexArray(props.gl_vertex_array);
+
+            glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubuffer);
+            glProgramUniformMatrix4fv(pipeline_props.program, 1, 1, GL_FALSE, (const GLfloat*)&shader_shit.model);
+            glProgramUniform1i(pipeline_props.program, 2, settings.flat ? (settings.flat_nrm ? 2 : 0) : 1);
+            glBindTextureUnit(0, rpaks.error_texture);
+            glBindSampler(0, rpaks.sampler);
+
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, props.transform_buffer);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, props.draw_buffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, nullptr, static_cast<GLsizei>(props.draws.size()), 0);
+        }
+
         // --- Start of ImGui ---
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
         // ImGui rendering here
+        if (pending || upload.active) {
+            if (ImGui::Begin("Loading", nullptr, ImGuiWindowFlags_AlwaysAutoResize)) {
+                char buf[64];
+                if (pending && !pending->map_taken) {
+                    const size_t done  = pending->progress.done;
+                    const size_t total = pending->progress.total;
+                    sprintf(buf, "Processing %zu/%zu", done, total);
+                    ImGui::ProgressBar(total ? float(done) / total : 0.f, ImVec2(300.f, 0.f), buf);
+                } else {
+                    sprintf(buf, "Models %zu/%zu", upload.models_done, map.models.size());
+                    ImGui::ProgressBar(upload.bytes_total ? float(upload.bytes_done) / upload.bytes_total : 1.f, ImVec2(300.f, 0.f), buf);
+                    sprintf(buf, "Textures %zu/%zu", upload.materials_done, map.materials.size());
+                    ImGui::ProgressBar(map.materials.size() ? float(upload.materials_done) / map.materials.size() : 1.f, ImVec2(300.f, 0.f), buf);
+                }
+            }
+            ImGui::End();
+        }
+
         if (show_menu) {
             ImGui::ShowDemoWindow(&show_demo_window);
             if (ImGui::Begin("Info")) {
@@ -930,7 +1598,29 @@ int main(int argc, char* argv[]) {
 
                 ImGui::Checkbox("Flat?", &settings.flat);
                 ImGui::Checkbox("Flat Normal?", &settings.flat_nrm);
-                ImGui::Checkbox("Cull? (WIP)", &settings.cull);
+                ImGui::Checkbox("Frustum cull", &settings.cull);
+                if (settings.cull) {
+                    ImGui::Text("Visible: %zu of %zu meshes", visible_meshes, map.cull_bounds.count);
+                    ImGui::Checkbox("Occlusion cull", &settings.occlusion);
+                    if (settings.occlusion)
+                        ImGui::Text("Unoccluded: %zu, %zu occluders, %.2fms", unoccluded_meshes, occluders.count(), occlusion_ms);
+                }
+                ImGui::Checkbox("Static props", &settings.props);
+                ImGui::Checkbox("LODs", &settings.lod);
+                ImGui::SliderFloat("LOD error (pixels)", &settings.lod_pixels, 0.25f, 8.f);
+                ImGui::Text("Triangles: %zu of %zu", lod_triangles.second, lod_triangles.first);
+                ImGui::Text("Props: %zu, models: %zu, draws: %zu", props.props.size(), props.models.size(), props.draws.size());
+                ImGui::Combo("Vertex mode (on open)", &settings.vertex_mode, "Expanded\0Pulling\0Compact\0");
+                ImGui::Checkbox("Optimize meshes (on open)", &settings.optimize_meshes);
+                ImGui::Checkbox("Build LODs (on open)", &settings.lods);
+                ImGui::Checkbox("Stream geometry to the GPU (on open)", &settings.streaming);
+                ImGui::SliderInt("GPU budget MiB (on open)", &settings.gpu_budget_mb, 16, 2048);
+                if (stream.active) {
+                    const auto& arena = stream.residency->arena();
+                    ImGui::Text("Cells: %zu of %zu, %.1f of %.1f MiB of VRAM (map %.1f MiB)", stream.residency->resident_cells, stream.grid.cells.size(),
+                        arena.used() / (1024.0 * 1024.0), arena.size() / (1024.0 * 1024.0), stream.grid.bytes / (1024.0 * 1024.0));
+                    ImGui::Text("Loads: %zu, evictions: %zu", stream.residency->loads, stream.residency->evictions);
+                }
             }
             ImGui::End();
 
@@ -965,10 +1655,45 @@ int main(int argc, char* argv[]) {
             }
             ImGui::End();
 
+            if (selected.hit()) {
+                if (ImGui::Begin("Pick")) {
+                    const auto& mesh = map.models[selected.model].meshes[selected.mesh];
+                    ImGui::Text("Model %u, mesh %u, triangle %u", selected.model, selected.mesh, selected.triangle);
+                    ImGui::Text("Material: %s", map.materials[mesh.material].c_str());
+                    ImGui::Text("At: %f %f %f", selected.point.x, selected.point.y, selected.point.z);
+                    if (ImGui::Button("Clear"))
+                        selected = {};
+                }
+                ImGui::End();
+            }
+
+            if (entities) {
+                if (ImGui::Begin("Entities")) {
+                    ImGui::Text("Entities: %zu, key/values: %zu", entities->size(), entities->keyvalues_num());
+                    ImGui::InputText("Lookup", settings.entity_lookup, sizeof(settings.entity_lookup));
+                    ImGui::Checkbox("By targetname", &settings.entity_by_target);
+
+                    const auto found = settings.entity_by_target ? entities->by_targetname(settings.entity_lookup) : entities->by_classname(settings.entity_lookup);
+                    ImGui::Text("Found: %zu", found.size());
+
+                    char buf[64];
+                    for (size_t i = 0; i < found.size() && i < 256; i++) {
+                        sprintf(buf, "Entity%06u", found[i].entity);
+                        if (ImGui::TreeNode(buf)) {
+                            for (const auto& kv : entities->keyvalues(found[i].entity)) {
+                                ImGui::Text("%.*s: %.*s", int(kv.key.size()), kv.key.data(), int(kv.value.size()), kv.value.data());
+                            }
+                            ImGui::TreePop();
+                        }
+                    }
+                }
+                ImGui::End();
+            }
+
             if (ImGui::BeginMainMenuBar()) {
                 if (ImGui::BeginMenu("File")) {
-                    if (ImGui::MenuItem("Open", "Ctrl+O")) {
-                        auto selection = pfd::open_file::open_file("Open BSP", ".", {"BSP (*.bsp)", "*.bsp"}).result();
+                    if (ImGui::MenuItem("Open", "Ctrl+O", false, !pending && !upload.active)) {
+                        auto selection = pfd::open_file("Open BSP", ".", {"BSP (*.bsp)", "*.bsp"}).result();
                         if (!selection.empty()) {
                             auto& selected = selection[0];
                             std::cout << "User selected file " << selected << std::endl;
@@ -983,56 +1708,60 @@ int main(int argc, char* argv[]) {
                             //std::cout << "Stem: " << stem << std::endl;
                             const auto rpak_map_name = stem + ".rpak";
                             std::cout << "RPak map: " << rpak_map_name << std::endl;
-                            load_rpak(rpak_map_name.c_str(), &rpaks.map, &rpaks.map_data);
-
-                            std::ifstream file(selected, std::ifstream::binary);
-                            auto [succ, map_idk] = load_map(file);
-                            if (succ) {
-                                if (map.loaded) {
-                                    glDeleteBuffers(1, &map.index_buffer);
-                                    glDeleteBuffers(1, &map.vertex_buffer);
-                                    glDeleteVertexArrays(1, &map.gl_vertex_array);
-
-                                    for (const auto& model : map.models) {
-                                        for (const auto& mesh : model.meshes) {
-                                            glDeleteBuffers(1, &mesh.dec_buf);
-                                        }
-                                    }
-
-                                    // I guess keeping them around is nice cuz they are just 2-4KiB at max?
-                                    // for (const auto& texture : map.textures) {
-                                    //     glDeleteTextures(1, &texture.second.texture);
-                                    // }
+
+                            map_load_options_t load_options;
+                            load_options.vertex_mode     = VERTEX_MODE(settings.vertex_mode);
+                            load_options.optimize_meshes = settings.optimize_meshes;
+                            load_options.lods            = settings.lods;
+
+                            // Open is disabled until both are done and pending is gone
+                            pending                = std::make_unique<pending_map_t>();
+                            pending->streamed   = settings.streaming;
+                            pending->gpu_budget = size_t(settings.gpu_budget_mb) * 1024 * 1024;
+                            jobs.submit([&jobs, map_cache, selected, load_options, loading = pending.get()]() mutable {
+                                load_options.progress  = &loading->progress;
+                                load_options.bvh_input = &loading->bvh_input;
+                                auto [succ, map_idk]   = load_map_cached(map_cache, selected, jobs, load_options, &std::cout, &loading->cache_put);
+                                loading->succ          = succ;
+                                loading->map           = std::move(map_idk);
+                                loading->bvh_later     = succ && loading->map.bvh.empty();
+
+                                // pulling has nothing to stream and gets uploaded whole
+                                if (succ && loading->streamed && !build_stream_grid(loading->map, STREAM_CELL_SIZE, &loading->stream_grid))
+                                    loading->streamed = false;
+                                if (succ)
+                                    build_occluders(loading->map, OCCLUSION_MAX_TRIANGLES, &loading->occluders);
+
+                                loading->map_done = true;
+
+                                // the render thread has the map from here on, only the input is left to read
+                                if (loading->bvh_later) {
+                                    build_bvh(loading->bvh_input, jobs, &loading->bvh);
+                                    loading->bvh_input = {};
+                                    if (!loading->cache_put.path.empty() && !map_cache->put_finish(loading->cache_put, loading->bvh))
+                                        std::cerr << "MapCache: couldn't store " << selected << std::endl;
+                                }
+                                loading->bvh_done = true;
+                                loading->jobs_left--;
+                            });
+                            jobs.submit([&jobs, selected, rpak_map_name, loading = pending.get()]() {
+                                load_rpak(rpak_map_name.c_str(), &loading->rpak, &loading->rpak_data);
+                                load_rpak_patches(rpak_map_name.c_str(), loading->rpak, &loading->patches, &loading->patches_data);
+
+                                // not worth failing the map over
+                                loading->entities = std::make_unique<EntitySet>();
+                                if (!loading->entities->open(selected, &jobs))
+                                    std::cerr << "No entities for " << selected << std::endl;
+
+                                BspFile props_bsp;
+                                if (props_bsp.open(selected) && load_static_props(props_bsp, &loading->props)) {
+                                    const auto resolved = resolve_prop_models(loading->props, loading->rpak);
+                                    std::cout << "Static props: " << loading->props.props.size() << ", models resolved: " << resolved << '/' << loading->props.models.size() << std::endl;
+                                    build_prop_transforms(loading->props, jobs);
                                 }
 
-                                map = std::move(map_idk);
-                                GLuint buf[2];
-                                glCreateBuffers(2, buf);
-                                glNamedBufferData(buf[0], static_cast<GLsizeiptr>(map.index_vec.size() * sizeof(uint32_t)), map.index_vec.data(), GL_STATIC_DRAW);
-                                glNamedBufferData(buf[1], static_cast<GLsizeiptr>(map.vertex_vec.size() * sizeof(stk_vertex_t)), map.vertex_vec.data(), GL_STATIC_DRAW);
-                                map.index_buffer  = buf[0];
-                                map.vertex_buffer = buf[1];
-
-                                glCreateVertexArrays(1, &map.gl_vertex_array);
-                                glVertexArrayElementBuffer(map.gl_vertex_array, map.index_buffer);
-                                glVertexArrayVertexBuffer(map.gl_vertex_array, 0, map.vertex_buffer, 0, sizeof(stk_vertex_t));
-
-                                // layout(location = 0) in vec3 vertPos;
-                                glEnableVertexArrayAttrib(map.gl_vertex_array, 0);
-                                glVertexArrayAttribFormat(map.gl_vertex_array, 0, 3, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, pos));
-                                glVertexArrayAttribBinding(map.gl_vertex_array, 0, 0);
-                                // layout(location = 1) in vec3 vertNorm;
-                                glEnableVertexArrayAttrib(map.gl_vertex_array, 1);
-                                glVertexArrayAttribFormat(map.gl_vertex_array, 1, 3, GL_FLOAT, GL_FALSE, offsetof(stk_vertex_t, normal));
-                                glVertexArrayAttribBinding(map.gl_vertex_array, 1, 0);
-
-                                // layout(location = 3) in vec2 vertUV;
-                                glEnableVertexArrayAttrib(map.gl_vertex_array, 3);
-                                glVertexArrayAttribFormat(map.gl_vertex_array, 3, 2, GL_FLOAT, GL_TRUE, offsetof(stk_vertex_t, uv));
-                                glVertexArrayAttribBinding(map.gl_vertex_array, 3, 0);
-
-                                map.loaded = true;
-                            }
+                                loading->jobs_left--;
+                            });
                         }
                     }
                     ImGui::EndMenu();
@@ -1047,9 +1776,21 @@ int main(int argc, char* argv[]) {
         glfwSwapBuffers(window);
     }
 
+    // the pool job still writes into it
+    while (pending && pending->jobs_left) {
+        if (!jobs.help())
+            std::this_thread::yield();
+    }
+
     // Delete our shit
     glDeleteProgramPipelines(1, &pipeline.pipeline);
     glDeleteProgram(pipeline.program);
+    glDeleteProgramPipelines(1, &pipeline_pulling.pipeline);
+    glDeleteProgram(pipeline_pulling.program);
+    glDeleteProgramPipelines(1, &pipeline_compact.pipeline);
+    glDeleteProgram(pipeline_compact.program);
+    glDeleteProgramPipelines(1, &pipeline_props.pipeline);
+    glDeleteProgram(pipeline_props.program);
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -0,0 +1,953 @@
+#include "map.hh"
+
+#include "mesh_opt.hh"
+#include "mesh_simplify.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <numeric>
+
+#include <glm/gtc/packing.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+// Vertices per job when expanding, big enough to not drown in scheduling
+constexpr size_t EXPAND_CHUNK = 64 * 1024;
+// How far ahead we prefetch positions/normals
+constexpr size_t EXPAND_PREFETCH = 16;
+
+// Mapped lumps only get read from disk once touched, doing it here means it happens in parallel
+template <typename T>
+static void fault_in(span<const T> lump) {
+    auto       bytes = reinterpret_cast<const volatile uint8_t*>(lump.data());
+    uint8_t    sink  = 0;
+    const auto size  = lump.size() * sizeof(T);
+    for (size_t i = 0; i < size; i += 4096) {
+        sink ^= bytes[i];
+    }
+    (void)sink;
+}
+
+// --- vertex expansion, every vertex lump type is pos_index, nrm_index, uv[2] and then whatever
+
+template <typename T>
+static void expand_range_scalar(const T* records, const vertex_t* positions, const vertex_t* normals, stk_vertex_t* out, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        const auto& vert = records[i];
+        auto&       dst  = out[i];
+        dst.pos          = positions[vert.pos_index];
+        dst.normal       = normals[vert.nrm_index];
+        dst.uv[0]        = vert.uv[0];
+        dst.uv[1]        = vert.uv[1];
+    }
+}
+
+#if defined(__AVX2__)
+// 8 vertices at a time: gather every component into its own register, then transpose 8x8 and
+// since stk_vertex_t is exactly 8 floats every row is a finished vertex
+template <typename T>
+static void expand_range(const T* records, const vertex_t* positions, const vertex_t* normals, stk_vertex_t* out, size_t begin, size_t end) {
+    static_assert(sizeof(T) % 4 == 0 && offsetof(T, nrm_index) == 4 && offsetof(T, uv) == 8);
+    static_assert(sizeof(stk_vertex_t) == 32);
+
+    const auto record_words = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(sizeof(T) / 4));
+    const auto three        = _mm256_set1_epi32(3);
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        auto rec = reinterpret_cast<const int*>(records + i);
+
+        const auto pos_idx = _mm256_mullo_epi32(_mm256_i32gather_epi32(rec, record_words, 4), three);
+        const auto nrm_idx = _mm256_mullo_epi32(_mm256_i32gather_epi32(rec + 1, record_words, 4), three);
+
+        auto pos = reinterpret_cast<const float*>(positions);
+        auto nrm = reinterpret_cast<const float*>(normals);
+        auto uvs = reinterpret_cast<const float*>(rec + 2);
+
+        __m256 r0 = _mm256_i32gather_ps(pos + 0, pos_idx, 4);
+        __m256 r1 = _mm256_i32gather_ps(pos + 1, pos_idx, 4);
+        __m256 r2 = _mm256_i32gather_ps(pos + 2, pos_idx, 4);
+        __m256 r3 = _mm256_i32gather_ps(nrm + 0, nrm_idx, 4);
+        __m256 r4 = _mm256_i32gather_ps(nrm + 1, nrm_idx, 4);
+        __m256 r5 = _mm256_i32gather_ps(nrm + 2, nrm_idx, 4);
+        __m256 r6 = _mm256_i32gather_ps(uvs + 0, record_words, 4);
+        __m256 r7 = _mm256_i32gather_ps(uvs + 1, record_words, 4);
+
+        // 8x8 transpose
+        const auto t0 = _mm256_unpacklo_ps(r0, r1);
+        const auto t1 = _mm256_unpackhi_ps(r0, r1);
+        const auto t2 = _mm256_unpacklo_ps(r2, r3);
+        const auto t3 = _mm256_unpackhi_ps(r2, r3);
+        const auto t4 = _mm256_unpacklo_ps(r4, r5);
+        const auto t5 = _mm256_unpackhi_ps(r4, r5);
+        const auto t6 = _mm256_unpacklo_ps(r6, r7);
+        const auto t7 = _mm256_unpackhi_ps(r6, r7);
+
+        const auto s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        const auto s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        const auto s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        const auto s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        const auto s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+        const auto s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        const auto s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+        const auto s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+        auto dst = reinterpret_cast<float*>(out + i);
+        _mm256_storeu_ps(dst + 0 * 8, _mm256_permute2f128_ps(s0, s4, 0x20));
+        _mm256_storeu_ps(dst + 1 * 8, _mm256_permute2f128_ps(s1, s5, 0x20));
+        _mm256_storeu_ps(dst + 2 * 8, _mm256_permute2f128_ps(s2, s6, 0x20));
+        _mm256_storeu_ps(dst + 3 * 8, _mm256_permute2f128_ps(s3, s7, 0x20));
+        _mm256_storeu_ps(dst + 4 * 8, _mm256_permute2f128_ps(s0, s4, 0x31));
+        _mm256_storeu_ps(dst + 5 * 8, _mm256_permute2f128_ps(s1, s5, 0x31));
+        _mm256_storeu_ps(dst + 6 * 8, _mm256_permute2f128_ps(s2, s6, 0x31));
+        _mm256_storeu_ps(dst + 7 * 8, _mm256_permute2f128_ps(s3, s7, 0x31));
+    }
+
+    expand_range_scalar(records, positions, normals, out, i, end);
+}
+#else
+// Positions/normals are random access, get them in flight a few records early
+template <typename T>
+static void expand_range(const T* records, const vertex_t* positions, const vertex_t* normals, stk_vertex_t* out, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+#if defined(__SSE__) || defined(_M_X64)
+        if (i + EXPAND_PREFETCH < end) {
+            const auto& ahead = records[i + EXPAND_PREFETCH];
+            _mm_prefetch(reinterpret_cast<const char*>(positions + ahead.pos_index), _MM_HINT_T0);
+            _mm_prefetch(reinterpret_cast<const char*>(normals + ahead.nrm_index), _MM_HINT_T0);
+        }
+#endif
+        expand_range_scalar(records, positions, normals, out, i, i + 1);
+    }
+}
+#endif
+
+template <typename T>
+static void expand_vertices(span<const T> records, span<const vertex_t> positions, span<const vertex_t> normals, stk_vertex_t* out, JobPool& jobs) {
+    jobs.parallel_for(records.size(), EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        expand_range(records.data(), positions.data(), normals.data(), out, begin, end);
+    });
+}
+
+// --- expand_selftest
+
+template <typename T>
+static bool check_expand(const char* name, span<const T> records, span<const vertex_t> positions, span<const vertex_t> normals, JobPool& jobs, std::ostream& out) {
+    const auto count = records.size();
+
+    std::vector<stk_vertex_t> reference(count), fast(count), pooled(count);
+    expand_range_scalar(records.data(), positions.data(), normals.data(), reference.data(), 0, count);
+    expand_range(records.data(), positions.data(), normals.data(), fast.data(), 0, count);
+    expand_vertices(records, positions, normals, pooled.data(), jobs);
+
+    // ranges that start and end off the vector width, like the chunks of parallel_for can
+    const size_t begin = std::min<size_t>(3, count), end = std::max(begin, count - std::min<size_t>(5, count));
+    std::vector<stk_vertex_t> ranged(reference);
+    if (end > begin)
+        memset(ranged.data() + begin, 0, (end - begin) * sizeof(stk_vertex_t));
+    expand_range(records.data(), positions.data(), normals.data(), ranged.data(), begin, end);
+
+    const auto bytes = count * sizeof(stk_vertex_t);
+    const bool succ  = !bytes || (!memcmp(reference.data(), fast.data(), bytes) && !memcmp(reference.data(), pooled.data(), bytes) && !memcmp(reference.data(), ranged.data(), bytes));
+    out << (succ ? "ok   " : "FAIL ") << name << " (" << count << " vertices)" << std::endl;
+    return succ;
+}
+
+bool expand_selftest(BspFile* bsp, JobPool& jobs, std::ostream& out) {
+    bool succ = true;
+
+    if (bsp) {
+        const auto positions = bsp->lump<LUMPS::VERTEX>();
+        const auto normals   = bsp->lump<LUMPS::VERTEX_NORMALS>();
+        succ &= check_expand("VERTEX_UNLIT", bsp->lump<LUMPS::VERTEX_UNLIT>(), positions, normals, jobs, out);
+        succ &= check_expand("VERTEX_LIT_FLAT", bsp->lump<LUMPS::VERTEX_LIT_FLAT>(), positions, normals, jobs, out);
+        succ &= check_expand("VERTEX_LIT_BUMP", bsp->lump<LUMPS::VERTEX_LIT_BUMP>(), positions, normals, jobs, out);
+        succ &= check_expand("VERTEX_UNLIT_TS", bsp->lump<LUMPS::VERTEX_UNLIT_TS>(), positions, normals, jobs, out);
+    }
+
+    // made up ones around the AVX2 width, the prefetch distance and the job chunk
+    std::vector<vertex_t> position_vec(1021), normal_vec(509);
+    for (size_t i = 0; i < position_vec.size(); i++) {
+        position_vec[i].x = float(i);
+        position_vec[i].y = float(i) * 0.5f;
+        position_vec[i].z = -float(i);
+    }
+    for (size_t i = 0; i < normal_vec.size(); i++) {
+        normal_vec[i].x = float(i) / normal_vec.size();
+        normal_vec[i].y = 1.f;
+        normal_vec[i].z = -float(i) / normal_vec.size();
+    }
+    const span<const vertex_t> positions{position_vec.data(), position_vec.size()};
+    const span<const vertex_t> normals{normal_vec.data(), normal_vec.size()};
+
+    for (const size_t count : {size_t(0), size_t(1), size_t(7), size_t(8), size_t(9), EXPAND_PREFETCH - 1, EXPAND_PREFETCH + 1, size_t(63), EXPAND_CHUNK + 13}) {
+        std::vector<vertex_lit_bump_t> lit_bump(count);
+        std::vector<vertex_unlit_ts_t> unlit_ts(count);
+        for (size_t i = 0; i < count; i++) {
+            // unrelated strides so the gathers don't land in order
+            const auto pos = uint32_t(i * 7919 % positions.size()), nrm = uint32_t(i * 104729 % normals.size());
+
+            lit_bump[i]           = {};
+            lit_bump[i].pos_index = pos;
+            lit_bump[i].nrm_index = nrm;
+            lit_bump[i].uv[0]     = float(i);
+            lit_bump[i].uv[1]     = -float(i);
+
+            unlit_ts[i]           = {};
+            unlit_ts[i].pos_index = pos;
+            unlit_ts[i].nrm_index = nrm;
+            unlit_ts[i].uv[0]     = float(i) * 0.25f;
+            unlit_ts[i].uv[1]     = 1.f;
+        }
+
+        succ &= check_expand("synthetic lit_bump", span<const vertex_lit_bump_t>{lit_bump.data(), count}, positions, normals, jobs, out);
+        succ &= check_expand("synthetic unlit_ts", span<const vertex_unlit_ts_t>{unlit_ts.data(), count}, positions, normals, jobs, out);
+    }
+
+    return succ;
+}
+
+template <typename T>
+static void copy_lump(span<const T> lump, std::vector<uint32_t>* res) {
+    static_assert(sizeof(T) % sizeof(uint32_t) == 0);
+
+    res->resize(lump.size() * sizeof(T) / sizeof(uint32_t));
+    if (!lump.empty())
+        memcpy(res->data(), lump.data(), lump.size() * sizeof(T));
+}
+
+// --- VERTEX_MODE::COMPACT
+
+static float sign_not_zero(float v) {
+    return v >= 0.f ? 1.f : -1.f;
+}
+
+static void oct_encode(const vertex_t& n, int16_t out[2]) {
+    const auto l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    auto       x  = l1 > 0.f ? n.x / l1 : 0.f;
+    auto       y  = l1 > 0.f ? n.y / l1 : 0.f;
+    if (n.z < 0.f) {
+        const auto ox = x;
+        x             = (1.f - std::abs(y)) * sign_not_zero(ox);
+        y             = (1.f - std::abs(ox)) * sign_not_zero(y);
+    }
+    out[0] = int16_t(std::lround(std::clamp(x, -1.f, 1.f) * 32767.f));
+    out[1] = int16_t(std::lround(std::clamp(y, -1.f, 1.f) * 32767.f));
+}
+
+// Same as the shader does it, snorm conversion included
+static vertex_t oct_decode(const int16_t in[2]) {
+    auto       x = std::max(in[0] / 32767.f, -1.f);
+    auto       y = std::max(in[1] / 32767.f, -1.f);
+    const auto z = 1.f - std::abs(x) - std::abs(y);
+    if (z < 0.f) {
+        const auto ox = x;
+        x             = (1.f - std::abs(y)) * sign_not_zero(ox);
+        y             = (1.f - std::abs(ox)) * sign_not_zero(y);
+    }
+    const auto len = std::sqrt(x * x + y * y + z * z);
+
+    vertex_t ret;
+    ret.x = x / len;
+    ret.y = y / len;
+    ret.z = z / len;
+    return ret;
+}
+
+bool mesh_vertex_normal(const stk_map_t& map, const mesh_parsed_t& mesh, uint32_t index, vertex_t* res) {
+    const auto v = size_t(mesh.dec.base_vertex) + index;
+
+    if (!map.vertex_vec.empty()) {
+        if (v >= map.vertex_vec.size())
+            return false;
+        *res = map.vertex_vec[v].normal;
+        return true;
+    }
+
+    if (map.vertex_mode == VERTEX_MODE::COMPACT) {
+        if (v >= map.compact_vec.size())
+            return false;
+        *res = oct_decode(map.compact_vec[v].normal);
+        return true;
+    }
+
+    if (map.vertex_mode == VERTEX_MODE::PULLING) {
+        const auto  stride = map.vertex_lump_strides[size_t(mesh.vertex_lump)];
+        const auto& lump   = map.vertex_lumps[size_t(mesh.vertex_lump)];
+        if (stride < 2 || v * stride + 1 >= lump.size() || lump[v * stride + 1] >= map.normals.size())
+            return false;
+        *res = map.normals[lump[v * stride + 1]];
+        return true;
+    }
+
+    return false;
+}
+
+// Every model gets bounds of its own, except vertices can be shared between models and then those
+// have to agree on them, so models sharing any vertex get merged into one group.
+// vertex_vec is the float reference for the error report and gets freed afterwards.
+static void quantize_vertices(stk_map_t& stk_map, JobPool& jobs) {
+    constexpr auto NONE = ~uint32_t(0);
+
+    const auto& vertices = stk_map.vertex_vec;
+    auto&       models   = stk_map.models;
+
+    std::vector<uint32_t> parent(models.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](uint32_t m) {
+        while (parent[m] != m) {
+            parent[m] = parent[parent[m]];
+            m         = parent[m];
+        }
+        return m;
+    };
+
+    std::vector<uint32_t> owner(vertices.size(), NONE);
+    for (uint32_t model_idx = 0; model_idx < models.size(); model_idx++) {
+        for (const auto& mesh : models[model_idx].meshes) {
+            for (uint32_t i = 0; i < mesh.dec.indices; i++) {
+                const auto v = size_t(mesh.dec.base_vertex) + mesh_index_at(stk_map, mesh, i);
+                if (v >= owner.size())
+                    continue;
+                if (owner[v] == NONE)
+                    owner[v] = model_idx;
+                else
+                    parent[find(owner[v])] = find(model_idx);
+            }
+        }
+    }
+
+    // flatten so the parallel part doesn't need find()
+    std::vector<uint32_t> model_group(models.size(), NONE);
+    size_t                groups_num = 0;
+    for (uint32_t model_idx = 0; model_idx < models.size(); model_idx++) {
+        const auto root = find(model_idx);
+        if (model_group[root] == NONE)
+            model_group[root] = uint32_t(groups_num++);
+        model_group[model_idx] = model_group[root];
+    }
+
+    std::vector<vertex_t> mins(groups_num), maxs(groups_num);
+    for (size_t g = 0; g < groups_num; g++) {
+        for (int c = 0; c < 3; c++) {
+            mins[g].coords[c] = INFINITY;
+            maxs[g].coords[c] = -INFINITY;
+        }
+    }
+    for (size_t v = 0; v < vertices.size(); v++) {
+        if (owner[v] == NONE)
+            continue;
+        const auto g = model_group[owner[v]];
+        for (int c = 0; c < 3; c++) {
+            mins[g].coords[c] = std::min(mins[g].coords[c], vertices[v].pos.coords[c]);
+            maxs[g].coords[c] = std::max(maxs[g].coords[c], vertices[v].pos.coords[c]);
+        }
+    }
+
+    // groups nobody references keep a zero scale
+    stk_map.quant_bounds.resize(groups_num);
+    for (size_t g = 0; g < groups_num; g++) {
+        auto& bounds = stk_map.quant_bounds[g];
+        for (int c = 0; c < 3; c++) {
+            const auto used        = mins[g].coords[c] <= maxs[g].coords[c];
+            bounds.offset.coords[c] = used ? mins[g].coords[c] : 0.f;
+            bounds.scale.coords[c]  = used ? (maxs[g].coords[c] - mins[g].coords[c]) / 65535.f : 0.f;
+        }
+    }
+
+    for (uint32_t model_idx = 0; model_idx < models.size(); model_idx++) {
+        for (auto& mesh : models[model_idx].meshes) {
+            mesh.quant_bounds = model_group[model_idx];
+        }
+    }
+
+    struct error_t {
+        double pos_sum = 0.0;
+        float  pos_max = 0.f;
+        float  nrm_max = 0.f; // cos of the worst angle is min'd instead
+        float  uv_max  = 0.f;
+        size_t checked = 0;
+    };
+    std::vector<error_t> errors((vertices.size() + EXPAND_CHUNK - 1) / EXPAND_CHUNK);
+    for (auto& error : errors) {
+        error.nrm_max = 1.f;
+    }
+
+    stk_map.compact_vec.resize(vertices.size());
+    jobs.parallel_for(vertices.size(), EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        auto& error = errors[begin / EXPAND_CHUNK];
+        for (size_t v = begin; v < end; v++) {
+            const auto& src = vertices[v];
+            auto&       dst = stk_map.compact_vec[v];
+            dst             = {};
+            if (owner[v] == NONE)
+                continue; // never drawn
+
+            const auto& bounds = stk_map.quant_bounds[model_group[owner[v]]];
+            vertex_t    pos;
+            for (int c = 0; c < 3; c++) {
+                const auto scale = bounds.scale.coords[c];
+                const auto q     = scale > 0.f ? std::lround((src.pos.coords[c] - bounds.offset.coords[c]) / scale) : 0;
+                dst.pos[c]       = uint16_t(std::clamp<long>(q, 0, 65535));
+                pos.coords[c]    = bounds.offset.coords[c] + dst.pos[c] * scale;
+            }
+            oct_encode(src.normal, dst.normal);
+            dst.uv[0] = glm::packHalf1x16(src.uv[0]);
+            dst.uv[1] = glm::packHalf1x16(src.uv[1]);
+
+            // error against the float path
+            const auto dx  = pos.x - src.pos.x;
+            const auto dy  = pos.y - src.pos.y;
+            const auto dz  = pos.z - src.pos.z;
+            const auto err = std::sqrt(dx * dx + dy * dy + dz * dz);
+            error.pos_sum += err;
+            error.pos_max = std::max(error.pos_max, err);
+
+            const auto nrm_len = std::sqrt(src.normal.x * src.normal.x + src.normal.y * src.normal.y + src.normal.z * src.normal.z);
+            if (nrm_len > 0.f) {
+                const auto nrm = oct_decode(dst.normal);
+                const auto cos = (nrm.x * src.normal.x + nrm.y * src.normal.y + nrm.z * src.normal.z) / nrm_len;
+                error.nrm_max  = std::min(error.nrm_max, cos);
+            }
+
+            for (int c = 0; c < 2; c++) {
+                error.uv_max = std::max(error.uv_max, std::abs(glm::unpackHalf1x16(dst.uv[c]) - src.uv[c]));
+            }
+            error.checked++;
+        }
+    });
+
+    error_t total;
+    total.nrm_max = 1.f;
+    for (const auto& error : errors) {
+        total.pos_sum += error.pos_sum;
+        total.pos_max = std::max(total.pos_max, error.pos_max);
+        total.nrm_max = std::min(total.nrm_max, error.nrm_max);
+        total.uv_max  = std::max(total.uv_max, error.uv_max);
+        total.checked += error.checked;
+    }
+
+    const auto nrm_degrees = std::acos(std::clamp(total.nrm_max, -1.f, 1.f)) * 57.2957795f;
+    std::printf("Compact vertices: %zu groups, %zu -> %zu bytes\n", groups_num, vertices.size() * sizeof(stk_vertex_t), stk_map.compact_vec.size() * sizeof(stk_vertex_compact_t));
+    std::printf("  position error max %f avg %f, normal error max %f deg, uv error max %f (%zu vertices)\n", total.pos_max,
+        total.checked ? total.pos_sum / total.checked : 0.0, nrm_degrees, total.uv_max, total.checked);
+
+    stk_map.vertex_vec = {};
+}
+
+// --- map_load_options_t::optimize_meshes
+
+// Meshes get reordered in place, a mesh sharing index range with another one is left alone
+static void optimize_meshes(stk_map_t& stk_map, JobPool& jobs) {
+    std::vector<mesh_parsed_t*> meshes;
+    for (auto& model : stk_map.models) {
+        for (auto& mesh : model.meshes) {
+            if (mesh.dec.indices >= 6)
+                meshes.push_back(&mesh);
+        }
+    }
+    std::sort(meshes.begin(), meshes.end(), [](const mesh_parsed_t* a, const mesh_parsed_t* b) { return a->dec.base_index < b->dec.base_index; });
+
+    std::vector<mesh_parsed_t*> independent;
+    uint32_t                    end = 0;
+    for (size_t i = 0; i < meshes.size(); i++) {
+        const auto mesh     = meshes[i];
+        const auto mesh_end = mesh->dec.base_index + mesh->dec.indices;
+        const auto overlaps = mesh->dec.base_index < end || (i + 1 < meshes.size() && meshes[i + 1]->dec.base_index < mesh_end);
+        end                 = std::max(end, mesh_end);
+        if (!overlaps && mesh_end <= stk_map.index_vec.size())
+            independent.push_back(mesh);
+    }
+
+    std::vector<mesh_cache_stats_t> before(independent.size()), after(independent.size());
+    jobs.parallel_for(independent.size(), 64, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> indices;
+        std::vector<vertex_t> positions;
+        for (size_t m = begin; m < end; m++) {
+            auto& mesh = *independent[m];
+            auto  src  = stk_map.index_vec.data() + mesh.dec.base_index;
+            indices.assign(src, src + mesh.dec.indices);
+
+            const size_t vertices = *std::max_element(indices.begin(), indices.end()) + 1;
+            positions.resize(vertices);
+            for (size_t v = 0; v < vertices; v++) {
+                if (!mesh_vertex_position(stk_map, mesh, uint32_t(v), &positions[v]))
+                    positions[v] = vertex_t{};
+            }
+
+            before[m] = mesh_cache_stats(indices.data(), indices.size(), vertices);
+            mesh_optimize(indices.data(), indices.size(), positions.data(), vertices);
+            after[m] = mesh_cache_stats(indices.data(), indices.size(), vertices);
+
+            std::copy(indices.begin(), indices.end(), src);
+        }
+    });
+
+    mesh_cache_stats_t total_before, total_after;
+    for (size_t m = 0; m < independent.size(); m++) {
+        total_before += before[m];
+        total_after += after[m];
+    }
+    std::printf("Optimized %zu of %zu meshes (cache %zu): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", independent.size(), meshes.size(), MESH_OPT_CACHE_SIZE,
+        total_before.acmr(), total_after.acmr(), total_before.atvr(), total_after.atvr());
+}
+
+// --- map_load_options_t::lods
+
+// Not worth simplifying below this
+constexpr size_t MAP_LOD_MIN_TRIANGLES = 64;
+// A level has to get rid of at least this much of the one before it to be kept
+constexpr float MAP_LOD_MIN_REDUCTION = 0.2f;
+// Collapses stop at this fraction of the mesh's radius even when they haven't hit the target
+constexpr float MAP_LOD_MAX_ERROR = 0.02f;
+
+// Level n aims for 1/2^n of the triangles, borders and seams stay put so every level fits with the meshes around it
+static void build_lods(stk_map_t& stk_map, JobPool& jobs) {
+    std::vector<mesh_parsed_t*> meshes;
+    for (auto& model : stk_map.models) {
+        for (auto& mesh : model.meshes) {
+            if (mesh.dec.indices / 3 >= MAP_LOD_MIN_TRIANGLES)
+                meshes.push_back(&mesh);
+        }
+    }
+
+    // levels get simplified from the one before, all of a mesh's ones back to back
+    std::vector<std::vector<uint32_t>> levels(meshes.size());
+    jobs.parallel_for(meshes.size(), 16, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> indices, simplified;
+        std::vector<vertex_t> positions;
+        for (size_t m = begin; m < end; m++) {
+            auto& mesh = *meshes[m];
+            indices.resize(mesh.dec.indices);
+            for (size_t i = 0; i < indices.size(); i++) {
+                indices[i] = mesh_index_at(stk_map, mesh, i);
+            }
+
+            const size_t vertices = *std::max_element(indices.begin(), indices.end()) + 1;
+            positions.resize(vertices);
+            float mins[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+            float maxs[3] = {-mins[0], -mins[1], -mins[2]};
+            for (size_t v = 0; v < vertices; v++) {
+                if (!mesh_vertex_position(stk_map, mesh, uint32_t(v), &positions[v]))
+                    positions[v] = vertex_t{};
+            }
+            for (const auto index : indices) {
+                for (int i = 0; i < 3; i++) {
+                    mins[i] = std::min(mins[i], positions[index].coords[i]);
+                    maxs[i] = std::max(maxs[i], positions[index].coords[i]);
+                }
+            }
+            float radius2 = 0.f;
+            for (int i = 0; i < 3; i++) {
+                mesh.lod_sphere[i] = (mins[i] + maxs[i]) * 0.5f;
+                radius2 += (maxs[i] - mins[i]) * (maxs[i] - mins[i]) * 0.25f;
+            }
+            mesh.lod_sphere[3] = std::sqrt(radius2);
+
+            for (size_t level = 1; level < MAP_LODS; level++) {
+                simplified.resize(indices.size());
+                float      error = 0.f;
+                const auto count = mesh_simplify(indices.data(), indices.size(), positions.data(), vertices, mesh.dec.indices >> level,
+                    MAP_LOD_MAX_ERROR * mesh.lod_sphere[3], simplified.data(), &error);
+                if (count > indices.size() * (1.f - MAP_LOD_MIN_REDUCTION))
+                    break;
+
+                auto& lod      = mesh.lods[mesh.lods_num++];
+                lod.indices    = uint32_t(count);
+                lod.error      = std::max(error, level > 1 ? mesh.lods[level - 2].error : 0.f);
+                lod.base_index = uint32_t(levels[m].size()); // relative until they are appended
+                levels[m].insert(levels[m].end(), simplified.begin(), simplified.begin() + count);
+                indices.assign(simplified.begin(), simplified.begin() + count);
+            }
+        }
+    });
+
+    size_t lod_meshes = 0, triangles[MAP_LODS] = {};
+    for (size_t m = 0; m < meshes.size(); m++) {
+        auto& mesh = *meshes[m];
+        triangles[0] += mesh.dec.indices / 3;
+        for (size_t level = 1; level < MAP_LODS; level++) {
+            triangles[level] += mesh_lod_dec(mesh, uint32_t(level)).indices / 3;
+        }
+        if (!mesh.lods_num)
+            continue;
+        lod_meshes++;
+
+        // subsets of the mesh's indices so they always fit 16 bits like the mesh's
+        const auto base = stk_map.index_vec.size();
+        for (uint32_t level = 0; level < mesh.lods_num; level++) {
+            mesh.lods[level].base_index += uint32_t(base);
+        }
+        stk_map.index_vec.insert(stk_map.index_vec.end(), levels[m].begin(), levels[m].end());
+    }
+    std::printf("LODs for %zu of %zu meshes: %zu -> %zu -> %zu triangles\n", lod_meshes, meshes.size(), triangles[0], triangles[1], triangles[2]);
+}
+
+// The mesh's MESH_BOUNDS box when the lump has it, otherwise the box of the mesh's vertices, or of its model when none of them can be read
+template <typename B, typename M>
+static void build_mesh_bounds(stk_map_t& stk_map, span<const B> mesh_bounds, span<const M> models, JobPool& jobs) {
+    std::vector<const mesh_parsed_t*> meshes;
+    std::vector<uint32_t>             mesh_models;
+    std::vector<size_t>               mesh_ids; // into the MESHES lump and so MESH_BOUNDS, models don't have to cover it in order
+    for (size_t m = 0; m < stk_map.models.size(); m++) {
+        for (size_t i = 0; i < stk_map.models[m].meshes.size(); i++) {
+            meshes.push_back(&stk_map.models[m].meshes[i]);
+            mesh_models.push_back(uint32_t(m));
+            mesh_ids.push_back(size_t(models[m].first_mesh) + i);
+        }
+    }
+
+    std::vector<float> boxes(meshes.size() * 6);
+    jobs.parallel_for(meshes.size(), 64, [&](size_t begin, size_t end) {
+        for (size_t m = begin; m < end; m++) {
+            auto mins = &boxes[m * 6], maxs = mins + 3;
+            if (mesh_ids[m] < mesh_bounds.size()) {
+                const auto& bounds = mesh_bounds[mesh_ids[m]];
+                for (int i = 0; i < 3; i++) {
+                    mins[i] = bounds.origin[i] - bounds.extents[i];
+                    maxs[i] = bounds.origin[i] + bounds.extents[i];
+                }
+                continue;
+            }
+
+            const auto& mesh = *meshes[m];
+            for (int i = 0; i < 3; i++) {
+                mins[i] = std::numeric_limits<float>::max();
+                maxs[i] = -std::numeric_limits<float>::max();
+            }
+            for (uint32_t i = 0; i < mesh.dec.indices; i++) {
+                vertex_t pos;
+                if (!mesh_vertex_position(stk_map, mesh, mesh_index_at(stk_map, mesh, i), &pos))
+                    continue;
+                for (int c = 0; c < 3; c++) {
+                    mins[c] = std::min(mins[c], pos.coords[c]);
+                    maxs[c] = std::max(maxs[c], pos.coords[c]);
+                }
+            }
+            if (mins[0] > maxs[0]) {
+                const auto& model = models[mesh_models[m]];
+                std::copy(model.mins, model.mins + 3, mins);
+                std::copy(model.maxs, model.maxs + 3, maxs);
+            }
+        }
+    });
+
+    stk_map.cull_bounds = {};
+    for (size_t m = 0; m < meshes.size(); m++) {
+        cull_bounds_push(&stk_map.cull_bounds, &boxes[m * 6], &boxes[m * 6 + 3]);
+    }
+    cull_bounds_pad(&stk_map.cull_bounds);
+}
+
+// One instance per BSP version, layouts come from bsp_lump_traits so nothing in here checks the version
+template <uint32_t V>
+static std::pair<bool, stk_map_t> load_map_version(BspFile& bsp, JobPool& jobs, const map_load_options_t& options, std::ostream* timings) {
+    // everything here is a view into the mapped file, nothing gets copied until it's converted
+    span<const bsp_lump_type_t<V, LUMPS::TEXTURE_DATA>>    texture_data;
+    span<const bsp_lump_type_t<V, LUMPS::SURFACE_NAMES>>   surface_names;
+    span<const bsp_lump_type_t<V, LUMPS::MODELS>>          models;
+    span<const bsp_lump_type_t<V, LUMPS::MESHES>>          meshes;
+    span<const bsp_lump_type_t<V, LUMPS::MESH_BOUNDS>>     mesh_bounds;
+    span<const bsp_lump_type_t<V, LUMPS::MATERIAL_SORT>>   material_sorts;
+    span<const bsp_lump_type_t<V, LUMPS::MESH_INDICIES>>   mesh_indicies;
+    span<const bsp_lump_type_t<V, LUMPS::VERTEX_UNLIT>>    vertex_unlit;
+    span<const bsp_lump_type_t<V, LUMPS::VERTEX_LIT_FLAT>> vertex_lit_flat;
+    span<const bsp_lump_type_t<V, LUMPS::VERTEX_LIT_BUMP>> vertex_lit_bump;
+    span<const bsp_lump_type_t<V, LUMPS::VERTEX_UNLIT_TS>> vertex_unlit_ts;
+    span<const bsp_lump_type_t<V, LUMPS::VERTEX>>          vertex;
+    span<const bsp_lump_type_t<V, LUMPS::VERTEX_NORMALS>>  vertex_normals;
+
+    size_t vertex_unlit_start    = 0;
+    size_t vertex_lit_flat_start = 0;
+    size_t vertex_lit_bump_start = 0;
+    size_t vertex_unlit_ts_start = 0;
+
+    stk_map_t stk_map;
+    bool      succ = true;
+
+    const bool pulling  = options.vertex_mode == VERTEX_MODE::PULLING;
+    stk_map.vertex_mode = options.vertex_mode;
+
+    TaskGraph graph;
+
+    // --- lumps
+    const auto t_texture_data   = graph.add("TEXTURE_DATA", [&]() { fault_in(texture_data = bsp.lump<V, LUMPS::TEXTURE_DATA>()); });
+    const auto t_surface_names  = graph.add("SURFACE_NAMES", [&]() { fault_in(surface_names = bsp.lump<V, LUMPS::SURFACE_NAMES>()); });
+    const auto t_models         = graph.add("MODELS", [&]() { fault_in(models = bsp.lump<V, LUMPS::MODELS>()); });
+    const auto t_meshes         = graph.add("MESHES", [&]() { fault_in(meshes = bsp.lump<V, LUMPS::MESHES>()); });
+    const auto t_mesh_bounds    = graph.add("MESH_BOUNDS", [&]() { fault_in(mesh_bounds = bsp.lump<V, LUMPS::MESH_BOUNDS>()); });
+    const auto t_material_sorts = graph.add("MATERIAL_SORT", [&]() { fault_in(material_sorts = bsp.lump<V, LUMPS::MATERIAL_SORT>()); });
+    const auto t_mesh_indicies  = graph.add("MESH_INDICIES", [&]() { fault_in(mesh_indicies = bsp.lump<V, LUMPS::MESH_INDICIES>()); });
+
+    const auto t_vertex_unlit    = graph.add("VERTEX_UNLIT", [&]() { fault_in(vertex_unlit = bsp.lump<V, LUMPS::VERTEX_UNLIT>()); });
+    const auto t_vertex_lit_flat = graph.add("VERTEX_LIT_FLAT", [&]() { fault_in(vertex_lit_flat = bsp.lump<V, LUMPS::VERTEX_LIT_FLAT>()); });
+    const auto t_vertex_lit_bump = graph.add("VERTEX_LIT_BUMP", [&]() { fault_in(vertex_lit_bump = bsp.lump<V, LUMPS::VERTEX_LIT_BUMP>()); });
+    const auto t_vertex_unlit_ts = graph.add("VERTEX_UNLIT_TS", [&]() { fault_in(vertex_unlit_ts = bsp.lump<V, LUMPS::VERTEX_UNLIT_TS>()); });
+    //auto vertex_blinn_phong = bsp.lump<V, LUMPS::VERTEX_BLINN_PHONG>(); // unused???
+
+    const auto t_vertex         = graph.add("VERTEX", [&]() { fault_in(vertex = bsp.lump<V, LUMPS::VERTEX>()); });
+    const auto t_vertex_normals = graph.add("VERTEX_NORMALS", [&]() { fault_in(vertex_normals = bsp.lump<V, LUMPS::VERTEX_NORMALS>()); });
+
+    // --- combine into one buffer???
+    // Start is needed when converting into big buffer indicies?
+    const auto t_vertex_alloc = graph.add(
+        "vertex alloc", [&]() {
+            vertex_unlit_start    = 0;
+            vertex_lit_flat_start = vertex_unlit_start + vertex_unlit.size();
+            vertex_lit_bump_start = vertex_lit_flat_start + vertex_lit_flat.size();
+            vertex_unlit_ts_start = vertex_lit_bump_start + vertex_lit_bump.size();
+            auto total_size       = vertex_unlit_ts_start + vertex_unlit_ts.size();
+            std::printf("[%zu]: %zu %zu %zu %zu\n", total_size, vertex_unlit_start, vertex_lit_flat_start, vertex_lit_bump_start, vertex_unlit_ts_start);
+
+            if (!pulling)
+                stk_map.vertex_vec.resize(total_size);
+        },
+        {t_vertex_unlit, t_vertex_lit_flat, t_vertex_lit_bump, t_vertex_unlit_ts});
+
+    // I feel like packin' today...
+    // Wait I can't pack... or can I???
+    // This is legit dumb...
+    std::vector<TaskGraph::task_id> t_vertex_data;
+    if (!pulling) {
+        t_vertex_data.push_back(graph.add("expand unlit", [&]() { expand_vertices(vertex_unlit, vertex, vertex_normals, stk_map.vertex_vec.data() + vertex_unlit_start, jobs); }, {t_vertex_alloc, t_vertex, t_vertex_normals}));
+        t_vertex_data.push_back(graph.add("expand lit_flat", [&]() { expand_vertices(vertex_lit_flat, vertex, vertex_normals, stk_map.vertex_vec.data() + vertex_lit_flat_start, jobs); }, {t_vertex_alloc, t_vertex, t_vertex_normals}));
+        t_vertex_data.push_back(graph.add("expand lit_bump", [&]() { expand_vertices(vertex_lit_bump, vertex, vertex_normals, stk_map.vertex_vec.data() + vertex_lit_bump_start, jobs); }, {t_vertex_alloc, t_vertex, t_vertex_normals}));
+        t_vertex_data.push_back(graph.add("expand unlit_ts", [&]() { expand_vertices(vertex_unlit_ts, vertex, vertex_normals, stk_map.vertex_vec.data() + vertex_unlit_ts_start, jobs); }, {t_vertex_alloc, t_vertex, t_vertex_normals}));
+    } else {
+        // nothing to expand, lumps go to the GPU as they are
+        t_vertex_data.push_back(graph.add("copy positions", [&]() { stk_map.positions.assign(vertex.begin(), vertex.end()); }, {t_vertex}));
+        t_vertex_data.push_back(graph.add("copy normals", [&]() { stk_map.normals.assign(vertex_normals.begin(), vertex_normals.end()); }, {t_vertex_normals}));
+        t_vertex_data.push_back(graph.add("copy unlit", [&]() { copy_lump(vertex_unlit, &stk_map.vertex_lumps[size_t(VERTEX_LUMP::UNLIT)]); }, {t_vertex_unlit}));
+        t_vertex_data.push_back(graph.add("copy lit_flat", [&]() { copy_lump(vertex_lit_flat, &stk_map.vertex_lumps[size_t(VERTEX_LUMP::LIT_FLAT)]); }, {t_vertex_lit_flat}));
+        t_vertex_data.push_back(graph.add("copy lit_bump", [&]() { copy_lump(vertex_lit_bump, &stk_map.vertex_lumps[size_t(VERTEX_LUMP::LIT_BUMP)]); }, {t_vertex_lit_bump}));
+        t_vertex_data.push_back(graph.add("copy unlit_ts", [&]() { copy_lump(vertex_unlit_ts, &stk_map.vertex_lumps[size_t(VERTEX_LUMP::UNLIT_TS)]); }, {t_vertex_unlit_ts}));
+
+        stk_map.vertex_lump_strides[size_t(VERTEX_LUMP::UNLIT)]    = sizeof(vertex_unlit_t) / sizeof(uint32_t);
+        stk_map.vertex_lump_strides[size_t(VERTEX_LUMP::LIT_FLAT)] = sizeof(vertex_lit_flat_t) / sizeof(uint32_t);
+        stk_map.vertex_lump_strides[size_t(VERTEX_LUMP::LIT_BUMP)] = sizeof(vertex_lit_bump_t) / sizeof(uint32_t);
+        stk_map.vertex_lump_strides[size_t(VERTEX_LUMP::UNLIT_TS)] = sizeof(vertex_unlit_ts_t) / sizeof(uint32_t);
+    }
+
+    const auto t_indices = graph.add(
+        "indices", [&]() {
+            // already 16 bit, base_vertex takes care of the offset
+            stk_map.index_vec.assign(mesh_indicies.begin(), mesh_indicies.end());
+        },
+        {t_mesh_indicies});
+
+    // --- models only need the vertex starts, not the vertices themselves
+    const auto t_models_parsed = graph.add(
+        "models", [&]() {
+            std::unordered_map<std::string, uint32_t> material_ids;
+
+            // Every index one lump has into another gets checked here, once. A bad model fails the load, a bad mesh
+            // gets an empty dec, so everything after this can trust dec (and the material) without checking again.
+            size_t bad_meshes = 0;
+
+            std::vector<model_parsed_t> models_parsed;
+            models_parsed.reserve(models.size());
+            for (const auto& model : models) {
+                if (size_t(model.first_mesh) + model.num_meshes > meshes.size()) {
+                    std::cerr << "Model meshes [" << model.first_mesh << ", " << size_t(model.first_mesh) + model.num_meshes << ") are out of MESHES (" << meshes.size()
+                              << ")" << std::endl;
+                    succ = false;
+                    return;
+                }
+
+                std::vector<mesh_parsed_t> meshes_parsed(model.num_meshes);
+                for (size_t mesh_idx = model.first_mesh; mesh_idx < size_t(model.first_mesh) + model.num_meshes; mesh_idx++) {
+                    const auto& mesh = meshes[mesh_idx];
+
+                    const auto start = mesh.first_mesh_index;
+
+                    const auto material_sort     = mesh.material_sort < material_sorts.size() ? &material_sorts[mesh.material_sort] : nullptr;
+                    const auto texture_data_elem = material_sort && material_sort->texture_data < texture_data.size() ? &texture_data[material_sort->texture_data] : nullptr;
+                    const auto name_begin        = surface_names.begin() + std::min<size_t>(texture_data_elem ? texture_data_elem->name_index : surface_names.size(), surface_names.size());
+                    // names have to end inside the lump too
+                    const auto name_end = std::find(name_begin, surface_names.end(), '\0');
+                    const auto valid    = texture_data_elem && name_end != surface_names.end() && size_t(start) + size_t(mesh.num_triangles) * 3 <= mesh_indicies.size();
+                    if (!valid)
+                        bad_meshes++;
+
+                    const auto surface_name_std = valid ? std::string(name_begin, name_end) : std::string();
+                    auto       surface_name     = std::string(surface_name_std);
+
+                    std::transform(surface_name_std.begin(), surface_name_std.end(), surface_name.begin(), [](char c) {if (c == '\\') return (int)'/'; else return ::tolower(c); });
+
+                    const auto  type             = mesh.flags & uint32_t(VERTEX_FLAGS::MASK);
+                    size_t      additional_start = 0;
+                    VERTEX_LUMP vertex_lump;
+                    switch (VERTEX_FLAGS(type)) {
+                    case VERTEX_FLAGS::VERTEX_UNLIT:
+                        additional_start = vertex_unlit_start;
+                        vertex_lump      = VERTEX_LUMP::UNLIT;
+                        break;
+                    case VERTEX_FLAGS::VERTEX_UNLIT_TS:
+                        additional_start = vertex_unlit_ts_start;
+                        vertex_lump      = VERTEX_LUMP::UNLIT_TS;
+                        break;
+                    case VERTEX_FLAGS::VERTEX_LIT_FLAT:
+                        additional_start = vertex_lit_flat_start;
+                        vertex_lump      = VERTEX_LUMP::LIT_FLAT;
+                        break;
+                    case VERTEX_FLAGS::VERTEX_LIT_BUMP:
+                        additional_start = vertex_lit_bump_start;
+                        vertex_lump      = VERTEX_LUMP::LIT_BUMP;
+                        break;
+                    default:
+                        std::cerr << "WHAT???" << std::endl;
+                        succ = false;
+                        return;
+                    }
+
+                    // const auto base_vertex = material_sort.vertex_offset;
+                    // const auto indicies
+                    dec_t dec;
+                    dec.indices     = mesh.num_triangles * 3;
+                    dec.base_index  = start;
+                    dec.base_vertex = (pulling ? 0 : additional_start) + (material_sort ? material_sort->vertex_offset : 0);
+                    // base_index = vertex_unlit + vertex_lit_flat + vertex_lit_bump + vertex_unlit_ts
+                    // base_vertex = NEEDED_BUFFER_START + vertex_offset
+                    // index = base_vertex + base_index[i] = NEEDED_BUFFER_START + vertex_offset + base_index[i] = vertex_offset + NEEDED_BUFFER[i]
+                    // vertex = indicies[index]
+
+                    mesh_parsed_t mp;
+                    mp.dec         = dec;
+                    mp.flag        = VERTEX_FLAGS(type);
+                    mp.vertex_lump = vertex_lump;
+
+                    auto material = material_ids.find(surface_name);
+                    if (material == material_ids.end()) {
+                        material = material_ids.emplace(surface_name, uint32_t(stk_map.materials.size())).first;
+                        stk_map.materials.push_back(surface_name);
+                    }
+                    mp.material = material->second;
+
+                    constexpr auto unwanted_flags = uint32_t(VERTEX_FLAGS::SKY) | uint32_t(VERTEX_FLAGS::SKY_2D) | uint32_t(VERTEX_FLAGS::TRIGGER);
+                    if (mesh.flags & unwanted_flags) {
+                        mp.dec = dec_t{};
+                        std::cerr << "DISCARDING UNWANTED MESH WITH SIZE OF " << mesh.num_triangles << std::endl;
+                    }
+                    if (!valid)
+                        mp.dec = dec_t{};
+
+                    meshes_parsed[mesh_idx - model.first_mesh] = std::move(mp);
+                }
+
+                model_parsed_t model_parsed;
+                model_parsed.meshes = std::move(meshes_parsed);
+                models_parsed.push_back(model_parsed);
+            }
+            if (bad_meshes)
+                std::cerr << bad_meshes << " meshes point outside of MATERIAL_SORT, TEXTURE_DATA, SURFACE_NAMES or MESH_INDICIES, they won't be drawn" << std::endl;
+
+            stk_map.models = std::move(models_parsed);
+        },
+        {t_texture_data, t_surface_names, t_models, t_meshes, t_material_sorts, t_vertex_alloc});
+
+    const auto t_mesh_ranges = graph.add(
+        "mesh ranges", [&]() {
+            // where each vertex lump ends in whatever base_vertex points into
+            const size_t lump_ends[size_t(VERTEX_LUMP::COUNT)] = {
+                (pulling ? 0 : vertex_unlit_start) + vertex_unlit.size(),
+                (pulling ? 0 : vertex_lit_flat_start) + vertex_lit_flat.size(),
+                (pulling ? 0 : vertex_lit_bump_start) + vertex_lit_bump.size(),
+                (pulling ? 0 : vertex_unlit_ts_start) + vertex_unlit_ts.size(),
+            };
+
+            size_t bad_meshes = 0;
+            for (auto& model : stk_map.models) {
+                for (auto& mesh : model.meshes) {
+                    uint32_t highest = 0;
+                    for (uint32_t i = 0; i < mesh.dec.indices; i++) {
+                        highest = std::max(highest, mesh_index_at(stk_map, mesh, i));
+                    }
+                    mesh.vertex_end = mesh.dec.indices ? mesh.dec.base_vertex + highest + 1 : 0;
+                    // same as the models task, past here vertex_end is inside the vertices
+                    if (size_t(mesh.dec.base_vertex) + highest + 1 > lump_ends[size_t(mesh.vertex_lump)] && mesh.dec.indices) {
+                        mesh.dec        = dec_t{};
+                        mesh.vertex_end = 0;
+                        bad_meshes++;
+                    }
+                }
+            }
+            if (bad_meshes)
+                std::cerr << bad_meshes << " meshes index past the end of their vertex lump, they won't be drawn" << std::endl;
+        },
+        {t_indices, t_models_parsed});
+
+    auto t_processed = t_vertex_data;
+    t_processed.push_back(t_mesh_ranges);
+
+    if (options.optimize_meshes) {
+        // needs the float positions so this goes before quantizing
+        t_processed = {graph.add("optimize meshes", [&]() { if (succ) optimize_meshes(stk_map, jobs); }, t_processed)};
+    }
+
+    // after anything that reorders indices, before the float positions are gone
+    auto t_bounds_deps = t_processed;
+    t_bounds_deps.push_back(t_mesh_bounds);
+    // options.bvh_input only gathers, the caller builds it after handing the map on
+    const auto bvh = [&]() {
+        if (options.bvh_input)
+            gather_bvh_input(stk_map, jobs, options.bvh_input);
+        else
+            build_bvh(stk_map, jobs, &stk_map.bvh);
+    };
+    t_processed = {graph.add("bvh", [&]() { if (succ) bvh(); }, t_processed),
+        graph.add("mesh bounds", [&]() { if (succ) build_mesh_bounds(stk_map, mesh_bounds, models, jobs); }, t_bounds_deps)};
+
+    if (options.lods) {
+        // appends to the index vectors so nothing else can be reading them
+        t_processed = {graph.add("lods", [&]() { if (succ) build_lods(stk_map, jobs); }, t_processed)};
+    }
+
+    if (options.vertex_mode == VERTEX_MODE::COMPACT) {
+        graph.add("quantize", [&]() { if (succ) quantize_vertices(stk_map, jobs); }, t_processed);
+    }
+
+    if (options.progress)
+        options.progress->total = graph.size();
+    graph.run(jobs, options.progress ? &options.progress->done : nullptr);
+
+    if (timings) {
+        graph.print_timings(*timings);
+    }
+
+    if (!succ) {
+        return {false, stk_map_t()};
+    }
+
+    return {true, std::move(stk_map)}; // ???
+}
+
+std::pair<bool, stk_map_t> load_map(BspFile& bsp, JobPool& jobs, const map_load_options_t& options, std::ostream* timings) {
+    const auto& header = bsp.header();
+    if (header.header != BSP_MAGIC) {
+        std::cerr << bsp.path() << " isn't a BSP" << std::endl;
+        return {false, stk_map_t{}};
+    }
+
+    switch (header.version) {
+    // Nothing specializes bsp_lump_traits yet so every version reads the same layouts through one instance.
+    // A version that gets a specialization moves to a case of its own calling load_map_version with itself.
+    case 47:
+    case 48:
+    case 49:
+    case 50:
+        return load_map_version<BSP_VERSION_MIN>(bsp, jobs, options, timings);
+    default:
+        // what loaded before versions were looked at, the lump checks still warn about layouts that don't fit
+        std::cerr << bsp.path() << " is BSP version " << header.version << ", only " << BSP_VERSION_MIN << "-" << BSP_VERSION_MAX
+                  << " are known, reading it like " << BSP_VERSION_MIN << std::endl;
+        return load_map_version<BSP_VERSION_MIN>(bsp, jobs, options, timings);
+    }
+}
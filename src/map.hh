@@ -0,0 +1,246 @@
+#pragma once
+
+#include "bsp.hh"
+#include "bvh.hh"
+#include "cull.hh"
+#include "jobs.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// GL names in here are plain uint32_t so loading doesn't need GL (or a context), upload_map fills them in
+
+enum class VERTEX_MODE : uint32_t {
+    EXPANDED, // stk_vertex_t per vertex
+    PULLING, // vertex lumps as they are in the BSP, the vertex shader does the lookups
+    COMPACT, // stk_vertex_compact_t, quantized against the bounds of the model
+};
+
+// Order the vertex lumps are laid out in, in the big buffer or as SSBOs
+enum class VERTEX_LUMP : uint8_t {
+    UNLIT,
+    LIT_FLAT,
+    LIT_BUMP,
+    UNLIT_TS,
+
+    COUNT,
+};
+
+// Loading stages done out of all of them, for progress bars on other threads
+struct map_load_progress_t {
+    std::atomic<size_t> done  = 0;
+    std::atomic<size_t> total = 0;
+};
+
+struct map_load_options_t {
+    VERTEX_MODE vertex_mode = VERTEX_MODE::EXPANDED;
+
+    bool optimize_meshes = false; // triangle order for the vertex cache and overdraw, see mesh_opt.hh
+    bool lods            = false; // simplified index buffers per mesh, see mesh_simplify.hh
+
+    // set and the BVH is left to the caller, load_map only gathers what build_bvh needs in here
+    bvh_input_t*         bvh_input = nullptr;
+    map_load_progress_t* progress  = nullptr;
+};
+
+// dac wasn't used because this game is based on indicies
+// struct dac_t final {
+//     uint32_t vertices;
+//     uint32_t instances = 1; // I never set this...
+//     uint32_t base_vertex;
+//     uint32_t base_instance = 0; // I never set this...
+// };
+
+struct dec_t final {
+    uint32_t indices; // count
+    uint32_t instances = 1; // I never set this...
+    uint32_t base_index;
+    uint32_t base_vertex;
+    uint32_t base_instance = 0; // I never set this...
+};
+
+// Levels a mesh can have counting the original one
+constexpr size_t MAP_LODS = 3;
+
+// A coarser index range over the vertices of the mesh, same index width as the mesh
+struct mesh_lod_t {
+    uint32_t indices; // count
+    uint32_t base_index;
+    float    error; // world units the surface moved at most (about)
+};
+
+struct mesh_parsed_t {
+    dec_t        dec; // move to implement MDI?
+    uint32_t     dec_buf = 0; // buffer associated with the dec, the ones of the lods follow it
+    VERTEX_FLAGS flag;
+    VERTEX_LUMP  vertex_lump; // which lump base_vertex points into when pulling
+    uint32_t     material     = 0; // index into stk_map_t::materials
+    uint32_t     quant_bounds = 0; // index into stk_map_t::quant_bounds
+    uint32_t     texture      = 0;
+    bool         textured     = false;
+    bool         draw         = true;
+    bool         resident     = true; // streaming, its cell is in the arena
+    uint32_t     vertex_end   = 0; // base_vertex + highest index + 1, how much of the vertex buffer it needs
+
+    // map_load_options_t::lods
+    mesh_lod_t lods[MAP_LODS - 1] = {}; // levels 1 and up, level 0 is dec
+    uint32_t   lods_num           = 0;
+    float      lod_sphere[4]      = {}; // center xyz and radius
+};
+
+struct model_parsed_t {
+    std::vector<mesh_parsed_t> meshes;
+    bool                       drawable      = false; // level 0 of everything it draws is on the GPU
+    bool                       lods_drawable = false; // the levels past 0 too, their indices come after every mesh's level 0 ones
+};
+
+struct stk_vertex_t {
+    vertex_t pos;
+    vertex_t normal;
+    float    uv[2];
+    // bool     texture = false;
+};
+static_assert(sizeof(stk_vertex_t) == 32);
+
+struct stk_vertex_compact_t {
+    uint16_t pos[3]; // dequantized with the quant_bounds_t of the mesh
+    uint16_t _pad;
+    int16_t  normal[2]; // octahedral, snorm
+    uint16_t uv[2]; // half floats
+};
+static_assert(sizeof(stk_vertex_compact_t) == 16);
+
+// pos = offset + pos_quantized * scale
+struct quant_bounds_t {
+    vertex_t offset;
+    vertex_t scale;
+};
+
+struct texture_t {
+    std::string material_name;
+    uint32_t    texture;
+};
+
+struct stk_map_t {
+    uint32_t gl_vertex_array = 0;
+
+    uint32_t              index_buffer = 0;
+    std::vector<uint16_t> index_vec;
+
+    VERTEX_MODE vertex_mode = VERTEX_MODE::EXPANDED;
+
+    // VERTEX_MODE::EXPANDED
+    uint32_t                  vertex_buffer = 0;
+    std::vector<stk_vertex_t> vertex_vec;
+
+    // VERTEX_MODE::COMPACT, goes into vertex_buffer too
+    std::vector<stk_vertex_compact_t> compact_vec;
+    std::vector<quant_bounds_t>       quant_bounds;
+
+    // VERTEX_MODE::PULLING, positions/normals are stored once and vertex lumps are raw uint32s
+    uint32_t              positions_buffer = 0;
+    uint32_t              normals_buffer   = 0;
+    std::vector<vertex_t> positions;
+    std::vector<vertex_t> normals;
+
+    uint32_t              vertex_lump_buffers[size_t(VERTEX_LUMP::COUNT)] = {};
+    uint32_t              vertex_lump_strides[size_t(VERTEX_LUMP::COUNT)] = {}; // in uint32s
+    std::vector<uint32_t> vertex_lumps[size_t(VERTEX_LUMP::COUNT)];
+
+    std::vector<model_parsed_t> models;
+
+    // surface names, lowercase with forward slashes like the rpak ones
+    std::vector<std::string> materials;
+
+    std::unordered_map<std::string, texture_t> textures;
+
+    bvh_t bvh;
+
+    // per mesh, for frustum culling
+    cull_bounds_t cull_bounds;
+
+    bool loaded = false;
+};
+
+// Unchecked, load_map empties the dec of any mesh whose range isn't inside index_vec
+inline uint32_t mesh_index_at(const stk_map_t& map, const mesh_parsed_t& mesh, size_t i) {
+    return map.index_vec[mesh.dec.base_index + i];
+}
+
+// Position of a mesh vertex in whatever form the map has them, false if index points outside of the vertices
+inline bool mesh_vertex_position(const stk_map_t& map, const mesh_parsed_t& mesh, uint32_t index, vertex_t* res) {
+    const auto v = size_t(mesh.dec.base_vertex) + index;
+
+    // compact maps still have the floats until they get quantized
+    if (!map.vertex_vec.empty()) {
+        if (v >= map.vertex_vec.size())
+            return false;
+        *res = map.vertex_vec[v].pos;
+        return true;
+    }
+
+    if (map.vertex_mode == VERTEX_MODE::COMPACT) {
+        if (v >= map.compact_vec.size() || mesh.quant_bounds >= map.quant_bounds.size())
+            return false;
+        const auto& bounds = map.quant_bounds[mesh.quant_bounds];
+        for (int i = 0; i < 3; i++) {
+            res->coords[i] = bounds.offset.coords[i] + map.compact_vec[v].pos[i] * bounds.scale.coords[i];
+        }
+        return true;
+    }
+
+    if (map.vertex_mode == VERTEX_MODE::PULLING) {
+        const auto  stride = map.vertex_lump_strides[size_t(mesh.vertex_lump)];
+        const auto& lump   = map.vertex_lumps[size_t(mesh.vertex_lump)];
+        if (!stride || v * stride >= lump.size() || lump[v * stride] >= map.positions.size())
+            return false;
+        *res = map.positions[lump[v * stride]];
+        return true;
+    }
+
+    return false;
+}
+
+// Same as mesh_vertex_position but the normal, compact ones come out decoded
+bool mesh_vertex_normal(const stk_map_t& map, const mesh_parsed_t& mesh, uint32_t index, vertex_t* res);
+
+// Draw command of a level, anything past the last one the mesh has is its last one
+inline dec_t mesh_lod_dec(const mesh_parsed_t& mesh, uint32_t lod) {
+    auto dec = mesh.dec;
+    if (lod && mesh.lods_num) {
+        const auto& level = mesh.lods[std::min(lod, mesh.lods_num) - 1];
+        dec.indices       = level.indices;
+        dec.base_index    = level.base_index;
+    }
+    return dec;
+}
+
+// Coarsest level whose error is at most max_pixels on screen.
+// pixels_per_unit - how big one world unit is at distance 1, proj[1][1] * viewport height / 2
+inline uint32_t mesh_pick_lod(const mesh_parsed_t& mesh, const float camera[3], float pixels_per_unit, float max_pixels) {
+    float d2 = 0.f;
+    for (int i = 0; i < 3; i++) {
+        d2 += (camera[i] - mesh.lod_sphere[i]) * (camera[i] - mesh.lod_sphere[i]);
+    }
+    const auto distance = std::sqrt(d2) - mesh.lod_sphere[3];
+    if (distance <= 0.f)
+        return 0;
+
+    uint32_t lod = 0;
+    while (lod < mesh.lods_num && mesh.lods[lod].error * pixels_per_unit <= max_pixels * distance)
+        lod++;
+    return lod;
+}
+
+// Checks the vertex expansion kernels this was built with against the scalar one, on the vertex lumps of bsp
+// (if not null) and on made up ones sized around the vector width, prints a line per input to out
+bool expand_selftest(BspFile* bsp, JobPool& jobs, std::ostream& out);
+
+// CPU side of loading, lumps get read and converted on the pool.
+// timings - per lump/stage timings get printed here if not null
+std::pair<bool, stk_map_t> load_map(BspFile& bsp, JobPool& jobs, const map_load_options_t& options = {}, std::ostream* timings = nullptr);
@@ -0,0 +1,443 @@
+#include "map_cache.hh"
+
+#include "hash.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <type_traits>
+
+namespace fs = std::filesystem;
+
+constexpr uint32_t MAP_CACHE_MAGIC = 'CM5R';
+// Bump whenever stk_map_t or anything stored in it changes
+constexpr uint32_t MAP_CACHE_VERSION = 10;
+// Arrays start aligned so they can be read straight out of the mapping
+constexpr size_t MAP_CACHE_ALIGN = 16;
+
+static_assert(std::is_trivially_copyable_v<mesh_parsed_t>);
+
+struct map_cache_header_t {
+    uint32_t magic;
+    uint32_t version;
+
+    // layouts we can't version by hand
+    uint32_t mesh_size;
+    uint32_t vertex_size;
+
+    uint64_t size;
+    int64_t  mtime;
+    uint64_t header_hash;
+    uint64_t lumps_hash;
+    uint32_t vertex_mode;
+    uint32_t optimize_meshes;
+    uint32_t lods;
+
+    uint64_t total_size;
+};
+
+class cache_writer_t {
+public:
+    template <typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const auto at = this->data.size();
+        this->data.resize(at + sizeof(T));
+        memcpy(this->data.data() + at, &value, sizeof(T));
+    }
+
+    template <typename T>
+    void put_array(const T* values, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        this->put(uint64_t(count));
+        this->data.resize(((this->base + this->data.size() + MAP_CACHE_ALIGN - 1) & ~(MAP_CACHE_ALIGN - 1)) - this->base);
+        const auto at = this->data.size();
+        this->data.resize(at + count * sizeof(T));
+        if (count)
+            memcpy(this->data.data() + at, values, count * sizeof(T));
+    }
+
+    template <typename T>
+    void put_vector(const std::vector<T>& values) {
+        this->put_array(values.data(), values.size());
+    }
+
+    void put_string(const std::string& value) { this->put_array(value.data(), value.size()); }
+
+    std::vector<uint8_t> data;
+    size_t               base = 0; // where data goes in the file, alignment is in file offsets
+};
+
+// Reads are bounds checked so a truncated file just fails, what the records point at gets checked by map_valid
+class cache_reader_t {
+public:
+    cache_reader_t(const uint8_t* data, size_t size, size_t at) : data(data), size(size), at(at) {}
+
+    template <typename T>
+    bool get(T* value) {
+        if (this->at + sizeof(T) > this->size)
+            return false;
+        memcpy(value, this->data + this->at, sizeof(T));
+        this->at += sizeof(T);
+        return true;
+    }
+
+    template <typename T>
+    bool get_vector(std::vector<T>* values) {
+        uint64_t count;
+        if (!this->get(&count))
+            return false;
+        this->at = (this->at + MAP_CACHE_ALIGN - 1) & ~(MAP_CACHE_ALIGN - 1);
+        if (this->at > this->size || count > (this->size - this->at) / sizeof(T))
+            return false;
+
+        auto begin = reinterpret_cast<const T*>(this->data + this->at);
+        values->assign(begin, begin + count);
+        this->at += count * sizeof(T);
+        return true;
+    }
+
+    bool get_string(std::string* value) {
+        std::vector<char> chars;
+        if (!this->get_vector(&chars))
+            return false;
+        value->assign(chars.begin(), chars.end());
+        return true;
+    }
+
+private:
+    const uint8_t* data;
+    size_t         size;
+    size_t         at;
+};
+
+MapCache::MapCache(const std::string& root) : root(root) {
+}
+
+bool MapCache::make_key(const BspFile& bsp, const map_load_options_t& options, key_t* key) const {
+    std::error_code ec;
+    key->size = fs::file_size(bsp.path(), ec);
+    if (ec)
+        return false;
+    key->mtime = fs::last_write_time(bsp.path(), ec).time_since_epoch().count();
+    if (ec)
+        return false;
+
+    key->header_hash     = hash_bytes(&bsp.header(), sizeof(bsp_header_t));
+
+    // most of a shipped map is in .bsp_lump files, any of them can change without the .bsp doing so
+    key->lumps_hash = 0;
+    for (uint32_t lump = 0; lump < std::size(bsp.header().lumps); lump++) {
+        char suffix[20];
+        sprintf(suffix, ".%04x.bsp_lump", lump);
+        const auto path = bsp.path() + suffix;
+
+        const auto size = fs::file_size(path, ec);
+        if (ec)
+            continue;
+        const auto mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+        if (ec)
+            return false;
+
+        const uint64_t entry[3] = {lump, size, uint64_t(mtime)};
+        key->lumps_hash         = hash_bytes(entry, sizeof(entry), key->lumps_hash);
+    }
+
+    key->vertex_mode     = uint32_t(options.vertex_mode);
+    key->optimize_meshes = options.optimize_meshes;
+    key->lods            = options.lods;
+    key->_pad            = 0;
+    return true;
+}
+
+std::string MapCache::entry_path(const BspFile& bsp, const key_t& key) const {
+    const auto key_hash = hash_bytes(&key, sizeof(key));
+
+    char buf[24];
+    sprintf(buf, "-%016llx", (unsigned long long)key_hash);
+    return (fs::path(this->root) / (fs::path(bsp.path()).stem().string() + buf + ".mapcache")).string();
+}
+
+bool MapCache::put_begin(const BspFile& bsp, const map_load_options_t& options, const stk_map_t& map, map_cache_pending_t* pending) const {
+    key_t key;
+    if (!this->make_key(bsp, options, &key))
+        return false;
+
+    cache_writer_t writer;
+
+    map_cache_header_t header = {};
+    header.magic              = MAP_CACHE_MAGIC;
+    header.version            = MAP_CACHE_VERSION;
+    header.mesh_size          = sizeof(mesh_parsed_t);
+    header.vertex_size        = sizeof(stk_vertex_t);
+    header.size               = key.size;
+    header.mtime              = key.mtime;
+    header.header_hash        = key.header_hash;
+    header.lumps_hash         = key.lumps_hash;
+    header.vertex_mode        = key.vertex_mode;
+    header.optimize_meshes    = key.optimize_meshes;
+    header.lods               = key.lods;
+    writer.put(header);
+
+    writer.put(uint64_t(map.models.size()));
+    for (const auto& model : map.models) {
+        writer.put_vector(model.meshes);
+    }
+
+    writer.put(uint64_t(map.materials.size()));
+    for (const auto& material : map.materials) {
+        writer.put_string(material);
+    }
+
+    writer.put_vector(map.index_vec);
+
+    writer.put_vector(map.vertex_vec);
+    writer.put_vector(map.compact_vec);
+    writer.put_vector(map.quant_bounds);
+
+    writer.put_vector(map.positions);
+    writer.put_vector(map.normals);
+    for (size_t i = 0; i < size_t(VERTEX_LUMP::COUNT); i++) {
+        writer.put(map.vertex_lump_strides[i]);
+        writer.put_vector(map.vertex_lumps[i]);
+    }
+
+    writer.put(uint64_t(map.cull_bounds.count));
+    for (int i = 0; i < 3; i++) {
+        writer.put_vector(map.cull_bounds.center[i]);
+        writer.put_vector(map.cull_bounds.extent[i]);
+    }
+
+    // total_size stays 0 until put_finish, the BVH goes last
+    pending->path = this->entry_path(bsp, key);
+    pending->size = writer.data.size();
+    fs::create_directories(this->root);
+
+    std::ofstream f(pending->path + ".tmp", std::ofstream::binary);
+    f.write((const char*)writer.data.data(), writer.data.size());
+    f.close();
+    return !f.fail();
+}
+
+bool MapCache::put_finish(const map_cache_pending_t& pending, const bvh_t& bvh) const {
+    cache_writer_t writer;
+    writer.base = pending.size;
+    writer.put_vector(bvh.nodes);
+    writer.put_vector(bvh.refs);
+    writer.put_vector(bvh.triangles);
+    writer.put(bvh.depth);
+
+    const auto tmp = pending.path + ".tmp";
+    {
+        std::fstream f(tmp, std::fstream::in | std::fstream::out | std::fstream::binary);
+        f.seekp(pending.size);
+        f.write((const char*)writer.data.data(), writer.data.size());
+        const uint64_t total_size = pending.size + writer.data.size();
+        f.seekp(offsetof(map_cache_header_t, total_size));
+        f.write((const char*)&total_size, sizeof(total_size));
+        f.close();
+        if (f.fail())
+            return false;
+    }
+
+    // rename so a half written file never looks valid
+    std::error_code ec;
+    fs::rename(tmp, pending.path, ec);
+    return !ec;
+}
+
+bool MapCache::put(const BspFile& bsp, const map_load_options_t& options, const stk_map_t& map) const {
+    map_cache_pending_t pending;
+    return this->put_begin(bsp, options, map, &pending) && this->put_finish(pending, map.bvh);
+}
+
+// Vertices a mesh's base_vertex + index can reach in the buffer it gets drawn from
+static size_t mesh_vertices(const stk_map_t& map, const mesh_parsed_t& mesh) {
+    switch (map.vertex_mode) {
+    case VERTEX_MODE::EXPANDED:
+        return map.vertex_vec.size();
+    case VERTEX_MODE::COMPACT:
+        return map.compact_vec.size();
+    case VERTEX_MODE::PULLING: {
+        const auto stride = map.vertex_lump_strides[size_t(mesh.vertex_lump)];
+        return stride ? map.vertex_lumps[size_t(mesh.vertex_lump)].size() / stride : 0;
+    }
+    }
+    return 0;
+}
+
+static bool index_range_valid(const stk_map_t& map, uint32_t base_index, uint32_t indices, uint32_t base_vertex, size_t vertices) {
+    if (size_t(base_index) + indices > map.index_vec.size())
+        return false;
+    for (uint32_t i = 0; i < indices; i++) {
+        if (size_t(base_vertex) + map.index_vec[size_t(base_index) + i] >= vertices)
+            return false;
+    }
+    return true;
+}
+
+// An entry that passed the header checks can still be stale or corrupt inside, everything the draw loop, the uploads
+// and the ray caster index with gets checked against the vectors it indexes, like load_map does for the lumps
+static bool map_valid(const stk_map_t& map) {
+    for (const auto& model : map.models) {
+        for (const auto& mesh : model.meshes) {
+            if (size_t(mesh.vertex_lump) >= size_t(VERTEX_LUMP::COUNT) || mesh.material >= map.materials.size() || mesh.lods_num >= MAP_LODS)
+                return false;
+            if (map.vertex_mode == VERTEX_MODE::COMPACT && mesh.quant_bounds >= map.quant_bounds.size())
+                return false;
+
+            const auto vertices = mesh_vertices(map, mesh);
+            if (mesh.vertex_end > vertices || !index_range_valid(map, mesh.dec.base_index, mesh.dec.indices, mesh.dec.base_vertex, vertices))
+                return false;
+            for (uint32_t level = 0; level < mesh.lods_num; level++) {
+                if (!index_range_valid(map, mesh.lods[level].base_index, mesh.lods[level].indices, mesh.dec.base_vertex, vertices))
+                    return false;
+            }
+        }
+    }
+
+    // children come after their parent (so walking it ends), leaves stay in refs and the depth is the real one since
+    // the ray caster sizes its stack from it
+    const auto& bvh = map.bvh;
+    if (bvh.refs.size() != bvh.triangles.size())
+        return false;
+    for (const auto& ref : bvh.refs) {
+        if (ref.model >= map.models.size() || ref.mesh >= map.models[ref.model].meshes.size() ||
+            ref.triangle >= map.models[ref.model].meshes[ref.mesh].dec.indices / 3)
+            return false;
+    }
+    std::vector<uint32_t> depths(bvh.nodes.size(), 0);
+    uint32_t              depth = 0;
+    for (size_t i = 0; i < bvh.nodes.size(); i++) {
+        const auto& node = bvh.nodes[i];
+        if (node.leaf()) {
+            if (size_t(node.first) + node.count > bvh.refs.size())
+                return false;
+            depth = std::max(depth, depths[i]);
+        } else {
+            if (node.first <= i || size_t(node.first) + 1 >= bvh.nodes.size())
+                return false;
+            for (const auto child : {node.first, node.first + 1}) {
+                depths[child] = std::max(depths[child], depths[i] + 1);
+            }
+        }
+    }
+    return bvh.nodes.empty() || depth == bvh.depth;
+}
+
+bool MapCache::get(const BspFile& bsp, const map_load_options_t& options, stk_map_t* res) const {
+    key_t key;
+    if (!this->make_key(bsp, options, &key))
+        return false;
+
+    mapped_file_t file;
+    if (!file.open(this->entry_path(bsp, key)) || file.size < sizeof(map_cache_header_t))
+        return false;
+
+    map_cache_header_t header;
+    memcpy(&header, file.data, sizeof(header));
+    if (header.magic != MAP_CACHE_MAGIC || header.version != MAP_CACHE_VERSION || header.mesh_size != sizeof(mesh_parsed_t) ||
+        header.vertex_size != sizeof(stk_vertex_t) || header.size != key.size || header.mtime != key.mtime || header.header_hash != key.header_hash ||
+        header.lumps_hash != key.lumps_hash || header.vertex_mode != key.vertex_mode || header.optimize_meshes != key.optimize_meshes || header.lods != key.lods ||
+        header.total_size != file.size)
+        return false;
+
+    cache_reader_t reader(file.data, file.size, sizeof(header));
+    stk_map_t      map;
+    map.vertex_mode = VERTEX_MODE(header.vertex_mode);
+
+    uint64_t models_num;
+    if (!reader.get(&models_num) || models_num > file.size)
+        return false;
+    map.models.resize(models_num);
+    for (auto& model : map.models) {
+        if (!reader.get_vector(&model.meshes))
+            return false;
+
+        // GL names are from whoever wrote the cache
+        for (auto& mesh : model.meshes) {
+            mesh.dec_buf  = 0;
+            mesh.texture  = 0;
+            mesh.textured = false;
+            mesh.draw     = true;
+            mesh.resident = true;
+        }
+    }
+
+    uint64_t materials_num;
+    if (!reader.get(&materials_num) || materials_num > file.size)
+        return false;
+    map.materials.resize(materials_num);
+    for (auto& material : map.materials) {
+        if (!reader.get_string(&material))
+            return false;
+    }
+
+    bool ok = reader.get_vector(&map.index_vec);
+    ok      = ok && reader.get_vector(&map.vertex_vec) && reader.get_vector(&map.compact_vec) && reader.get_vector(&map.quant_bounds);
+    ok      = ok && reader.get_vector(&map.positions) && reader.get_vector(&map.normals);
+    for (size_t i = 0; ok && i < size_t(VERTEX_LUMP::COUNT); i++) {
+        ok = reader.get(&map.vertex_lump_strides[i]) && reader.get_vector(&map.vertex_lumps[i]);
+    }
+
+    uint64_t bounds_count = 0;
+    ok                    = ok && reader.get(&bounds_count);
+    for (int i = 0; ok && i < 3; i++) {
+        ok = reader.get_vector(&map.cull_bounds.center[i]) && reader.get_vector(&map.cull_bounds.extent[i]);
+    }
+    map.cull_bounds.count = size_t(bounds_count);
+
+    ok = ok && reader.get_vector(&map.bvh.nodes) && reader.get_vector(&map.bvh.refs) && reader.get_vector(&map.bvh.triangles) && reader.get(&map.bvh.depth);
+    if (!ok)
+        return false;
+
+    // cull_frustum reads padded() boxes out of every vector, a bad entry would have it read past them
+    const auto padded = map.cull_bounds.padded();
+    if (map.cull_bounds.count > padded || padded % 4)
+        return false;
+    for (int i = 0; i < 3; i++) {
+        if (map.cull_bounds.center[i].size() != padded || map.cull_bounds.extent[i].size() != padded)
+            return false;
+    }
+    if (!map_valid(map))
+        return false;
+
+    *res = std::move(map);
+    return true;
+}
+
+std::pair<bool, stk_map_t> load_map_cached(MapCache* cache, const std::string& path, JobPool& jobs, const map_load_options_t& options, std::ostream* timings,
+                                           map_cache_pending_t* pending) {
+    BspFile bsp;
+    if (!bsp.open(path)) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return {false, stk_map_t{}};
+    }
+
+    if (cache) {
+        const auto begin = std::chrono::steady_clock::now();
+
+        stk_map_t map;
+        if (cache->get(bsp, options, &map)) {
+            if (timings) {
+                const auto end = std::chrono::steady_clock::now();
+                *timings << "Map cache hit, took " << std::chrono::duration<double, std::milli>(end - begin).count() << "ms" << std::endl;
+            }
+            return {true, std::move(map)};
+        }
+    }
+
+    auto ret = load_map(bsp, jobs, options, timings);
+    if (cache && ret.first) {
+        // the BVH isn't there yet, the caller finishes the put once it is
+        const auto stored = options.bvh_input ? !pending || cache->put_begin(bsp, options, ret.second, pending) : cache->put(bsp, options, ret.second);
+        if (!stored)
+            std::cerr << "MapCache: couldn't store " << path << std::endl;
+    }
+
+    return ret;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "bsp.hh"
+#include "map.hh"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Processed load_map results on disk, reopening a map is a mapping and a few memcpys instead of a full load.
+// Entries are keyed by the BSP's size, mtime, a hash of its header (every lump's offset/size/version is in there)
+// and the load options, anything that doesn't match is a miss and gets rebuilt.
+//
+// <root>/<bsp stem>-<key hash>.mapcache
+
+// A put that's waiting on the BVH, everything else is in path + ".tmp" already
+struct map_cache_pending_t {
+    std::string path;
+    size_t      size = 0; // of what's written
+};
+
+class MapCache {
+public:
+    MapCache(const std::string& root);
+
+    bool get(const BspFile& bsp, const map_load_options_t& options, stk_map_t* res) const;
+    bool put(const BspFile& bsp, const map_load_options_t& options, const stk_map_t& map) const;
+
+    // put in two halves for a map that's handed on before its BVH is built, the BVH is ignored by put_begin
+    bool put_begin(const BspFile& bsp, const map_load_options_t& options, const stk_map_t& map, map_cache_pending_t* pending) const;
+    bool put_finish(const map_cache_pending_t& pending, const bvh_t& bvh) const;
+
+private:
+    struct key_t {
+        uint64_t size;
+        int64_t  mtime;
+        uint64_t header_hash;
+        uint64_t lumps_hash; // of the .bsp_lump files next to it
+        uint32_t vertex_mode;
+        uint32_t optimize_meshes;
+        uint32_t lods;
+        uint32_t _pad; // gets hashed as bytes, so no padding left to chance
+    };
+
+    bool        make_key(const BspFile& bsp, const map_load_options_t& options, key_t* key) const;
+    std::string entry_path(const BspFile& bsp, const key_t& key) const;
+
+    std::string root;
+};
+
+// load_map, but the result comes from (and goes into) the cache when there is one.
+// With options.bvh_input a miss only begins the put in pending, the caller does put_finish with the BVH. A hit
+// comes with its BVH and leaves pending->path empty.
+std::pair<bool, stk_map_t> load_map_cached(MapCache* cache, const std::string& path, JobPool& jobs, const map_load_options_t& options = {}, std::ostream* timings = nullptr,
+                                           map_cache_pending_t* pending = nullptr);
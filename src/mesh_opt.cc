@@ -0,0 +1,211 @@
+#include "mesh_opt.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+mesh_cache_stats_t mesh_cache_stats(const uint32_t* indices, size_t count, size_t vertices, size_t cache_size) {
+    mesh_cache_stats_t stats;
+    stats.triangles = count / 3;
+
+    // a vertex is in the cache when less than cache_size misses happened since it got in
+    std::vector<size_t> stamp(vertices, 0);
+    size_t              time = cache_size + 1;
+    for (size_t i = 0; i < count; i++) {
+        const auto v = indices[i];
+        if (!stamp[v])
+            stats.referenced++;
+        if (time - stamp[v] > cache_size) {
+            stamp[v] = time++;
+            stats.transformed++;
+        }
+    }
+
+    return stats;
+}
+
+void mesh_optimize_vertex_cache(const uint32_t* indices, size_t count, size_t vertices, uint32_t* out, std::vector<uint32_t>* clusters, size_t cache_size) {
+    const auto triangles = count / 3;
+    if (clusters)
+        clusters->clear();
+
+    // vertex -> triangles, CSR style
+    std::vector<uint32_t> offsets(vertices + 1, 0);
+    for (size_t i = 0; i < triangles * 3; i++) {
+        offsets[indices[i] + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<uint32_t> adjacency(triangles * 3);
+    {
+        auto fill = offsets;
+        for (size_t i = 0; i < triangles * 3; i++) {
+            adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+        }
+    }
+
+    std::vector<uint32_t> live(vertices);
+    for (size_t v = 0; v < vertices; v++) {
+        live[v] = offsets[v + 1] - offsets[v];
+    }
+
+    std::vector<size_t>   stamp(vertices, 0);
+    std::vector<bool>     emitted(triangles, false);
+    std::vector<uint32_t> dead_end;
+    std::vector<uint32_t> candidates;
+
+    size_t time   = cache_size + 1;
+    size_t cursor = 0;
+    size_t at     = 0;
+
+    // most recently used vertex that still has triangles, otherwise next one in input order
+    auto skip_dead_end = [&]() -> int64_t {
+        while (!dead_end.empty()) {
+            const auto v = dead_end.back();
+            dead_end.pop_back();
+            if (live[v])
+                return v;
+        }
+        for (; cursor < vertices; cursor++) {
+            if (live[cursor])
+                return int64_t(cursor);
+        }
+        return -1;
+    };
+
+    int64_t fanning     = skip_dead_end();
+    bool    new_cluster = true;
+    while (fanning >= 0) {
+        if (clusters && new_cluster)
+            clusters->push_back(uint32_t(at / 3));
+        new_cluster = false;
+
+        candidates.clear();
+        for (auto a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+            const auto t = adjacency[a];
+            if (emitted[t])
+                continue;
+            emitted[t] = true;
+
+            for (int c = 0; c < 3; c++) {
+                const auto v = indices[t * 3 + c];
+                out[at++]    = v;
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - stamp[v] > cache_size)
+                    stamp[v] = time++;
+            }
+        }
+
+        // best candidate is the one that stays in the cache while all of its triangles get emitted
+        int64_t best          = -1;
+        int64_t best_priority = -1;
+        for (const auto v : candidates) {
+            if (!live[v])
+                continue;
+            int64_t priority = 0;
+            if (time - stamp[v] + 2 * live[v] <= cache_size)
+                priority = int64_t(time - stamp[v]);
+            if (priority > best_priority) {
+                best          = v;
+                best_priority = priority;
+            }
+        }
+
+        if (best < 0) {
+            new_cluster = true;
+            best        = skip_dead_end();
+        }
+        fanning = best;
+    }
+
+    // degenerate leftovers (count not a multiple of 3) are kept as is
+    memmove(out + at, indices + at, (count - at) * sizeof(uint32_t));
+}
+
+void mesh_optimize_overdraw(const uint32_t* indices, size_t count, const vertex_t* positions, const std::vector<uint32_t>& clusters, uint32_t* out) {
+    const auto triangles = count / 3;
+
+    struct cluster_t {
+        uint32_t begin, end; // triangles
+        float    centroid[3] = {};
+        float    normal[3]   = {};
+        float    area        = 0.f;
+        float    sort_key    = 0.f;
+    };
+
+    std::vector<cluster_t> sorted;
+    for (size_t i = 0; i < clusters.size(); i++) {
+        cluster_t cluster;
+        cluster.begin = clusters[i];
+        cluster.end   = i + 1 < clusters.size() ? clusters[i + 1] : uint32_t(triangles);
+        if (cluster.begin < cluster.end)
+            sorted.push_back(cluster);
+    }
+
+    float mesh_centroid[3] = {};
+    float mesh_area        = 0.f;
+    for (auto& cluster : sorted) {
+        for (auto t = cluster.begin; t < cluster.end; t++) {
+            const auto& a = positions[indices[t * 3 + 0]];
+            const auto& b = positions[indices[t * 3 + 1]];
+            const auto& c = positions[indices[t * 3 + 2]];
+
+            const float e0[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+            const float e1[3] = {c.x - a.x, c.y - a.y, c.z - a.z};
+            const float n[3]  = {e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0]};
+            const auto  area  = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+            for (int k = 0; k < 3; k++) {
+                cluster.centroid[k] += (a.coords[k] + b.coords[k] + c.coords[k]) / 3.f * area;
+                cluster.normal[k] += n[k];
+            }
+            cluster.area += area;
+        }
+
+        for (int k = 0; k < 3; k++) {
+            mesh_centroid[k] += cluster.centroid[k];
+        }
+        mesh_area += cluster.area;
+        if (cluster.area > 0.f) {
+            for (int k = 0; k < 3; k++) {
+                cluster.centroid[k] /= cluster.area;
+            }
+        }
+    }
+    if (mesh_area > 0.f) {
+        for (int k = 0; k < 3; k++) {
+            mesh_centroid[k] /= mesh_area;
+        }
+    }
+
+    for (auto& cluster : sorted) {
+        const auto len = std::sqrt(cluster.normal[0] * cluster.normal[0] + cluster.normal[1] * cluster.normal[1] + cluster.normal[2] * cluster.normal[2]);
+        if (len <= 0.f)
+            continue;
+        for (int k = 0; k < 3; k++) {
+            cluster.sort_key += (cluster.centroid[k] - mesh_centroid[k]) * cluster.normal[k] / len;
+        }
+    }
+
+    std::stable_sort(sorted.begin(), sorted.end(), [](const cluster_t& a, const cluster_t& b) { return a.sort_key > b.sort_key; });
+
+    size_t at = 0;
+    for (const auto& cluster : sorted) {
+        const auto size = (cluster.end - cluster.begin) * 3;
+        memcpy(out + at, indices + cluster.begin * 3, size * sizeof(uint32_t));
+        at += size;
+    }
+    memcpy(out + at, indices + at, (count - at) * sizeof(uint32_t));
+}
+
+void mesh_optimize(uint32_t* indices, size_t count, const vertex_t* positions, size_t vertices) {
+    if (count < 6)
+        return;
+
+    std::vector<uint32_t> cache_order(count);
+    std::vector<uint32_t> clusters;
+    mesh_optimize_vertex_cache(indices, count, vertices, cache_order.data(), &clusters);
+    mesh_optimize_overdraw(cache_order.data(), count, positions, clusters, indices);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "bsp.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Triangle order for one mesh, indices are local (0 to vertices - 1), positions are indexed the same way.
+// Nothing here touches the vertices themselves, they are shared between meshes.
+
+// FIFO post transform cache of cache_size, the usual model for ACMR/ATVR
+constexpr size_t MESH_OPT_CACHE_SIZE = 16;
+
+struct mesh_cache_stats_t {
+    size_t triangles   = 0;
+    size_t transformed = 0; // cache misses
+    size_t referenced  = 0; // unique vertices
+
+    // Transformed vertices per triangle (0.5 best, 3.0 worst)
+    double acmr() const { return triangles ? double(transformed) / triangles : 0.0; }
+    // Transformed vertices per referenced vertex (1.0 best)
+    double atvr() const { return referenced ? double(transformed) / referenced : 0.0; }
+
+    mesh_cache_stats_t& operator+=(const mesh_cache_stats_t& other) {
+        this->triangles += other.triangles;
+        this->transformed += other.transformed;
+        this->referenced += other.referenced;
+        return *this;
+    }
+};
+
+mesh_cache_stats_t mesh_cache_stats(const uint32_t* indices, size_t count, size_t vertices, size_t cache_size = MESH_OPT_CACHE_SIZE);
+
+// Tipsify (Sander et al. 2007), clusters gets the first triangle of every run that started at a dead end
+void mesh_optimize_vertex_cache(const uint32_t* indices, size_t count, size_t vertices, uint32_t* out, std::vector<uint32_t>* clusters = nullptr,
+    size_t cache_size = MESH_OPT_CACHE_SIZE);
+
+// Clusters that face away from the middle of the mesh go first so they occlude the rest, order inside a cluster is kept
+void mesh_optimize_overdraw(const uint32_t* indices, size_t count, const vertex_t* positions, const std::vector<uint32_t>& clusters, uint32_t* out);
+
+// Both of the above, in place
+void mesh_optimize(uint32_t* indices, size_t count, const vertex_t* positions, size_t vertices);
@@ -0,0 +1,264 @@
+#include "mesh_simplify.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <tuple>
+#include <vector>
+
+// Q(p) = p'Ap + 2b'p + c summed over planes, weight is the summed area so the error can be made a distance again
+struct quadric_t {
+    double a00, a01, a02, a11, a12, a22;
+    double b0, b1, b2;
+    double c;
+    double weight;
+
+    quadric_t& operator+=(const quadric_t& other) {
+        this->a00 += other.a00;
+        this->a01 += other.a01;
+        this->a02 += other.a02;
+        this->a11 += other.a11;
+        this->a12 += other.a12;
+        this->a22 += other.a22;
+        this->b0 += other.b0;
+        this->b1 += other.b1;
+        this->b2 += other.b2;
+        this->c += other.c;
+        this->weight += other.weight;
+        return *this;
+    }
+};
+
+static void quadric_add_plane(quadric_t& q, const double n[3], double d, double weight) {
+    q.a00 += weight * n[0] * n[0];
+    q.a01 += weight * n[0] * n[1];
+    q.a02 += weight * n[0] * n[2];
+    q.a11 += weight * n[1] * n[1];
+    q.a12 += weight * n[1] * n[2];
+    q.a22 += weight * n[2] * n[2];
+    q.b0 += weight * n[0] * d;
+    q.b1 += weight * n[1] * d;
+    q.b2 += weight * n[2] * d;
+    q.c += weight * d * d;
+    q.weight += weight;
+}
+
+// RMS distance of p to the planes of q
+static float quadric_error(const quadric_t& q, const vertex_t& p) {
+    const double x = p.x, y = p.y, z = p.z;
+
+    const auto e = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z + 2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z) + 2.0 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+    return q.weight > 0.0 ? float(std::sqrt(std::max(e, 0.0) / q.weight)) : 0.f;
+}
+
+static void triangle_normal(const vertex_t& p0, const vertex_t& p1, const vertex_t& p2, double n[3]) {
+    const double e1[3] = {double(p1.x) - p0.x, double(p1.y) - p0.y, double(p1.z) - p0.z};
+    const double e2[3] = {double(p2.x) - p0.x, double(p2.y) - p0.y, double(p2.z) - p0.z};
+    n[0]               = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1]               = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2]               = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+size_t mesh_simplify(const uint32_t* indices, size_t count, const vertex_t* positions, size_t vertices, size_t target_count, float max_error, uint32_t* out,
+    float* error) {
+    std::vector<uint32_t> current(indices, indices + count / 3 * 3);
+    if (error)
+        *error = 0.f;
+
+    // vertices at the same position share one id, that's what the topology and quadrics are built on
+    std::vector<uint32_t> weld(vertices);
+    std::vector<bool>     locked(vertices, false);
+    {
+        std::vector<bool> used(vertices, false);
+        for (const auto v : current) {
+            used[v] = true;
+        }
+
+        std::vector<uint32_t> order;
+        for (uint32_t v = 0; v < vertices; v++) {
+            weld[v] = v;
+            if (used[v])
+                order.push_back(v);
+        }
+        const auto position_less = [&](uint32_t a, uint32_t b) {
+            const auto &pa = positions[a], &pb = positions[b];
+            return std::tie(pa.x, pa.y, pa.z) < std::tie(pb.x, pb.y, pb.z);
+        };
+        std::sort(order.begin(), order.end(), position_less);
+        for (size_t i = 0; i < order.size();) {
+            auto end = i + 1;
+            while (end < order.size() && !position_less(order[i], order[end]))
+                end++;
+            for (auto j = i; j < end; j++) {
+                weld[order[j]]   = order[i];
+                locked[order[j]] = end - i > 1;
+            }
+            i = end;
+        }
+    }
+
+    // open (or non manifold) edges, counted over both directions
+    {
+        std::vector<uint64_t> edges;
+        edges.reserve(current.size());
+        for (size_t t = 0; t < current.size(); t += 3) {
+            for (int corner = 0; corner < 3; corner++) {
+                const auto a = weld[current[t + corner]], b = weld[current[t + (corner + 1) % 3]];
+                edges.push_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size();) {
+            auto end = i + 1;
+            while (end < edges.size() && edges[end] == edges[i])
+                end++;
+            if (end - i != 2) {
+                locked[uint32_t(edges[i] >> 32)] = true;
+                locked[uint32_t(edges[i])]       = true;
+            }
+            i = end;
+        }
+        // the rest of a weld group goes with its first vertex
+        for (uint32_t v = 0; v < vertices; v++) {
+            if (locked[weld[v]])
+                locked[v] = true;
+        }
+    }
+
+    std::vector<quadric_t> quadrics(vertices, quadric_t{});
+    for (size_t t = 0; t < current.size(); t += 3) {
+        const auto& p0 = positions[current[t + 0]];
+        double      n[3];
+        triangle_normal(p0, positions[current[t + 1]], positions[current[t + 2]], n);
+        const auto len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (len <= 0.0)
+            continue;
+        for (auto& c : n) {
+            c /= len;
+        }
+        const auto d = -(n[0] * p0.x + n[1] * p0.y + n[2] * p0.z);
+        for (int corner = 0; corner < 3; corner++) {
+            quadric_add_plane(quadrics[weld[current[t + corner]]], n, d, len * 0.5);
+        }
+    }
+
+    struct collapse_t {
+        uint32_t from, to;
+        float    cost;
+    };
+    std::vector<uint32_t>   offsets, adjacency;
+    std::vector<uint64_t>   edges;
+    std::vector<collapse_t> collapses;
+    std::vector<uint32_t>   remap(vertices);
+    std::vector<bool>       touched(vertices);
+
+    target_count = target_count / 3 * 3;
+    while (current.size() > target_count) {
+        const auto triangles = current.size() / 3;
+
+        // vertex -> triangles, CSR style
+        offsets.assign(vertices + 1, 0);
+        for (const auto v : current) {
+            offsets[v + 1]++;
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        adjacency.resize(current.size());
+        {
+            auto fill = offsets;
+            for (size_t i = 0; i < current.size(); i++) {
+                adjacency[fill[current[i]]++] = uint32_t(i / 3);
+            }
+        }
+
+        // every edge both ways, a locked vertex can still be collapsed onto
+        edges.clear();
+        for (size_t t = 0; t < current.size(); t += 3) {
+            for (int corner = 0; corner < 3; corner++) {
+                const auto a = current[t + corner], b = current[t + (corner + 1) % 3];
+                if (!locked[a])
+                    edges.push_back(uint64_t(a) << 32 | b);
+                if (!locked[b])
+                    edges.push_back(uint64_t(b) << 32 | a);
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        collapses.clear();
+        for (const auto edge : edges) {
+            const auto from = uint32_t(edge >> 32), to = uint32_t(edge);
+            auto       q    = quadrics[weld[from]];
+            q += quadrics[weld[to]];
+            const auto cost = quadric_error(q, positions[to]);
+            if (cost <= max_error)
+                collapses.push_back({from, to, cost});
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const collapse_t& a, const collapse_t& b) { return a.cost < b.cost; });
+
+        // cheapest first, a vertex's neighbourhood only changes once a pass so the flip checks stay valid
+        std::iota(remap.begin(), remap.end(), 0);
+        std::fill(touched.begin(), touched.end(), false);
+        const auto needed  = (triangles - target_count / 3 + 1) / 2 * 2;
+        size_t     removed = 0;
+        size_t     done    = 0;
+        for (const auto& collapse : collapses) {
+            if (removed >= needed)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            auto   flips = false;
+            size_t gone  = 0;
+            for (auto a = offsets[collapse.from]; a < offsets[collapse.from + 1] && !flips; a++) {
+                const auto t  = adjacency[a] * 3;
+                const auto c  = std::find(&current[t], &current[t] + 3, collapse.from) - &current[t];
+                const auto v1 = current[t + (c + 1) % 3], v2 = current[t + (c + 2) % 3];
+                if (v1 == collapse.to || v2 == collapse.to) {
+                    gone++;
+                    continue;
+                }
+
+                double before[3], after[3];
+                triangle_normal(positions[collapse.from], positions[v1], positions[v2], before);
+                triangle_normal(positions[collapse.to], positions[v1], positions[v2], after);
+                const auto dot        = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+                const auto len_before = before[0] * before[0] + before[1] * before[1] + before[2] * before[2];
+                const auto len_after  = after[0] * after[0] + after[1] * after[1] + after[2] * after[2];
+                // flipped or folded to nothing, the 0.25 keeps normals within about 60 degrees of where they were
+                flips = dot <= 0.0 || dot * dot < 0.25 * len_before * len_after;
+            }
+            if (flips || !gone)
+                continue;
+
+            remap[collapse.from] = collapse.to;
+            for (auto a = offsets[collapse.from]; a < offsets[collapse.from + 1]; a++) {
+                const auto t = adjacency[a] * 3;
+                for (int corner = 0; corner < 3; corner++) {
+                    touched[current[t + corner]] = true;
+                }
+            }
+            quadrics[weld[collapse.to]] += quadrics[weld[collapse.from]];
+            if (error)
+                *error = std::max(*error, collapse.cost);
+            removed += gone;
+            done++;
+        }
+        if (!done)
+            break;
+
+        size_t write = 0;
+        for (size_t t = 0; t < current.size(); t += 3) {
+            const auto a = remap[current[t + 0]], b = remap[current[t + 1]], c = remap[current[t + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+            current[write++] = a;
+            current[write++] = b;
+            current[write++] = c;
+        }
+        current.resize(write);
+    }
+
+    std::copy(current.begin(), current.end(), out);
+    return current.size();
+}
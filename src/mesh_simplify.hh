@@ -0,0 +1,20 @@
+#pragma once
+
+#include "bsp.hh"
+
+#include <cstddef>
+#include <cstdint>
+
+// Quadric error edge collapse (Garland & Heckbert 1997) that only ever moves a vertex onto a neighbour,
+// so the result is a new index buffer over the same vertices and can sit next to the original one.
+// Indices are local (0 to vertices - 1) like mesh_opt.hh wants them.
+//
+// Vertices that stay where they are:
+// - on an open edge, which is also where the mesh meets meshes of other materials
+// - sharing their position with another vertex, those are split on purpose (uv seams, hard edges)
+// so the outline and seams of every level are the same as the original's and levels never crack against each other.
+
+// Writes at most count indices to out and returns how many, stops at target_count or once the next collapse would
+// be worse than max_error. error gets the largest collapse done, roughly a distance in the units of positions.
+size_t mesh_simplify(const uint32_t* indices, size_t count, const vertex_t* positions, size_t vertices, size_t target_count, float max_error, uint32_t* out,
+    float* error = nullptr);
@@ -0,0 +1,265 @@
+#include "meshlet.hh"
+
+#include "map.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <numeric>
+
+// Cones wider than this (min dot of a normal with the axis) can't cull anything useful
+constexpr float MESHLET_CONE_MIN_DOT = 0.1f;
+
+constexpr uint8_t MESHLET_NOT_IN = 0xFF;
+
+static void meshlet_bounds(const std::vector<uint32_t>& vertices, const std::vector<uint8_t>& triangles, const vertex_t* positions, meshlet_bounds_t* res) {
+    *res = {};
+
+    // sphere around the box, good enough and stable
+    float mins[3] = {positions[vertices[0]].x, positions[vertices[0]].y, positions[vertices[0]].z};
+    float maxs[3] = {mins[0], mins[1], mins[2]};
+    for (const auto v : vertices) {
+        for (int i = 0; i < 3; i++) {
+            mins[i] = std::min(mins[i], positions[v].coords[i]);
+            maxs[i] = std::max(maxs[i], positions[v].coords[i]);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        res->center[i] = (mins[i] + maxs[i]) * 0.5f;
+    }
+    for (const auto v : vertices) {
+        float d2 = 0.f;
+        for (int i = 0; i < 3; i++) {
+            const auto d = positions[v].coords[i] - res->center[i];
+            d2 += d * d;
+        }
+        res->radius = std::max(res->radius, d2);
+    }
+    res->radius = std::sqrt(res->radius);
+
+    // normal cone, see the comment on meshlet_bounds_t for how it's used
+    std::vector<vertex_t> normals;
+    float                 axis[3] = {};
+    for (size_t t = 0; t < triangles.size() / 3; t++) {
+        const auto& p0 = positions[vertices[triangles[t * 3 + 0]]];
+        const auto& p1 = positions[vertices[triangles[t * 3 + 1]]];
+        const auto& p2 = positions[vertices[triangles[t * 3 + 2]]];
+
+        const float e1[3] = {p1.x - p0.x, p1.y - p0.y, p1.z - p0.z};
+        const float e2[3] = {p2.x - p0.x, p2.y - p0.y, p2.z - p0.z};
+        vertex_t    n     = {{e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]}};
+        const auto  len   = std::sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+        if (len <= 0.f)
+            continue;
+        for (int i = 0; i < 3; i++) {
+            n.coords[i] /= len;
+            axis[i] += n.coords[i];
+        }
+        normals.push_back(n);
+    }
+
+    memcpy(res->cone_apex, res->center, sizeof(res->cone_apex));
+    res->cone_cutoff = 1.f;
+
+    const auto axis_len = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    if (axis_len <= 0.f)
+        return;
+    for (int i = 0; i < 3; i++) {
+        res->cone_axis[i] = axis[i] / axis_len;
+    }
+
+    float min_dot = 1.f;
+    for (const auto& n : normals) {
+        min_dot = std::min(min_dot, n.x * res->cone_axis[0] + n.y * res->cone_axis[1] + n.z * res->cone_axis[2]);
+    }
+    if (min_dot <= MESHLET_CONE_MIN_DOT)
+        return;
+
+    // apex is pushed back along the axis until it's behind every triangle's plane
+    float max_t = 0.f;
+    size_t n_at  = 0;
+    for (size_t t = 0; t < triangles.size() / 3; t++) {
+        const auto& p0 = positions[vertices[triangles[t * 3 + 0]]];
+        const auto& p1 = positions[vertices[triangles[t * 3 + 1]]];
+        const auto& p2 = positions[vertices[triangles[t * 3 + 2]]];
+
+        const float e1[3] = {p1.x - p0.x, p1.y - p0.y, p1.z - p0.z};
+        const float e2[3] = {p2.x - p0.x, p2.y - p0.y, p2.z - p0.z};
+        if (e1[1] * e2[2] - e1[2] * e2[1] == 0.f && e1[2] * e2[0] - e1[0] * e2[2] == 0.f && e1[0] * e2[1] - e1[1] * e2[0] == 0.f)
+            continue;
+
+        const auto& n  = normals[n_at++];
+        const auto  dc = (res->center[0] - p0.x) * n.x + (res->center[1] - p0.y) * n.y + (res->center[2] - p0.z) * n.z;
+        const auto  dn = res->cone_axis[0] * n.x + res->cone_axis[1] * n.y + res->cone_axis[2] * n.z;
+        max_t          = std::max(max_t, dc / dn);
+    }
+    for (int i = 0; i < 3; i++) {
+        res->cone_apex[i] = res->center[i] - res->cone_axis[i] * max_t;
+    }
+    res->cone_cutoff = std::sqrt(1.f - min_dot * min_dot);
+}
+
+void mesh_build_meshlets(const uint32_t* indices, size_t count, const vertex_t* positions, size_t vertices, uint32_t mesh, meshlets_t* res) {
+    const auto triangles = count / 3;
+
+    // vertex -> triangles, CSR style
+    std::vector<uint32_t> offsets(vertices + 1, 0);
+    for (size_t i = 0; i < triangles * 3; i++) {
+        offsets[indices[i] + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<uint32_t> adjacency(triangles * 3);
+    {
+        auto fill = offsets;
+        for (size_t i = 0; i < triangles * 3; i++) {
+            adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+        }
+    }
+
+    std::vector<bool>     emitted(triangles, false);
+    std::vector<uint8_t>  local(vertices, MESHLET_NOT_IN);
+    std::vector<uint32_t> meshlet_vertices;
+    std::vector<uint8_t>  meshlet_triangles;
+
+    auto flush = [&]() {
+        if (meshlet_triangles.empty())
+            return;
+
+        meshlet_t meshlet;
+        meshlet.vertex_offset   = uint32_t(res->vertices.size());
+        meshlet.triangle_offset = uint32_t(res->triangles.size());
+        meshlet.vertex_count    = uint16_t(meshlet_vertices.size());
+        meshlet.triangle_count  = uint16_t(meshlet_triangles.size() / 3);
+        meshlet.mesh            = mesh;
+        res->meshlets.push_back(meshlet);
+
+        meshlet_bounds_t bounds;
+        meshlet_bounds(meshlet_vertices, meshlet_triangles, positions, &bounds);
+        res->bounds.push_back(bounds);
+
+        res->vertices.insert(res->vertices.end(), meshlet_vertices.begin(), meshlet_vertices.end());
+        res->triangles.insert(res->triangles.end(), meshlet_triangles.begin(), meshlet_triangles.end());
+        res->triangles.resize((res->triangles.size() + 3) & ~size_t(3), 0);
+
+        for (const auto v : meshlet_vertices) {
+            local[v] = MESHLET_NOT_IN;
+        }
+        meshlet_vertices.clear();
+        meshlet_triangles.clear();
+    };
+
+    size_t cursor = 0;
+    for (size_t done = 0; done < triangles; done++) {
+        // neighbour that adds the fewest vertices and still fits
+        auto   best       = ~uint32_t(0);
+        size_t best_extra = 4;
+        for (size_t i = 0; i < meshlet_vertices.size() && best_extra; i++) {
+            const auto v = meshlet_vertices[i];
+            for (auto a = offsets[v]; a < offsets[v + 1]; a++) {
+                const auto t = adjacency[a];
+                if (emitted[t])
+                    continue;
+
+                size_t extra = 0;
+                for (int corner = 0; corner < 3; corner++) {
+                    extra += local[indices[t * 3 + corner]] == MESHLET_NOT_IN;
+                }
+                if (meshlet_vertices.size() + extra <= MESHLET_MAX_VERTICES && (extra < best_extra || (extra == best_extra && t < best))) {
+                    best       = t;
+                    best_extra = extra;
+                }
+            }
+        }
+
+        if (best == ~uint32_t(0)) {
+            // nothing connected fits, start over at the next triangle in order
+            flush();
+            while (emitted[cursor])
+                cursor++;
+            best = uint32_t(cursor);
+        }
+
+        emitted[best] = true;
+        for (int corner = 0; corner < 3; corner++) {
+            const auto v = indices[best * 3 + corner];
+            if (local[v] == MESHLET_NOT_IN) {
+                local[v] = uint8_t(meshlet_vertices.size());
+                meshlet_vertices.push_back(v);
+            }
+            meshlet_triangles.push_back(local[v]);
+        }
+
+        if (meshlet_triangles.size() / 3 == MESHLET_MAX_TRIANGLES)
+            flush();
+    }
+    flush();
+}
+
+void build_meshlets(const stk_map_t& map, JobPool& jobs, meshlets_t* res) {
+    *res = {};
+
+    for (uint32_t model = 0; model < map.models.size(); model++) {
+        for (uint32_t mesh = 0; mesh < map.models[model].meshes.size(); mesh++) {
+            res->meshes.push_back({model, mesh, 0, 0});
+        }
+    }
+
+    std::vector<meshlets_t> per_mesh(res->meshes.size());
+    jobs.parallel_for(res->meshes.size(), 64, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> indices;
+        std::vector<vertex_t> positions;
+        for (size_t m = begin; m < end; m++) {
+            const auto& mesh = map.models[res->meshes[m].model].meshes[res->meshes[m].mesh];
+
+            indices.resize(mesh.dec.indices);
+            for (size_t i = 0; i < indices.size(); i++) {
+                indices[i] = mesh_index_at(map, mesh, i);
+            }
+            if (indices.empty())
+                continue;
+
+            const size_t vertices = *std::max_element(indices.begin(), indices.end()) + 1;
+            positions.resize(vertices);
+            for (size_t v = 0; v < vertices; v++) {
+                if (!mesh_vertex_position(map, mesh, uint32_t(v), &positions[v]))
+                    positions[v] = vertex_t{};
+            }
+
+            mesh_build_meshlets(indices.data(), indices.size(), positions.data(), vertices, uint32_t(m), &per_mesh[m]);
+        }
+    });
+
+    for (size_t m = 0; m < per_mesh.size(); m++) {
+        const auto& part = per_mesh[m];
+
+        res->meshes[m].first = uint32_t(res->meshlets.size());
+        res->meshes[m].count = uint32_t(part.meshlets.size());
+        for (auto meshlet : part.meshlets) {
+            meshlet.vertex_offset += uint32_t(res->vertices.size());
+            meshlet.triangle_offset += uint32_t(res->triangles.size());
+            res->meshlets.push_back(meshlet);
+        }
+        res->bounds.insert(res->bounds.end(), part.bounds.begin(), part.bounds.end());
+        res->vertices.insert(res->vertices.end(), part.vertices.begin(), part.vertices.end());
+        res->triangles.insert(res->triangles.end(), part.triangles.begin(), part.triangles.end());
+    }
+}
+
+void print_meshlet_stats(const meshlets_t& meshlets, std::ostream& out) {
+    size_t triangles = 0, vertices = 0, coned = 0;
+    for (size_t i = 0; i < meshlets.meshlets.size(); i++) {
+        triangles += meshlets.meshlets[i].triangle_count;
+        vertices += meshlets.meshlets[i].vertex_count;
+        coned += meshlets.bounds[i].cone_cutoff < 1.f;
+    }
+
+    const auto num = std::max<size_t>(meshlets.meshlets.size(), 1);
+    out << "Meshlets: " << meshlets.meshlets.size() << " over " << meshlets.meshes.size() << " meshes, " << triangles << " triangles" << std::endl;
+    out << std::fixed << std::setprecision(1);
+    out << "  vertices " << double(vertices) / num << '/' << MESHLET_MAX_VERTICES << " (" << 100.0 * vertices / (num * MESHLET_MAX_VERTICES) << "%), triangles "
+        << double(triangles) / num << '/' << MESHLET_MAX_TRIANGLES << " (" << 100.0 * triangles / (num * MESHLET_MAX_TRIANGLES) << "%)" << std::endl;
+    out << "  cone cullable " << coned << " (" << 100.0 * coned / num << "%), "
+        << (meshlets.meshlets.size() * (sizeof(meshlet_t) + sizeof(meshlet_bounds_t)) + meshlets.vertices.size() * sizeof(uint32_t) + meshlets.triangles.size()) / 1024
+        << " KiB" << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "bsp.hh"
+#include "jobs.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+struct stk_map_t;
+
+// What mesh shaders like, 124 so the primitive indices of a full meshlet are a multiple of 4 bytes
+constexpr size_t MESHLET_MAX_VERTICES  = 64;
+constexpr size_t MESHLET_MAX_TRIANGLES = 124;
+
+// 16 bytes, offsets are into meshlets_t::vertices/triangles
+struct meshlet_t {
+    uint32_t vertex_offset;
+    uint32_t triangle_offset; // in bytes, always a multiple of 4
+    uint16_t vertex_count;
+    uint16_t triangle_count;
+    uint32_t mesh; // meshlets_t::meshes
+};
+static_assert(sizeof(meshlet_t) == 16);
+
+// Culling data, 48 bytes so it's 3 vec4s on the GPU.
+// Backfacing from camera when dot(normalize(cone_apex - camera), cone_axis) >= cone_cutoff, cutoff is 1 when it never is.
+struct meshlet_bounds_t {
+    float center[3];
+    float radius;
+    float cone_apex[3];
+    float cone_cutoff;
+    float cone_axis[3];
+    float _pad;
+};
+static_assert(sizeof(meshlet_bounds_t) == 48);
+
+// A mesh's meshlets are meshlets[first, first + count)
+struct meshlet_range_t {
+    uint32_t model;
+    uint32_t mesh; // in the model
+    uint32_t first;
+    uint32_t count;
+};
+
+// Everything flat so it can go in SSBOs as is
+struct meshlets_t {
+    std::vector<meshlet_t>        meshlets;
+    std::vector<meshlet_bounds_t> bounds; // per meshlet
+    std::vector<uint32_t>         vertices; // mesh local vertex indices, what the meshlet's triangles index into
+    std::vector<uint8_t>          triangles; // 3 meshlet local indices a triangle, every meshlet padded to 4 bytes
+    std::vector<meshlet_range_t>  meshes;
+};
+
+// Appends the meshlets of one mesh, indices are local (0 to vertices - 1) like mesh_opt.hh wants them.
+// Greedy: keeps adding the neighbouring triangle that needs the fewest new vertices, jumps when there's none.
+void mesh_build_meshlets(const uint32_t* indices, size_t count, const vertex_t* positions, size_t vertices, uint32_t mesh, meshlets_t* res);
+
+// All meshes of the map on the pool
+void build_meshlets(const stk_map_t& map, JobPool& jobs, meshlets_t* res);
+
+// Meshlets, triangles, average fill and how many could be cone culled at all
+void print_meshlet_stats(const meshlets_t& meshlets, std::ostream& out);
@@ -0,0 +1,384 @@
+#include "occlusion.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+void build_occluders(const stk_map_t& map, size_t max_triangles, occluders_t* res) {
+    res->triangles.clear();
+    res->meshes.clear();
+    if (map.models.empty())
+        return;
+
+    struct candidate_t {
+        float    area;
+        float    corners[9];
+        uint32_t mesh;
+    };
+    std::vector<candidate_t> candidates;
+
+    // the world is model 0, the rest are brush entities that move or go away
+    const auto& world = map.models[0].meshes;
+    for (uint32_t m = 0; m < world.size(); m++) {
+        const auto& mesh = world[m];
+        for (uint32_t i = 0; i + 2 < mesh.dec.indices; i += 3) {
+            candidate_t candidate;
+            candidate.mesh = m;
+            auto ok        = true;
+            for (uint32_t k = 0; k < 3 && ok; k++) {
+                vertex_t pos;
+                ok = mesh_vertex_position(map, mesh, mesh_index_at(map, mesh, i + k), &pos);
+                std::copy(pos.coords, pos.coords + 3, candidate.corners + k * 3);
+            }
+            if (!ok)
+                continue;
+
+            const auto c = candidate.corners;
+            float      e1[3], e2[3];
+            for (int axis = 0; axis < 3; axis++) {
+                e1[axis] = c[3 + axis] - c[axis];
+                e2[axis] = c[6 + axis] - c[axis];
+            }
+            const float cross[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+            candidate.area       = 0.5f * std::sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+            if (candidate.area >= OCCLUSION_MIN_AREA)
+                candidates.push_back(candidate);
+        }
+    }
+
+    const auto count = std::min(candidates.size(), max_triangles);
+    std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), [](const candidate_t& a, const candidate_t& b) { return a.area > b.area; });
+
+    res->triangles.reserve(count * 9);
+    res->meshes.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        res->triangles.insert(res->triangles.end(), candidates[i].corners, candidates[i].corners + 9);
+        res->meshes.push_back(candidates[i].mesh);
+    }
+    std::printf("Occluders: %zu of %zu big enough triangles\n", count, candidates.size());
+}
+
+OcclusionCuller::OcclusionCuller(uint32_t width, uint32_t height)
+    : w((width + 3) & ~3u)
+    , h(std::max(height, 1u)) {
+    uint32_t lw = this->w, lh = this->h;
+    while (true) {
+        this->sizes.push_back({lw, lh});
+        this->levels.emplace_back(size_t(lw) * lh, 1.f);
+        if (lw == 1 && lh == 1)
+            break;
+        lw = std::max(1u, (lw + 1) / 2);
+        lh = std::max(1u, (lh + 1) / 2);
+    }
+}
+
+static void transform(const float m[16], const float* pos, float res[4]) {
+    for (int r = 0; r < 4; r++) {
+        res[r] = m[r] * pos[0] + m[4 + r] * pos[1] + m[8 + r] * pos[2] + m[12 + r];
+    }
+}
+
+void OcclusionCuller::render(const occluders_t& occluders, const float clip[16], const stk_map_t* map) {
+    std::fill(this->levels[0].begin(), this->levels[0].end(), 1.f);
+    this->triangles_rasterized = 0;
+
+    // a hidden mesh can't hide anything either
+    const auto* world = map && !map->models.empty() ? &map->models[0].meshes : nullptr;
+
+    for (size_t t = 0; t < occluders.count(); t++) {
+        if (world && occluders.meshes[t] < world->size() && !(*world)[occluders.meshes[t]].draw)
+            continue;
+
+        float in[3][4];
+        for (int k = 0; k < 3; k++) {
+            transform(clip, &occluders.triangles[t * 9 + k * 3], in[k]);
+        }
+
+        // all corners outside one of the side planes
+        auto outside = false;
+        for (int axis = 0; axis < 2 && !outside; axis++) {
+            outside = (in[0][axis] > in[0][3] && in[1][axis] > in[1][3] && in[2][axis] > in[2][3]) ||
+                      (in[0][axis] < -in[0][3] && in[1][axis] < -in[1][3] && in[2][axis] < -in[2][3]);
+        }
+        if (outside)
+            continue;
+
+        // only the near plane gets clipped, past it w is positive and the rest is just bounds clamping
+        float poly[4][4];
+        int   n = 0;
+        for (int k = 0; k < 3; k++) {
+            const auto a = in[k], b = in[(k + 1) % 3];
+            const auto da = a[2] + a[3], db = b[2] + b[3];
+            if (da >= 0.f)
+                std::copy(a, a + 4, poly[n++]);
+            if ((da >= 0.f) != (db >= 0.f)) {
+                const auto s = da / (da - db);
+                for (int c = 0; c < 4; c++) {
+                    poly[n][c] = a[c] + (b[c] - a[c]) * s;
+                }
+                n++;
+            }
+        }
+        if (n < 3)
+            continue;
+
+        float screen[4][3];
+        for (int k = 0; k < n; k++) {
+            const auto inv_w = 1.f / poly[k][3];
+            screen[k][0]     = (poly[k][0] * inv_w * 0.5f + 0.5f) * float(this->w);
+            screen[k][1]     = (poly[k][1] * inv_w * 0.5f + 0.5f) * float(this->h);
+            screen[k][2]     = poly[k][2] * inv_w * 0.5f + 0.5f;
+        }
+        for (int k = 1; k + 1 < n; k++) {
+            const float tri[3][3] = {
+                {screen[0][0], screen[0][1], screen[0][2]},
+                {screen[k][0], screen[k][1], screen[k][2]},
+                {screen[k + 1][0], screen[k + 1][1], screen[k + 1][2]},
+            };
+            this->rasterize(tri);
+            this->triangles_rasterized++;
+        }
+    }
+
+    this->build_pyramid();
+}
+
+void OcclusionCuller::rasterize(const float screen[3][3]) {
+    const float* a = screen[0];
+    const float* b = screen[1];
+    const float* c = screen[2];
+
+    auto area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+    // occluders are two sided
+    if (area < 0.f) {
+        std::swap(b, c);
+        area = -area;
+    }
+    if (!(area > 1e-6f))
+        return;
+
+    const auto min_x = std::max(0, int(std::floor(std::min({a[0], b[0], c[0]}))));
+    const auto max_x = std::min(int(this->w) - 1, int(std::floor(std::max({a[0], b[0], c[0]}))));
+    const auto min_y = std::max(0, int(std::floor(std::min({a[1], b[1], c[1]}))));
+    const auto max_y = std::min(int(this->h) - 1, int(std::floor(std::max({a[1], b[1], c[1]}))));
+    if (min_x > max_x || min_y > max_y)
+        return;
+
+    // z = z0 + dzdx * x + dzdy * y, NDC depth is linear in screen space
+    const auto dzdx = ((b[2] - a[2]) * (c[1] - a[1]) - (c[2] - a[2]) * (b[1] - a[1])) / area;
+    const auto dzdy = ((c[2] - a[2]) * (b[0] - a[0]) - (b[2] - a[2]) * (c[0] - a[0])) / area;
+    const auto z0   = a[2] - dzdx * a[0] - dzdy * a[1];
+
+    // e = ex * x + ey * y + e0, inside when all three are >= 0
+    const float* corners[3] = {a, b, c};
+    float        ex[3], ey[3], e0[3];
+    for (int e = 0; e < 3; e++) {
+        const auto v0 = corners[e], v1 = corners[(e + 1) % 3];
+        ex[e]         = v0[1] - v1[1];
+        ey[e]         = v1[0] - v0[0];
+        e0[e]         = -(ex[e] * v0[0] + ey[e] * v0[1]);
+    }
+
+    auto&      depth   = this->levels[0];
+    const auto start_x = min_x & ~3; // rows are a multiple of 4 wide so groups never run off the end
+
+#if defined(__SSE2__) || defined(_M_X64)
+    const auto lane_x = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const auto zero   = _mm_setzero_ps();
+    const auto one    = _mm_set1_ps(1.f);
+
+    __m128 edge_x[3];
+    for (int e = 0; e < 3; e++) {
+        edge_x[e] = _mm_set1_ps(ex[e]);
+    }
+    const auto depth_x = _mm_set1_ps(dzdx);
+
+    for (int y = min_y; y <= max_y; y++) {
+        const auto py  = float(y) + 0.5f;
+        auto       row = &depth[size_t(y) * this->w];
+
+        __m128 edge_row[3];
+        for (int e = 0; e < 3; e++) {
+            edge_row[e] = _mm_set1_ps(ey[e] * py + e0[e]);
+        }
+        const auto depth_row = _mm_set1_ps(dzdy * py + z0);
+
+        for (int x = start_x; x <= max_x; x += 4) {
+            const auto px = _mm_add_ps(_mm_set1_ps(float(x)), lane_x);
+
+            auto inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edge_x[0], px), edge_row[0]), zero);
+            inside      = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edge_x[1], px), edge_row[1]), zero));
+            inside      = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edge_x[2], px), edge_row[2]), zero));
+            if (!_mm_movemask_ps(inside))
+                continue;
+
+            const auto z   = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(depth_x, px), depth_row), zero), one);
+            const auto old = _mm_loadu_ps(row + x);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, _mm_min_ps(old, z)), _mm_andnot_ps(inside, old)));
+        }
+    }
+#else
+    for (int y = min_y; y <= max_y; y++) {
+        const auto py  = float(y) + 0.5f;
+        auto       row = &depth[size_t(y) * this->w];
+        for (int x = start_x; x <= max_x; x++) {
+            const auto px = float(x) + 0.5f;
+            if (ex[0] * px + ey[0] * py + e0[0] < 0.f || ex[1] * px + ey[1] * py + e0[1] < 0.f || ex[2] * px + ey[2] * py + e0[2] < 0.f)
+                continue;
+            const auto z = std::min(std::max(dzdx * px + dzdy * py + z0, 0.f), 1.f);
+            row[x]       = std::min(row[x], z);
+        }
+    }
+#endif
+}
+
+void OcclusionCuller::build_pyramid() {
+    for (size_t l = 1; l < this->levels.size(); l++) {
+        const auto& src  = this->levels[l - 1];
+        const auto  size = this->sizes[l - 1];
+        auto&       dst  = this->levels[l];
+        for (uint32_t y = 0; y < this->sizes[l].h; y++) {
+            const auto y0 = std::min(y * 2, size.h - 1), y1 = std::min(y * 2 + 1, size.h - 1);
+            for (uint32_t x = 0; x < this->sizes[l].w; x++) {
+                const auto x0 = std::min(x * 2, size.w - 1), x1 = std::min(x * 2 + 1, size.w - 1);
+
+                dst[size_t(y) * this->sizes[l].w + x] = std::max(std::max(src[y0 * size.w + x0], src[y0 * size.w + x1]), std::max(src[y1 * size.w + x0], src[y1 * size.w + x1]));
+            }
+        }
+    }
+}
+
+bool OcclusionCuller::box_visible(const float center[3], const float extent[3], const float clip[16]) const {
+    float min_x = std::numeric_limits<float>::max(), max_x = -min_x;
+    float min_y = min_x, max_y = -min_x;
+    float min_z = min_x;
+    for (int k = 0; k < 8; k++) {
+        const float corner[3] = {
+            center[0] + (k & 1 ? extent[0] : -extent[0]),
+            center[1] + (k & 2 ? extent[1] : -extent[1]),
+            center[2] + (k & 4 ? extent[2] : -extent[2]),
+        };
+        float pos[4];
+        transform(clip, corner, pos);
+        // reaches past the near plane, it's right in front of the camera
+        if (pos[2] < -pos[3] || pos[3] <= 0.f)
+            return true;
+
+        const auto inv_w = 1.f / pos[3];
+        const auto x     = (pos[0] * inv_w * 0.5f + 0.5f) * float(this->w);
+        const auto y     = (pos[1] * inv_w * 0.5f + 0.5f) * float(this->h);
+        min_x            = std::min(min_x, x);
+        max_x            = std::max(max_x, x);
+        min_y            = std::min(min_y, y);
+        max_y            = std::max(max_y, y);
+        min_z            = std::min(min_z, pos[2] * inv_w * 0.5f + 0.5f);
+    }
+
+    // off screen is hidden too
+    const auto x0 = std::max(0.f, std::floor(min_x)), x1 = std::min(float(this->w - 1), std::floor(max_x));
+    const auto y0 = std::max(0.f, std::floor(min_y)), y1 = std::min(float(this->h - 1), std::floor(max_y));
+    if (x0 > x1 || y0 > y1)
+        return false;
+
+    // coarsest level where the rect is at most 3 texels across
+    const auto extent_px = std::max(uint32_t(x1 - x0), uint32_t(y1 - y0)) + 1;
+    size_t     l         = 0;
+    while ((extent_px >> l) > 2 && l + 1 < this->levels.size())
+        l++;
+
+    const auto& level = this->levels[l];
+    const auto  lw    = this->sizes[l].w;
+    for (auto ty = uint32_t(y0) >> l; ty <= (uint32_t(y1) >> l); ty++) {
+        for (auto tx = uint32_t(x0) >> l; tx <= (uint32_t(x1) >> l); tx++) {
+            if (min_z <= level[size_t(ty) * lw + tx])
+                return true;
+        }
+    }
+    return false;
+}
+
+size_t OcclusionCuller::cull(const cull_bounds_t& bounds, const float clip[16], uint8_t* visible) const {
+    size_t count = 0;
+    for (size_t i = 0; i < bounds.count; i++) {
+        if (!visible[i])
+            continue;
+
+        const float center[3] = {bounds.center[0][i], bounds.center[1][i], bounds.center[2][i]};
+        const float extent[3] = {bounds.extent[0][i], bounds.extent[1][i], bounds.extent[2][i]};
+        if (this->box_visible(center, extent, clip))
+            count++;
+        else
+            visible[i] = 0;
+    }
+    return count;
+}
+
+// --- occlusion_selftest
+
+bool occlusion_selftest(std::ostream& out) {
+    // a wall over the left half of the view, the camera is at the origin looking down -z
+    stk_map_t map;
+    for (const auto& corner : {vertex_t{{-1000.f, -1000.f, -1000.f}}, vertex_t{{0.f, -1000.f, -1000.f}}, vertex_t{{0.f, 1000.f, -1000.f}}, vertex_t{{-1000.f, 1000.f, -1000.f}}}) {
+        stk_vertex_t vertex = {};
+        vertex.pos          = corner;
+        map.vertex_vec.push_back(vertex);
+    }
+    map.index_vec = {0, 1, 2, 0, 2, 3};
+    map.models.resize(1);
+    map.models[0].meshes.resize(1);
+    auto& wall           = map.models[0].meshes[0];
+    wall.dec.indices     = uint32_t(map.index_vec.size());
+    wall.dec.base_index  = 0;
+    wall.dec.base_vertex = 0;
+
+    occluders_t occluders;
+    build_occluders(map, OCCLUSION_MAX_TRIANGLES, &occluders);
+
+    struct box_t {
+        const char* name;
+        float       mins[3], maxs[3];
+        bool        visible; // with the wall drawn, all of them are without it
+    };
+    const box_t boxes[] = {
+        {"behind", {-600.f, -100.f, -2100.f}, {-400.f, 100.f, -1900.f}, false},
+        {"beside", {400.f, -100.f, -2100.f}, {600.f, 100.f, -1900.f}, true},
+        {"in front of", {-600.f, -100.f, -600.f}, {-400.f, 100.f, -400.f}, true},
+    };
+    cull_bounds_t bounds;
+    for (const auto& box : boxes) {
+        cull_bounds_push(&bounds, box.mins, box.maxs);
+    }
+    cull_bounds_pad(&bounds);
+
+    // glm::perspective(90 degrees, 1, 16, 102400), the view is the identity
+    const float z_near = 16.f, z_far = 102400.f;
+
+    float clip[16] = {};
+    clip[0]        = 1.f;
+    clip[5]        = 1.f;
+    clip[10]       = (z_far + z_near) / (z_near - z_far);
+    clip[11]       = -1.f;
+    clip[14]       = 2.f * z_far * z_near / (z_near - z_far);
+
+    bool            succ = occluders.count() == 2;
+    OcclusionCuller culler;
+    for (const auto draw : {true, false}) {
+        wall.draw = draw;
+        culler.render(occluders, clip, &map);
+
+        std::vector<uint8_t> visible(bounds.padded(), 1);
+        culler.cull(bounds, clip, visible.data());
+        for (size_t i = 0; i < bounds.count; i++) {
+            const auto ok = bool(visible[i]) == (boxes[i].visible || !draw);
+            out << (ok ? "ok   " : "FAIL ") << "box " << boxes[i].name << (draw ? " the wall" : " the hidden wall") << (visible[i] ? " is visible" : " is culled")
+                << std::endl;
+            succ &= ok;
+        }
+    }
+    return succ;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "cull.hh"
+#include "map.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// CPU occlusion culling, no GPU readback so it works on the frame it's for.
+// The biggest triangles of the world get rasterized into a small depth buffer, a max pyramid of it is built,
+// and a box is hidden when its nearest point is behind the furthest depth of every texel it covers.
+
+constexpr uint32_t OCCLUSION_WIDTH  = 256; // multiple of 4
+constexpr uint32_t OCCLUSION_HEIGHT = 128;
+constexpr size_t   OCCLUSION_MAX_TRIANGLES = 4096;
+// Smaller ones hide too little to be worth rasterizing, in square units
+constexpr float OCCLUSION_MIN_AREA = 8192.f;
+
+// xyz of the three corners of each triangle, biggest first
+struct occluders_t {
+    std::vector<float>    triangles;
+    std::vector<uint32_t> meshes; // per triangle, which of the world model's it came from
+
+    size_t count() const { return this->triangles.size() / 9; }
+};
+
+// Picks by area out of the meshes of the world model
+void build_occluders(const stk_map_t& map, size_t max_triangles, occluders_t* res);
+
+class OcclusionCuller {
+public:
+    OcclusionCuller(uint32_t width = OCCLUSION_WIDTH, uint32_t height = OCCLUSION_HEIGHT);
+
+    // Clears, rasterizes the occluders and builds the pyramid.
+    // clip - column major like glm and GL, with -w <= z <= w
+    // map - triangles of meshes it has draw off for are skipped, all of them get drawn if null
+    void render(const occluders_t& occluders, const float clip[16], const stk_map_t* map = nullptr);
+
+    // Only boxes whose visible is set get tested, it gets cleared for the hidden ones.
+    // Returns how many of bounds.count are still visible, clip has to be the one render got.
+    size_t cull(const cull_bounds_t& bounds, const float clip[16], uint8_t* visible) const;
+
+    uint32_t width() const { return this->w; }
+    uint32_t height() const { return this->h; }
+    // 0 (near) to 1 (far), bottom row first
+    const std::vector<float>& depth() const { return this->levels[0]; }
+
+    size_t triangles_rasterized = 0; // last render, after clipping
+
+private:
+    struct level_t {
+        uint32_t w, h;
+    };
+
+    void rasterize(const float screen[3][3]);
+    void build_pyramid();
+    bool box_visible(const float center[3], const float extent[3], const float clip[16]) const;
+
+    uint32_t                        w, h;
+    std::vector<level_t>            sizes;
+    std::vector<std::vector<float>> levels; // 0 is the depth buffer, every one after is the max of 2x2 of the one before
+};
+
+// Culls made up boxes around a made up wall, one behind it, one beside it and one in front,
+// with the wall drawn and hidden, prints a line per case to out
+bool occlusion_selftest(std::ostream& out);
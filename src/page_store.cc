@@ -0,0 +1,292 @@
+#include "page_store.hh"
+
+#include "rpak.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+constexpr uint32_t MANIFEST_MAGIC   = 'MP5R';
+constexpr uint32_t MANIFEST_VERSION = 1;
+constexpr uint32_t PAGE_MAGIC       = 'GP5R';
+
+struct manifest_header_t {
+    uint32_t magic;
+    uint32_t version;
+
+    uint64_t tables_size; // header and everything up to the first page
+    uint64_t total_size; // size_decompressed
+
+    uint32_t pages_num;
+    uint32_t _pad;
+};
+
+struct manifest_page_t {
+    hash128_t hash;
+    uint64_t  size;
+};
+
+struct page_file_header_t {
+    uint32_t magic;
+    uint32_t compressed;
+    uint64_t size; // decompressed
+};
+
+// --- zero run "compression": [u32 literal count][literals][u32 zero count] until done
+static std::vector<uint8_t> squash_zeros(const uint8_t* data, size_t size) {
+    std::vector<uint8_t> ret;
+    ret.reserve(size / 2);
+
+    auto put_u32 = [&](uint32_t v) {
+        const auto at = ret.size();
+        ret.resize(at + 4);
+        memcpy(ret.data() + at, &v, 4);
+    };
+
+    size_t i = 0;
+    while (i < size) {
+        // short zero runs aren't worth the 8 byte token
+        size_t literal_end = i;
+        while (literal_end < size) {
+            size_t zeros = 0;
+            while (literal_end + zeros < size && zeros < 16 && !data[literal_end + zeros])
+                zeros++;
+            if (zeros == 16 || literal_end + zeros == size)
+                break;
+            literal_end += zeros + 1;
+        }
+
+        put_u32(uint32_t(literal_end - i));
+        ret.insert(ret.end(), data + i, data + literal_end);
+        i = literal_end;
+
+        size_t zero_end = i;
+        while (zero_end < size && !data[zero_end])
+            zero_end++;
+        put_u32(uint32_t(zero_end - i));
+        i = zero_end;
+    }
+
+    return ret;
+}
+
+static bool unsquash_zeros(const uint8_t* data, size_t size, uint8_t* out, size_t out_size) {
+    size_t i = 0, o = 0;
+    while (o < out_size) {
+        uint32_t literal, zeros;
+        if (i + 4 > size)
+            return false;
+        memcpy(&literal, data + i, 4);
+        i += 4;
+        if (i + literal + 4 > size || o + literal > out_size)
+            return false;
+        memcpy(out + o, data + i, literal);
+        i += literal;
+        o += literal;
+
+        memcpy(&zeros, data + i, 4);
+        i += 4;
+        if (o + zeros > out_size)
+            return false;
+        memset(out + o, 0, zeros);
+        o += zeros;
+    }
+
+    return true;
+}
+
+static bool write_file(const fs::path& path, const void* header, size_t header_size, const void* data, size_t size) {
+    fs::create_directories(path.parent_path());
+
+    // rename so a half written file never looks valid
+    auto          tmp = path;
+    std::ofstream f(tmp += ".tmp", std::ofstream::binary);
+    f.write((const char*)header, header_size);
+    f.write((const char*)data, size);
+    f.close();
+    if (f.fail())
+        return false;
+
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    return !ec;
+}
+
+// Page file into out, which has size bytes. False if it's missing, broken or not that size.
+static bool read_page(const std::string& path, uint64_t size, uint8_t* out, std::vector<uint8_t>* squashed) {
+    std::ifstream      page(path, std::ifstream::binary);
+    page_file_header_t page_header;
+    page.read((char*)&page_header, sizeof(page_header));
+    if (page.fail() || page_header.magic != PAGE_MAGIC || page_header.size != size)
+        return false;
+
+    if (!page_header.compressed) {
+        page.read((char*)out, size);
+        return !page.fail();
+    }
+
+    page.seekg(0, std::ios::end);
+    const auto end = page.tellg();
+    if (page.fail() || end < std::streamoff(sizeof(page_header)))
+        return false;
+    squashed->resize(size_t(end) - sizeof(page_header));
+    page.seekg(sizeof(page_header), std::ios::beg);
+    page.read((char*)squashed->data(), squashed->size());
+    return !page.fail() && unsquash_zeros(squashed->data(), squashed->size(), out, size);
+}
+
+PageStore::PageStore(const std::string& root, bool compress) : root(root), compress(compress) {
+}
+
+std::string PageStore::manifest_path(const std::string& name, uint64_t timestamp) const {
+    char buf[24];
+    sprintf(buf, "-%016llx", (unsigned long long)timestamp);
+    return (fs::path(this->root) / "paks" / (name + buf + ".manifest")).string();
+}
+
+std::string PageStore::page_path(const hash128_t& hash) const {
+    char buf[40];
+    sprintf(buf, "%016llx%016llx", (unsigned long long)hash.hi, (unsigned long long)hash.lo);
+    return (fs::path(this->root) / "pages" / std::string(buf, 2) / (std::string(buf) + ".page")).string();
+}
+
+bool PageStore::has(const std::string& name, uint64_t timestamp) const {
+    std::error_code ec;
+    return fs::exists(this->manifest_path(name, timestamp), ec);
+}
+
+bool PageStore::put(const std::string& name, uint8_t* deta) {
+    const auto layout = rpak_parse_layout(deta);
+    const auto header = layout.header;
+
+    manifest_header_t manifest;
+    manifest.magic       = MANIFEST_MAGIC;
+    manifest.version     = MANIFEST_VERSION;
+    manifest.tables_size = layout.pages.size() ? (layout.pages[0] - deta) : header->size_decompressed;
+    manifest.total_size  = header->size_decompressed;
+    manifest.pages_num   = uint32_t(layout.pages.size());
+    manifest._pad        = 0;
+
+    std::vector<uint8_t> body(deta, deta + manifest.tables_size);
+    std::vector<uint8_t> existing, squashed;
+    for (size_t i = 0; i < layout.pages.size(); i++) {
+        const auto page = layout.pages[i];
+        const auto size = layout.data_chunks[i].size;
+
+        manifest_page_t entry;
+        entry.hash = hash_bytes128(page, size);
+        entry.size = size;
+
+        const auto at = body.size();
+        body.resize(at + sizeof(entry));
+        memcpy(body.data() + at, &entry, sizeof(entry));
+
+        // the hash isn't collision resistant, only a page with the same bytes counts as already there
+        const auto      path = this->page_path(entry.hash);
+        std::error_code ec;
+        if (fs::exists(path, ec)) {
+            existing.resize(size);
+            if (!read_page(path, size, existing.data(), &squashed) || (size && memcmp(existing.data(), page, size))) {
+                std::cerr << "PageStore: " << path << " has the same hash as page " << i << " of " << name << " but different contents" << std::endl;
+                return false;
+            }
+            this->pages_deduped++;
+            this->bytes_deduped += size;
+            continue;
+        }
+
+        page_file_header_t page_header;
+        page_header.magic      = PAGE_MAGIC;
+        page_header.compressed = 0;
+        page_header.size       = size;
+
+        squashed.clear();
+        if (this->compress) {
+            squashed = squash_zeros(page, size);
+            if (squashed.size() < size)
+                page_header.compressed = 1;
+        }
+
+        const auto stored      = page_header.compressed ? squashed.data() : page;
+        const auto stored_size = page_header.compressed ? squashed.size() : size;
+        if (!write_file(path, &page_header, sizeof(page_header), stored, stored_size)) {
+            std::cerr << "PageStore: failed to write " << path << std::endl;
+            return false;
+        }
+
+        this->pages_written++;
+        this->bytes_written += stored_size;
+    }
+
+    return write_file(this->manifest_path(name, header->timestamp), &manifest, sizeof(manifest), body.data(), body.size());
+}
+
+bool PageStore::get(const std::string& name, uint64_t timestamp, std::vector<uint8_t>* res_data) const {
+    std::ifstream f(this->manifest_path(name, timestamp), std::ifstream::binary);
+    if (f.fail())
+        return false;
+
+    manifest_header_t manifest;
+    f.read((char*)&manifest, sizeof(manifest));
+    if (f.fail() || manifest.magic != MANIFEST_MAGIC || manifest.version != MANIFEST_VERSION)
+        return false;
+
+    if (manifest.tables_size > manifest.total_size)
+        return false;
+
+    std::vector<uint8_t> out(manifest.total_size);
+    f.read((char*)out.data(), manifest.tables_size);
+    if (f.fail())
+        return false;
+
+    std::vector<uint8_t> squashed;
+
+    size_t offset = manifest.tables_size;
+    for (size_t i = 0; i < manifest.pages_num; i++) {
+        manifest_page_t entry;
+        f.read((char*)&entry, sizeof(entry));
+        if (f.fail() || entry.size > out.size() - offset)
+            return false;
+
+        if (!read_page(this->page_path(entry.hash), entry.size, out.data() + offset, &squashed)) {
+            std::cerr << "PageStore: missing page " << i << " of " << name << std::endl;
+            return false;
+        }
+
+        offset += entry.size;
+    }
+
+    *res_data = std::move(out);
+    return true;
+}
+
+bool rpak_decompress_cached(PageStore* store, const char* name, std::vector<uint8_t>* res_data) {
+    if (!store)
+        return rpak_decompress(name, res_data);
+
+    rpak_header_t header;
+    {
+        std::ifstream f(name, std::ifstream::binary);
+        if (f.fail())
+            return false;
+        f.read((char*)&header, sizeof(header));
+        if (f.fail())
+            return false;
+    }
+
+    const auto stem = fs::path(name).stem().string();
+    if (store->get(stem, header.timestamp, res_data))
+        return true;
+
+    if (!rpak_decompress(name, res_data))
+        return false;
+
+    if (!store->put(stem, res_data->data()))
+        std::cerr << "PageStore: couldn't store " << name << std::endl;
+
+    return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "hash.hh"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Content addressed store of decompressed rpak pages.
+// Every unique page is kept once under <root>/pages/, a pak is just a manifest under <root>/paks/
+// (header + tables blob and a list of page hashes), so common paks and game versions share everything that didn't change.
+//
+// <root>/paks/<name>-<timestamp>.manifest
+// <root>/pages/<first 2 hex digits>/<hash>.page
+class PageStore {
+public:
+    // compress - zero runs get squashed, pages are mostly padding and empty mips
+    PageStore(const std::string& root, bool compress = false);
+
+    // name is the pak's file name without extension, timestamp comes from the header
+    bool has(const std::string& name, uint64_t timestamp) const;
+    bool put(const std::string& name, uint8_t* deta);
+    bool get(const std::string& name, uint64_t timestamp, std::vector<uint8_t>* res_data) const;
+
+    size_t pages_written = 0;
+    size_t pages_deduped = 0;
+    size_t bytes_written = 0;
+    size_t bytes_deduped = 0;
+
+private:
+    std::string manifest_path(const std::string& name, uint64_t timestamp) const;
+    std::string page_path(const hash128_t& hash) const;
+
+    std::string root;
+    bool        compress;
+};
+
+// rpak_decompress, but pages come from (and go into) the store when there is one.
+// Warm loads only read the pak header, no decompression.
+bool rpak_decompress_cached(PageStore* store, const char* name, std::vector<uint8_t>* res_data);
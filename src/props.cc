@@ -0,0 +1,235 @@
+#include "props.hh"
+
+#include <cmath>
+#include <iostream>
+
+// Placeholder for models we can't find, props still show up where they are
+constexpr float PROP_UNRESOLVED_EXTENT = 16.f;
+
+// The prop struct and what comes between the count and the props change with the sprp version
+struct sprp_layout_t {
+    uint32_t version;
+    uint32_t header_size; // props_num and whatever follows it
+    uint32_t stride; // of a prop
+};
+constexpr sprp_layout_t SPRP_LAYOUTS[] = {
+    {13, 12, 64},
+};
+
+template <typename T>
+static bool read_at(span<const uint8_t> bytes, size_t offset, T* res) {
+    if (offset + sizeof(T) > bytes.size())
+        return false;
+    memcpy(res, bytes.data() + offset, sizeof(T));
+    return true;
+}
+
+// [0, 1] cube, 4 vertices a face so the normals are flat
+static void make_box(stk_props_t& props) {
+    static const float normals[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+
+    for (uint16_t face = 0; face < 6; face++) {
+        const auto axis = face / 2;
+        const auto u    = (axis + 1) % 3;
+        const auto v    = (axis + 2) % 3;
+        const auto side = face % 2 ? 0.f : 1.f;
+
+        const auto base = uint16_t(props.vertex_vec.size());
+        for (int corner = 0; corner < 4; corner++) {
+            stk_vertex_t vertex = {};
+            vertex.pos.coords[axis]    = side;
+            vertex.pos.coords[u]       = float(corner & 1);
+            vertex.pos.coords[v]       = float(corner >> 1);
+            vertex.normal.coords[0]    = normals[face][0];
+            vertex.normal.coords[1]    = normals[face][1];
+            vertex.normal.coords[2]    = normals[face][2];
+            vertex.uv[0]               = float(corner & 1);
+            vertex.uv[1]               = float(corner >> 1);
+            props.vertex_vec.push_back(vertex);
+        }
+        for (const uint16_t i : {0, 1, 3, 0, 3, 2}) {
+            props.index_vec.push_back(base + i);
+        }
+    }
+}
+
+// Where the sprp sub lump is inside of the game lump bytes
+static bool find_static_props(BspFile& bsp, span<const uint8_t> game_lump, span<const uint8_t>* res, uint32_t* version) {
+    game_lump_header_t header;
+    if (!read_at(game_lump, 0, &header))
+        return false;
+
+    for (uint32_t i = 0; i < header.lumps_num; i++) {
+        game_lump_t entry;
+        if (!read_at(game_lump, sizeof(header) + i * sizeof(entry), &entry)) {
+            std::cerr << "Game lump directory is cut off at " << i << '/' << header.lumps_num << std::endl;
+            return false;
+        }
+        if (entry.id != GAME_LUMP_STATIC_PROPS)
+            continue;
+
+        // offsets are into the .bsp, but external game lumps have been seen counting from their own start
+        const size_t lump_offset = bsp.header().lumps[size_t(LUMPS::GAME_LUMP)].offset;
+        size_t       offset      = entry.offset;
+        if (offset >= lump_offset && offset - lump_offset + entry.size <= game_lump.size())
+            offset -= lump_offset;
+        if (offset + entry.size > game_lump.size()) {
+            std::cerr << "Static props at " << entry.offset << " are outside of the game lump" << std::endl;
+            return false;
+        }
+
+        *res     = span<const uint8_t>{game_lump.data() + offset, entry.size};
+        *version = entry.version;
+        return true;
+    }
+
+    return false;
+}
+
+bool load_static_props(BspFile& bsp, stk_props_t* res) {
+    *res = {};
+    make_box(*res);
+
+    span<const uint8_t> sprp;
+    if (!find_static_props(bsp, bsp.lump_bytes(LUMPS::GAME_LUMP), &sprp, &res->version))
+        return true; // plenty of maps have none
+
+    uint32_t names_num;
+    if (!read_at(sprp, 0, &names_num) || 4 + size_t(names_num) * STATIC_PROP_NAME_SIZE > sprp.size()) {
+        std::cerr << "Static prop names don't fit the lump" << std::endl;
+        return false;
+    }
+    for (uint32_t i = 0; i < names_num; i++) {
+        const auto name = reinterpret_cast<const char*>(sprp.data()) + 4 + i * STATIC_PROP_NAME_SIZE;
+        res->models.emplace_back(name, strnlen(name, STATIC_PROP_NAME_SIZE));
+    }
+
+    size_t   at = 4 + size_t(names_num) * STATIC_PROP_NAME_SIZE;
+    uint32_t props_num;
+    if (!read_at(sprp, at, &props_num)) {
+        std::cerr << "Static props have no count" << std::endl;
+        return false;
+    }
+
+    const sprp_layout_t* layout = nullptr;
+    for (const auto& known : SPRP_LAYOUTS) {
+        if (known.version == res->version)
+            layout = &known;
+    }
+    if (!layout) {
+        std::cerr << "Static props are version " << res->version << ", don't know its layout" << std::endl;
+        return false;
+    }
+
+    const size_t props_offset = at + layout->header_size;
+    res->stride               = layout->stride;
+    if (props_offset + size_t(props_num) * res->stride > sprp.size()) {
+        std::cerr << props_num << " static props don't fit the lump, " << (sprp.size() - at) << " bytes for them" << std::endl;
+        return false;
+    }
+
+    // counting sort by model, one draw per model
+    std::vector<uint32_t> counts(names_num + 1, 0);
+    std::vector<uint8_t>  valid(props_num, 0);
+    size_t                bad = 0;
+    for (uint32_t i = 0; i < props_num; i++) {
+        static_prop_t prop;
+        memcpy(&prop, sprp.data() + props_offset + size_t(i) * res->stride, sizeof(prop));
+        if (prop.model_index >= names_num) {
+            bad++;
+            continue;
+        }
+        valid[i] = 1;
+        counts[prop.model_index + 1]++;
+    }
+    if (bad)
+        std::cerr << bad << " static props point at models that aren't in the dictionary" << std::endl;
+
+    for (uint32_t model = 0; model < names_num; model++) {
+        const auto first = counts[model];
+        counts[model + 1] += first;
+
+        const auto instances = counts[model + 1] - first;
+        if (!instances)
+            continue;
+
+        dec_t draw;
+        draw.indices       = uint32_t(res->index_vec.size());
+        draw.instances     = instances;
+        draw.base_index    = 0;
+        draw.base_vertex   = 0;
+        draw.base_instance = first;
+        res->draws.push_back(draw);
+    }
+
+    res->props.resize(counts[names_num]);
+    for (uint32_t i = 0; i < props_num; i++) {
+        if (!valid[i])
+            continue;
+        static_prop_t prop;
+        memcpy(&prop, sprp.data() + props_offset + size_t(i) * res->stride, sizeof(prop));
+        res->props[counts[prop.model_index]++] = prop;
+    }
+
+    prop_bounds_t placeholder;
+    placeholder.mins = {{-PROP_UNRESOLVED_EXTENT, -PROP_UNRESOLVED_EXTENT, 0.f}};
+    placeholder.maxs = {{PROP_UNRESOLVED_EXTENT, PROP_UNRESOLVED_EXTENT, 2.f * PROP_UNRESOLVED_EXTENT}};
+    res->bounds.assign(names_num, placeholder);
+    res->resolved.assign(names_num, 0);
+
+    return true;
+}
+
+// Source's AngleMatrix, columns are forward, left, up
+static void angle_matrix(const float angles[3], float res[3][3]) {
+    constexpr float to_rad = 3.14159265358979f / 180.f;
+
+    const float sp = std::sin(angles[0] * to_rad), cp = std::cos(angles[0] * to_rad);
+    const float sy = std::sin(angles[1] * to_rad), cy = std::cos(angles[1] * to_rad);
+    const float sr = std::sin(angles[2] * to_rad), cr = std::cos(angles[2] * to_rad);
+
+    res[0][0] = cp * cy;
+    res[1][0] = cp * sy;
+    res[2][0] = -sp;
+
+    res[0][1] = sr * sp * cy - cr * sy;
+    res[1][1] = sr * sp * sy + cr * cy;
+    res[2][1] = sr * cp;
+
+    res[0][2] = cr * sp * cy + sr * sy;
+    res[1][2] = cr * sp * sy - sr * cy;
+    res[2][2] = cr * cp;
+}
+
+void build_prop_transforms(stk_props_t& props, JobPool& jobs) {
+    props.transforms.resize(props.props.size());
+
+    jobs.parallel_for(props.props.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const auto& prop   = props.props[i];
+            const auto& bounds = props.bounds[prop.model_index];
+            auto&       res    = props.transforms[i].m;
+
+            float rotation[3][3];
+            angle_matrix(prop.angles, rotation);
+
+            // world = origin + rotation * scale * (mins + size * box)
+            const auto scale = prop.scale > 0.f ? prop.scale : 1.f;
+            for (int column = 0; column < 3; column++) {
+                const auto size = (bounds.maxs.coords[column] - bounds.mins.coords[column]) * scale;
+                for (int row = 0; row < 3; row++) {
+                    res[column * 4 + row] = rotation[row][column] * size;
+                }
+                res[column * 4 + 3] = 0.f;
+            }
+            for (int row = 0; row < 3; row++) {
+                float offset = 0.f;
+                for (int column = 0; column < 3; column++) {
+                    offset += rotation[row][column] * bounds.mins.coords[column] * scale;
+                }
+                res[12 + row] = prop.origin[row] + offset;
+            }
+            res[15] = 1.f;
+        }
+    });
+}
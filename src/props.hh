@@ -0,0 +1,55 @@
+#pragma once
+
+#include "bsp.hh"
+#include "jobs.hh"
+#include "map.hh"
+
+#include <string>
+#include <vector>
+
+// Column major like GL wants it, goes into the instance buffer as is
+struct prop_transform_t {
+    float m[16];
+};
+static_assert(sizeof(prop_transform_t) == 64);
+
+struct prop_bounds_t {
+    vertex_t mins;
+    vertex_t maxs;
+};
+
+// Static props of the game lump, instanced.
+// Props are sorted by model so every model is one dec_t with instances = its prop count,
+// base_instance points at its first transform. All of them go out in one multi draw.
+// GL names are filled in by upload, same as stk_map_t.
+struct stk_props_t {
+    std::vector<std::string>   models; // names from the sprp dictionary
+    std::vector<prop_bounds_t> bounds; // per model, what gets drawn until we read model geometry
+    std::vector<uint8_t>       resolved; // per model, bounds came from the model asset
+
+    std::vector<static_prop_t>    props; // sorted by model_index
+    std::vector<prop_transform_t> transforms; // per prop, bounds baked in
+    std::vector<dec_t>            draws; // per model that has props
+
+    // shared geometry every model draws for now, a unit box
+    std::vector<stk_vertex_t> vertex_vec;
+    std::vector<uint16_t>     index_vec;
+
+    uint32_t stride  = 0; // of a prop in the lump
+    uint32_t version = 0; // of the sprp lump
+
+    uint32_t gl_vertex_array  = 0;
+    uint32_t vertex_buffer    = 0;
+    uint32_t index_buffer     = 0;
+    uint32_t transform_buffer = 0;
+    uint32_t draw_buffer      = 0;
+
+    bool loaded = false;
+};
+
+// Reads the sprp game lump, sorts the props by model and sets up the draws.
+// Every model gets a placeholder box in bounds, resolve them before build_prop_transforms.
+bool load_static_props(BspFile& bsp, stk_props_t* res);
+
+// transforms from the props and the bounds of their models
+void build_prop_transforms(stk_props_t& props, JobPool& jobs);
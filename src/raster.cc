@@ -0,0 +1,417 @@
+#include "raster.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+using triangle_t = SoftwareRasterizer::triangle_t;
+
+namespace {
+struct clip_vertex_t {
+    float pos[4];
+    float attrs[6]; // normal then map position
+};
+} // namespace
+
+SoftwareRasterizer::SoftwareRasterizer(uint32_t width, uint32_t height)
+    : w((std::max(width, 1u) + 3) & ~3u)
+    , h(std::max(height, 1u))
+    , tiles_x((this->w + RASTER_TILE - 1) / RASTER_TILE)
+    , tiles_y((this->h + RASTER_TILE - 1) / RASTER_TILE)
+    , color_buffer(size_t(this->w) * this->h, RASTER_CLEAR_COLOR)
+    , depth_buffer(size_t(this->w) * this->h, 1.f) {
+}
+
+// Near plane, then the guard band
+static float plane_distance(const clip_vertex_t& v, int plane) {
+    switch (plane) {
+    case 0:
+        return v.pos[2] + v.pos[3];
+    case 1:
+        return RASTER_GUARD_BAND * v.pos[3] - v.pos[0];
+    case 2:
+        return RASTER_GUARD_BAND * v.pos[3] + v.pos[0];
+    case 3:
+        return RASTER_GUARD_BAND * v.pos[3] - v.pos[1];
+    default:
+        return RASTER_GUARD_BAND * v.pos[3] + v.pos[1];
+    }
+}
+
+// Tiles the box of a triangle touches, inclusive. False when it has no pixels on screen.
+static bool triangle_tiles(const triangle_t& tri, uint32_t w, uint32_t h, uint32_t range[4]) {
+    const auto min_x = std::max(0.f, std::floor(std::min({tri.x[0], tri.x[1], tri.x[2]})));
+    const auto max_x = std::min(float(w - 1), std::floor(std::max({tri.x[0], tri.x[1], tri.x[2]})));
+    const auto min_y = std::max(0.f, std::floor(std::min({tri.y[0], tri.y[1], tri.y[2]})));
+    const auto max_y = std::min(float(h - 1), std::floor(std::max({tri.y[0], tri.y[1], tri.y[2]})));
+    if (!(min_x <= max_x && min_y <= max_y))
+        return false;
+
+    range[0] = uint32_t(min_x) / RASTER_TILE;
+    range[1] = uint32_t(min_y) / RASTER_TILE;
+    range[2] = uint32_t(max_x) / RASTER_TILE;
+    range[3] = uint32_t(max_y) / RASTER_TILE;
+    return true;
+}
+
+// Clips, goes to screen space and counts the tiles of whatever is left
+static void setup_triangle(const clip_vertex_t in[3], uint32_t w, uint32_t h, uint32_t tiles_x, std::vector<triangle_t>* out, uint32_t* tile_counts) {
+    for (int axis = 0; axis < 2; axis++) {
+        if ((in[0].pos[axis] > in[0].pos[3] && in[1].pos[axis] > in[1].pos[3] && in[2].pos[axis] > in[2].pos[3]) ||
+            (in[0].pos[axis] < -in[0].pos[3] && in[1].pos[axis] < -in[1].pos[3] && in[2].pos[axis] < -in[2].pos[3]))
+            return;
+    }
+
+    // every plane adds at most one vertex
+    clip_vertex_t polys[2][8];
+    int           n   = 3;
+    auto          src = polys[0], dst = polys[1];
+    std::copy(in, in + 3, src);
+    for (int plane = 0; plane < 5; plane++) {
+        float distances[8];
+        auto  outside = false;
+        for (int k = 0; k < n; k++) {
+            distances[k] = plane_distance(src[k], plane);
+            outside |= distances[k] < 0.f;
+        }
+        if (!outside)
+            continue;
+
+        int count = 0;
+        for (int k = 0; k < n; k++) {
+            const auto next = (k + 1) % n;
+            if (distances[k] >= 0.f)
+                dst[count++] = src[k];
+            if ((distances[k] >= 0.f) != (distances[next] >= 0.f)) {
+                const auto s = distances[k] / (distances[k] - distances[next]);
+                for (int c = 0; c < 4; c++) {
+                    dst[count].pos[c] = src[k].pos[c] + (src[next].pos[c] - src[k].pos[c]) * s;
+                }
+                for (int a = 0; a < 6; a++) {
+                    dst[count].attrs[a] = src[k].attrs[a] + (src[next].attrs[a] - src[k].attrs[a]) * s;
+                }
+                count++;
+            }
+        }
+        n = count;
+        std::swap(src, dst);
+        if (n < 3)
+            return;
+    }
+
+    triangle_t screen;
+    float      sx[8], sy[8], sz[8], inv_w[8];
+    for (int k = 0; k < n; k++) {
+        inv_w[k] = 1.f / src[k].pos[3];
+        sx[k]    = (src[k].pos[0] * inv_w[k] * 0.5f + 0.5f) * float(w);
+        sy[k]    = (src[k].pos[1] * inv_w[k] * 0.5f + 0.5f) * float(h);
+        sz[k]    = src[k].pos[2] * inv_w[k] * 0.5f + 0.5f;
+    }
+    for (int k = 1; k + 1 < n; k++) {
+        int corners[3] = {0, k, k + 1};
+
+        const auto area = (sx[k] - sx[0]) * (sy[k + 1] - sy[0]) - (sy[k] - sy[0]) * (sx[k + 1] - sx[0]);
+        if (!(std::abs(area) > 1e-8f))
+            continue;
+        // two sided like the GL path, wound counter clockwise from here on
+        if (area < 0.f)
+            std::swap(corners[1], corners[2]);
+
+        for (int v = 0; v < 3; v++) {
+            const auto c    = corners[v];
+            screen.x[v]     = sx[c];
+            screen.y[v]     = sy[c];
+            screen.z[v]     = sz[c];
+            screen.inv_w[v] = inv_w[c];
+            for (int a = 0; a < 6; a++) {
+                screen.attrs[v][a] = src[c].attrs[a] * inv_w[c];
+            }
+        }
+
+        uint32_t range[4];
+        if (!triangle_tiles(screen, w, h, range))
+            continue;
+        for (auto ty = range[1]; ty <= range[3]; ty++) {
+            for (auto tx = range[0]; tx <= range[2]; tx++) {
+                tile_counts[ty * tiles_x + tx]++;
+            }
+        }
+        out->push_back(screen);
+    }
+}
+
+void SoftwareRasterizer::render(const stk_map_t& map, const raster_view_t& view, JobPool& jobs, raster_stats_t* stats) {
+    using clock      = std::chrono::steady_clock;
+    const auto begin = clock::now();
+
+    // in the order the GL path goes through them, triangles get numbered across all of them
+    struct draw_t {
+        const mesh_parsed_t* mesh;
+        dec_t                dec;
+    };
+    std::vector<draw_t> draws;
+    std::vector<size_t> first_triangle;
+    size_t              triangles = 0, id = 0;
+    for (const auto& model : map.models) {
+        for (const auto& mesh : model.meshes) {
+            if (mesh.draw && (!view.visible || view.visible[id])) {
+                const auto dec = mesh_lod_dec(mesh, view.lod);
+                if (dec.indices >= 3) {
+                    draws.push_back({&mesh, dec});
+                    first_triangle.push_back(triangles);
+                    triangles += dec.indices / 3;
+                }
+            }
+            id++;
+        }
+    }
+
+    const auto tiles  = this->tiles_x * this->tiles_y;
+    const auto chunks = (triangles + RASTER_CHUNK - 1) / RASTER_CHUNK;
+    this->chunk_triangles.resize(chunks);
+    this->chunk_tile_counts.assign(chunks * tiles, 0);
+
+    jobs.parallel_for(triangles, RASTER_CHUNK, [&](size_t first, size_t last) {
+        const auto chunk = first / RASTER_CHUNK;
+        auto&      out   = this->chunk_triangles[chunk];
+        out.clear();
+
+        size_t d = std::upper_bound(first_triangle.begin(), first_triangle.end(), first) - first_triangle.begin() - 1;
+        for (size_t t = first; t < last; t++) {
+            while (d + 1 < draws.size() && first_triangle[d + 1] <= t)
+                d++;
+            const auto& mesh = *draws[d].mesh;
+            const auto& dec  = draws[d].dec;
+
+            clip_vertex_t corners[3];
+            auto          ok = true;
+            for (int k = 0; k < 3 && ok; k++) {
+                const auto i     = dec.base_index + (t - first_triangle[d]) * 3 + k;
+                const auto index = uint32_t(map.index_vec[i]);
+
+                vertex_t pos = {}, normal = {};
+                ok = mesh_vertex_position(map, mesh, index, &pos) && mesh_vertex_normal(map, mesh, index, &normal);
+                for (int r = 0; r < 4; r++) {
+                    corners[k].pos[r] = view.clip[r] * pos.x + view.clip[4 + r] * pos.y + view.clip[8 + r] * pos.z + view.clip[12 + r];
+                }
+                std::copy(normal.coords, normal.coords + 3, corners[k].attrs);
+                std::copy(pos.coords, pos.coords + 3, corners[k].attrs + 3);
+            }
+            if (ok)
+                setup_triangle(corners, this->w, this->h, this->tiles_x, &out, &this->chunk_tile_counts[chunk * tiles]);
+        }
+    });
+    const auto setup_end = clock::now();
+
+    // counts become where each chunk's refs of a tile start, chunks stay in order so tiles draw in submission order
+    this->tile_offsets.resize(tiles + 1);
+    uint32_t total = 0;
+    for (uint32_t tile = 0; tile < tiles; tile++) {
+        this->tile_offsets[tile] = total;
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            auto&      count = this->chunk_tile_counts[chunk * tiles + tile];
+            const auto n     = count;
+            count            = total;
+            total += n;
+        }
+    }
+    this->tile_offsets[tiles] = total;
+    this->refs.resize(total);
+
+    jobs.parallel_for(chunks, 1, [&](size_t first, size_t last) {
+        for (size_t chunk = first; chunk < last; chunk++) {
+            auto        offsets = &this->chunk_tile_counts[chunk * tiles];
+            const auto& tris    = this->chunk_triangles[chunk];
+            for (uint32_t t = 0; t < tris.size(); t++) {
+                uint32_t range[4];
+                triangle_tiles(tris[t], this->w, this->h, range);
+                for (auto ty = range[1]; ty <= range[3]; ty++) {
+                    for (auto tx = range[0]; tx <= range[2]; tx++) {
+                        this->refs[offsets[ty * this->tiles_x + tx]++] = {uint32_t(chunk), t};
+                    }
+                }
+            }
+        }
+    });
+    const auto bin_end = clock::now();
+
+    jobs.parallel_for(tiles, 1, [&](size_t first, size_t last) {
+        for (size_t tile = first; tile < last; tile++) {
+            this->raster_tile(uint32_t(tile), view);
+        }
+    });
+    const auto end = clock::now();
+
+    if (stats) {
+        stats->triangles = triangles;
+        stats->setup     = 0;
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            stats->setup += this->chunk_triangles[chunk].size();
+        }
+        stats->refs      = total;
+        stats->setup_ms  = std::chrono::duration<double, std::milli>(setup_end - begin).count();
+        stats->bin_ms    = std::chrono::duration<double, std::milli>(bin_end - setup_end).count();
+        stats->raster_ms = std::chrono::duration<double, std::milli>(end - bin_end).count();
+        stats->total_ms  = std::chrono::duration<double, std::milli>(end - begin).count();
+    }
+}
+
+static uint32_t to_unorm8(float v) {
+    return uint32_t(std::min(std::max(v, 0.f), 1.f) * 255.f + 0.5f);
+}
+
+// FRAGMENT_SHADER at one pixel, b are the barycentrics
+static uint32_t shade(const triangle_t& tri, const float b[3], const raster_view_t& view) {
+    const auto w = 1.f / (b[0] * tri.inv_w[0] + b[1] * tri.inv_w[1] + b[2] * tri.inv_w[2]);
+
+    float attrs[6];
+    for (int a = 0; a < 6; a++) {
+        attrs[a] = (b[0] * tri.attrs[0][a] + b[1] * tri.attrs[1][a] + b[2] * tri.attrs[2][a]) * w;
+    }
+    const auto normal = attrs, pos = attrs + 3;
+
+    float light[3], normal_len = 0.f, light_len = 0.f, dot = 0.f;
+    for (int c = 0; c < 3; c++) {
+        light[c] = view.camera[c] - pos[c];
+        normal_len += normal[c] * normal[c];
+        light_len += light[c] * light[c];
+        dot += normal[c] * light[c];
+    }
+    const auto len  = std::sqrt(normal_len * light_len);
+    const auto diff = std::max(len > 0.f ? dot / len : 0.f, 0.001f);
+
+    uint32_t color = 0xFF000000;
+    for (int c = 0; c < 3; c++) {
+        const auto base = view.shading == RASTER_SHADING::NORMAL ? normal[c] : 0.603f;
+        color |= to_unorm8((0.1f + diff) * base) << (c * 8);
+    }
+    return color;
+}
+
+void SoftwareRasterizer::raster_tile(uint32_t tile, const raster_view_t& view) {
+    const auto x0 = (tile % this->tiles_x) * RASTER_TILE, y0 = (tile / this->tiles_x) * RASTER_TILE;
+    const auto x1 = std::min(this->w, x0 + RASTER_TILE), y1 = std::min(this->h, y0 + RASTER_TILE);
+
+    for (auto y = y0; y < y1; y++) {
+        std::fill_n(&this->color_buffer[size_t(y) * this->w + x0], x1 - x0, RASTER_CLEAR_COLOR);
+        std::fill_n(&this->depth_buffer[size_t(y) * this->w + x0], x1 - x0, 1.f);
+    }
+
+    for (auto r = this->tile_offsets[tile]; r < this->tile_offsets[tile + 1]; r++) {
+        const auto& tri = this->chunk_triangles[this->refs[r].chunk][this->refs[r].triangle];
+
+        const auto min_x = std::max(int(x0), int(std::floor(std::min({tri.x[0], tri.x[1], tri.x[2]}))));
+        const auto max_x = std::min(int(x1) - 1, int(std::floor(std::max({tri.x[0], tri.x[1], tri.x[2]}))));
+        const auto min_y = std::max(int(y0), int(std::floor(std::min({tri.y[0], tri.y[1], tri.y[2]}))));
+        const auto max_y = std::min(int(y1) - 1, int(std::floor(std::max({tri.y[0], tri.y[1], tri.y[2]}))));
+        if (min_x > max_x || min_y > max_y)
+            continue;
+
+        // edge opposite of each corner scaled by the area, so they come out as barycentrics: b = bx * x + by * y + b0
+        const auto area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.y[1] - tri.y[0]) * (tri.x[2] - tri.x[0]);
+        float      bx[3], by[3], b0[3];
+        for (int v = 0; v < 3; v++) {
+            const auto a = (v + 1) % 3, b = (v + 2) % 3;
+            bx[v]        = (tri.y[a] - tri.y[b]) / area;
+            by[v]        = (tri.x[b] - tri.x[a]) / area;
+            b0[v]        = -(bx[v] * tri.x[a] + by[v] * tri.y[a]);
+        }
+
+        const auto start_x = min_x & ~3; // tiles and rows are multiples of 4 wide, groups never leave the tile
+
+#if defined(__SSE2__) || defined(_M_X64)
+        const auto lane_x = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const auto zero   = _mm_setzero_ps();
+
+        __m128 edge_x[3], depth[3];
+        for (int v = 0; v < 3; v++) {
+            edge_x[v] = _mm_set1_ps(bx[v]);
+            depth[v]  = _mm_set1_ps(tri.z[v]);
+        }
+
+        for (int y = min_y; y <= max_y; y++) {
+            const auto py        = float(y) + 0.5f;
+            auto       depth_row = &this->depth_buffer[size_t(y) * this->w];
+            auto       color_row = &this->color_buffer[size_t(y) * this->w];
+
+            __m128 edge_row[3];
+            for (int v = 0; v < 3; v++) {
+                edge_row[v] = _mm_set1_ps(by[v] * py + b0[v]);
+            }
+
+            for (int x = start_x; x <= max_x; x += 4) {
+                const auto px = _mm_add_ps(_mm_set1_ps(float(x)), lane_x);
+
+                __m128 b[3];
+                for (int v = 0; v < 3; v++) {
+                    b[v] = _mm_add_ps(_mm_mul_ps(edge_x[v], px), edge_row[v]);
+                }
+                const auto inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(b[0], zero), _mm_cmpge_ps(b[1], zero)), _mm_cmpge_ps(b[2], zero));
+                if (!_mm_movemask_ps(inside))
+                    continue;
+
+                const auto z    = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b[0], depth[0]), _mm_mul_ps(b[1], depth[1])), _mm_mul_ps(b[2], depth[2]));
+                const auto old  = _mm_loadu_ps(depth_row + x);
+                const auto pass = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+                const auto mask = _mm_movemask_ps(pass);
+                if (!mask)
+                    continue;
+                _mm_storeu_ps(depth_row + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+
+                float lanes[3][4];
+                for (int v = 0; v < 3; v++) {
+                    _mm_storeu_ps(lanes[v], b[v]);
+                }
+                for (int lane = 0; lane < 4; lane++) {
+                    if (mask & (1 << lane)) {
+                        const float bary[3]  = {lanes[0][lane], lanes[1][lane], lanes[2][lane]};
+                        color_row[x + lane] = shade(tri, bary, view);
+                    }
+                }
+            }
+        }
+#else
+        for (int y = min_y; y <= max_y; y++) {
+            const auto py        = float(y) + 0.5f;
+            auto       depth_row = &this->depth_buffer[size_t(y) * this->w];
+            auto       color_row = &this->color_buffer[size_t(y) * this->w];
+            for (int x = start_x; x <= max_x; x++) {
+                const auto px      = float(x) + 0.5f;
+                const float bary[3] = {bx[0] * px + by[0] * py + b0[0], bx[1] * px + by[1] * py + b0[1], bx[2] * px + by[2] * py + b0[2]};
+                if (bary[0] < 0.f || bary[1] < 0.f || bary[2] < 0.f)
+                    continue;
+
+                const auto z = bary[0] * tri.z[0] + bary[1] * tri.z[1] + bary[2] * tri.z[2];
+                if (!(z < depth_row[x]))
+                    continue;
+                depth_row[x] = z;
+                color_row[x] = shade(tri, bary, view);
+            }
+        }
+#endif
+    }
+}
+
+bool SoftwareRasterizer::write_ppm(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+        return false;
+
+    out << "P6\n" << this->w << ' ' << this->h << "\n255\n";
+    std::vector<uint8_t> row(size_t(this->w) * 3);
+    for (auto y = this->h; y-- > 0;) {
+        for (uint32_t x = 0; x < this->w; x++) {
+            const auto color = this->color_buffer[size_t(y) * this->w + x];
+            row[x * 3 + 0]   = uint8_t(color);
+            row[x * 3 + 1]   = uint8_t(color >> 8);
+            row[x * 3 + 2]   = uint8_t(color >> 16);
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    return bool(out);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "jobs.hh"
+#include "map.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// CPU renderer for previews and screenshots on machines without a GPU. Draws the same vertices, indices and
+// dec_t ranges the GL path does: triangles get set up and binned into screen tiles in chunks over the pool,
+// then every tile gets rasterized on its own with SIMD edge functions and a depth test.
+
+constexpr uint32_t RASTER_TILE = 64; // pixels, square, multiple of 4
+// Triangles a setup job takes
+constexpr size_t RASTER_CHUNK = 4096;
+// Triangles only get clipped to the sides once they reach this many screens out, the edge functions stay precise enough
+constexpr float RASTER_GUARD_BAND = 4.f;
+// glClearColor of the GL path, RGBA8
+constexpr uint32_t RASTER_CLEAR_COLOR = 0xFFFFFF00;
+
+// diffuseLoaded of FRAGMENT_SHADER, there are no textures on this side
+enum class RASTER_SHADING : int {
+    FLAT   = 0,
+    NORMAL = 2,
+};
+
+struct raster_view_t {
+    float          clip[16]; // proj * view, column major like glm and GL, with -w <= z <= w
+    float          camera[3]; // the light is at the camera like in the shader
+    RASTER_SHADING shading = RASTER_SHADING::FLAT;
+    uint32_t       lod     = 0; // see mesh_lod_dec
+    // per mesh like cull_frustum gives it, everything gets drawn if null
+    const uint8_t* visible = nullptr;
+};
+
+struct raster_stats_t {
+    size_t triangles = 0; // drawn ones
+    size_t setup     = 0; // after clipping and dropping the ones with no pixels
+    size_t refs      = 0; // triangles in tiles, a triangle is in every tile its box touches
+
+    double setup_ms  = 0.0;
+    double bin_ms    = 0.0;
+    double raster_ms = 0.0;
+    double total_ms  = 0.0;
+};
+
+class SoftwareRasterizer {
+public:
+    // width gets rounded up to a multiple of 4
+    SoftwareRasterizer(uint32_t width, uint32_t height);
+
+    void render(const stk_map_t& map, const raster_view_t& view, JobPool& jobs, raster_stats_t* stats = nullptr);
+
+    uint32_t width() const { return this->w; }
+    uint32_t height() const { return this->h; }
+    // RGBA8, bottom row first like glReadPixels
+    const std::vector<uint32_t>& color() const { return this->color_buffer; }
+    const std::vector<float>&    depth() const { return this->depth_buffer; }
+
+    bool write_ppm(const std::string& path) const;
+
+    // Screen space triangle, attributes are divided by w so they interpolate linearly
+    struct triangle_t {
+        float x[3], y[3];
+        float z[3]; // 0 to 1
+        float inv_w[3];
+        float attrs[3][6]; // normal then map position
+    };
+
+    // Triangle of a setup chunk
+    struct ref_t {
+        uint32_t chunk;
+        uint32_t triangle;
+    };
+
+private:
+    void raster_tile(uint32_t tile, const raster_view_t& view);
+
+    uint32_t w, h;
+    uint32_t tiles_x, tiles_y;
+
+    std::vector<uint32_t> color_buffer;
+    std::vector<float>    depth_buffer;
+
+    // reused between frames
+    std::vector<std::vector<triangle_t>> chunk_triangles;
+    std::vector<uint32_t>                chunk_tile_counts; // chunks * tiles, then the offsets into refs
+    std::vector<uint32_t>                tile_offsets; // tiles + 1
+    std::vector<ref_t>                   refs; // grouped by tile, in draw order within one
+};
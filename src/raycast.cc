@@ -0,0 +1,226 @@
+#include "raycast.hh"
+
+#include "map.hh"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Traversal stack that lives on the stack, deeper BVHs get one on the heap
+constexpr size_t RAYCAST_STACK = 64;
+// Rays per job when casting a batch
+constexpr size_t RAYCAST_CHUNK = 256;
+// Parallel rays/triangles
+constexpr float RAYCAST_EPSILON = 1e-9f;
+
+RayCaster::RayCaster(const bvh_t& bvh, JobPool& jobs) : bvh(bvh) {
+    const auto count = bvh.triangles.size();
+    for (auto& values : this->soa) {
+        values.assign(count + 3, 0.f);
+    }
+
+    jobs.parallel_for(count, 64 * 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const auto& v = bvh.triangles[i].v;
+            for (int axis = 0; axis < 3; axis++) {
+                this->soa[V0X + axis][i] = v[0].coords[axis];
+                this->soa[E1X + axis][i] = v[1].coords[axis] - v[0].coords[axis];
+                this->soa[E2X + axis][i] = v[2].coords[axis] - v[0].coords[axis];
+            }
+        }
+    });
+}
+
+// Slab test, entry distance or infinity on a miss
+static float ray_box(const bvh_node_t& node, const float origin[3], const float inv_dir[3], float max_t) {
+    float enter = 0.f, leave = max_t;
+    for (int axis = 0; axis < 3; axis++) {
+        auto t0 = (node.mins[axis] - origin[axis]) * inv_dir[axis];
+        auto t1 = (node.maxs[axis] - origin[axis]) * inv_dir[axis];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        enter = std::max(enter, t0);
+        leave = std::min(leave, t1);
+    }
+    return enter <= leave ? enter : std::numeric_limits<float>::infinity();
+}
+
+bool RayCaster::cast(const ray_t& ray, ray_hit_t* res, const stk_map_t* map) const {
+    *res = {};
+    if (this->bvh.empty())
+        return false;
+
+    const float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float dir[3]    = {ray.dir.x, ray.dir.y, ray.dir.z};
+    float       inv_dir[3];
+    for (int axis = 0; axis < 3; axis++) {
+        // infinity is fine here, the slab test still does the right thing with it
+        inv_dir[axis] = 1.f / dir[axis];
+    }
+
+    auto     best_t   = ray.max_t;
+    uint32_t best_tri = ~uint32_t(0);
+    float    best_u = 0.f, best_v = 0.f;
+
+#if defined(__SSE2__) || defined(_M_X64)
+    const auto ox = _mm_set1_ps(origin[0]), oy = _mm_set1_ps(origin[1]), oz = _mm_set1_ps(origin[2]);
+    const auto dx = _mm_set1_ps(dir[0]), dy = _mm_set1_ps(dir[1]), dz = _mm_set1_ps(dir[2]);
+    const auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), eps = _mm_set1_ps(RAYCAST_EPSILON);
+    const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const auto lanes    = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+#endif
+
+    // nodes with where the ray enters them, anything entered past the best hit so far gets skipped
+    struct entry_t {
+        uint32_t node;
+        float    enter;
+    };
+    // popping a node at depth d leaves at most one sibling per level above it, plus its two children
+    entry_t              local_stack[RAYCAST_STACK];
+    std::vector<entry_t> heap_stack;
+    auto                 stack      = local_stack;
+    size_t               stack_size = 0;
+    if (this->bvh.depth + 2 > RAYCAST_STACK) {
+        heap_stack.resize(this->bvh.depth + 2);
+        stack = heap_stack.data();
+    }
+
+    // meshes that aren't drawn can't be hit
+    auto drawn = [&](uint32_t triangle) {
+        const auto& ref = this->bvh.refs[triangle];
+        return !map || map->models[ref.model].meshes[ref.mesh].draw;
+    };
+
+    const auto root_near = ray_box(this->bvh.nodes[0], origin, inv_dir, best_t);
+    if (root_near != std::numeric_limits<float>::infinity())
+        stack[stack_size++] = {0, root_near};
+
+    while (stack_size) {
+        const auto entry = stack[--stack_size];
+        if (entry.enter > best_t)
+            continue;
+
+        const auto& node = this->bvh.nodes[entry.node];
+        if (!node.leaf()) {
+            const auto near_left  = ray_box(this->bvh.nodes[node.first], origin, inv_dir, best_t);
+            const auto near_right = ray_box(this->bvh.nodes[node.first + 1], origin, inv_dir, best_t);
+
+            // nearer child on top so it gets done first and shrinks best_t for the other one
+            const entry_t left = {node.first, near_left}, right = {node.first + 1, near_right};
+            const auto    second = near_left <= near_right ? right : left;
+            const auto    first  = near_left <= near_right ? left : right;
+            if (second.enter != std::numeric_limits<float>::infinity())
+                stack[stack_size++] = second;
+            if (first.enter != std::numeric_limits<float>::infinity())
+                stack[stack_size++] = first;
+            continue;
+        }
+
+        for (uint32_t first = node.first; first < node.first + node.count; first += 4) {
+#if defined(__SSE2__) || defined(_M_X64)
+            // Moller-Trumbore on 4 triangles at once
+            const auto e1x = _mm_loadu_ps(&this->soa[E1X][first]), e1y = _mm_loadu_ps(&this->soa[E1Y][first]), e1z = _mm_loadu_ps(&this->soa[E1Z][first]);
+            const auto e2x = _mm_loadu_ps(&this->soa[E2X][first]), e2y = _mm_loadu_ps(&this->soa[E2Y][first]), e2z = _mm_loadu_ps(&this->soa[E2Z][first]);
+
+            // p = dir x e2
+            const auto px  = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            const auto py  = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            const auto pz  = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            const auto det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+            const auto inv = _mm_div_ps(one, det);
+
+            const auto tx = _mm_sub_ps(ox, _mm_loadu_ps(&this->soa[V0X][first]));
+            const auto ty = _mm_sub_ps(oy, _mm_loadu_ps(&this->soa[V0Y][first]));
+            const auto tz = _mm_sub_ps(oz, _mm_loadu_ps(&this->soa[V0Z][first]));
+            const auto u  = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv);
+
+            // q = t x e1
+            const auto qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+            const auto qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+            const auto qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+            const auto v  = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+            const auto t  = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+            auto mask = _mm_cmpgt_ps(_mm_and_ps(det, abs_mask), eps);
+            mask      = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+            mask      = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+            mask      = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            mask      = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+            mask      = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(best_t)));
+            // lanes past the end of the leaf are the next leaf's triangles (or padding)
+            mask = _mm_and_ps(mask, _mm_cmplt_ps(lanes, _mm_set1_ps(float(node.first + node.count - first))));
+
+            auto bits = _mm_movemask_ps(mask);
+            if (!bits)
+                continue;
+
+            alignas(16) float ts[4], us[4], vs[4];
+            _mm_store_ps(ts, t);
+            _mm_store_ps(us, u);
+            _mm_store_ps(vs, v);
+            for (int lane = 0; lane < 4; lane++) {
+                if ((bits & (1 << lane)) && ts[lane] < best_t && drawn(first + lane)) {
+                    best_t   = ts[lane];
+                    best_tri = first + lane;
+                    best_u   = us[lane];
+                    best_v   = vs[lane];
+                }
+            }
+#else
+            const auto end = std::min(first + 4, node.first + node.count);
+            for (uint32_t i = first; i < end; i++) {
+                const float e1[3] = {this->soa[E1X][i], this->soa[E1Y][i], this->soa[E1Z][i]};
+                const float e2[3] = {this->soa[E2X][i], this->soa[E2Y][i], this->soa[E2Z][i]};
+
+                const float p[3] = {dir[1] * e2[2] - dir[2] * e2[1], dir[2] * e2[0] - dir[0] * e2[2], dir[0] * e2[1] - dir[1] * e2[0]};
+                const auto  det  = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+                if (std::abs(det) <= RAYCAST_EPSILON)
+                    continue;
+                const auto inv = 1.f / det;
+
+                const float tv[3] = {origin[0] - this->soa[V0X][i], origin[1] - this->soa[V0Y][i], origin[2] - this->soa[V0Z][i]};
+                const auto  u     = (tv[0] * p[0] + tv[1] * p[1] + tv[2] * p[2]) * inv;
+                if (u < 0.f || u > 1.f)
+                    continue;
+
+                const float q[3] = {tv[1] * e1[2] - tv[2] * e1[1], tv[2] * e1[0] - tv[0] * e1[2], tv[0] * e1[1] - tv[1] * e1[0]};
+                const auto  v    = (dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2]) * inv;
+                const auto  t    = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+                if (v < 0.f || u + v > 1.f || t < 0.f || t >= best_t || !drawn(i))
+                    continue;
+
+                best_t   = t;
+                best_tri = i;
+                best_u   = u;
+                best_v   = v;
+            }
+#endif
+        }
+    }
+
+    if (best_tri == ~uint32_t(0))
+        return false;
+
+    const auto& ref = this->bvh.refs[best_tri];
+    res->t          = best_t;
+    res->model      = ref.model;
+    res->mesh       = ref.mesh;
+    res->triangle   = ref.triangle;
+    res->u          = best_u;
+    res->v          = best_v;
+    for (int axis = 0; axis < 3; axis++) {
+        res->point.coords[axis] = origin[axis] + dir[axis] * best_t;
+    }
+    return true;
+}
+
+void RayCaster::cast(const ray_t* rays, size_t count, ray_hit_t* res, JobPool& jobs, const stk_map_t* map) const {
+    jobs.parallel_for(count, RAYCAST_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            this->cast(rays[i], &res[i], map);
+        }
+    });
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "bsp.hh"
+#include "bvh.hh"
+#include "jobs.hh"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+struct ray_t {
+    vertex_t origin;
+    vertex_t dir; // doesn't have to be normalized, t is in multiples of it
+    float    max_t = std::numeric_limits<float>::max();
+};
+
+struct ray_hit_t {
+    float    t = std::numeric_limits<float>::max();
+    uint32_t model    = 0;
+    uint32_t mesh     = 0; // in the model
+    uint32_t triangle = 0; // in the mesh
+    float    u = 0.f, v = 0.f; // barycentrics of v1 and v2
+    vertex_t point = {};
+
+    bool hit() const { return this->t != std::numeric_limits<float>::max(); }
+};
+
+// Ray queries over the BVH of a map. Keeps the BVH triangles as SoA edges so a leaf's triangles
+// get tested 4 at a time, the BVH has to outlive it and not change.
+class RayCaster {
+public:
+    RayCaster(const bvh_t& bvh, JobPool& jobs);
+
+    RayCaster(const RayCaster&) = delete;
+    RayCaster& operator=(const RayCaster&) = delete;
+
+    // Closest hit, both sides of a triangle count.
+    // map - the one the BVH was built from, meshes it doesn't draw get skipped. Everything counts if null.
+    bool cast(const ray_t& ray, ray_hit_t* res, const stk_map_t* map = nullptr) const;
+    // Lots of them over the pool, res has count elements
+    void cast(const ray_t* rays, size_t count, ray_hit_t* res, JobPool& jobs, const stk_map_t* map = nullptr) const;
+
+private:
+    enum { V0X, V0Y, V0Z, E1X, E1Y, E1Z, E2X, E2Y, E2Z, COUNT };
+
+    const bvh_t&       bvh;
+    std::vector<float> soa[COUNT]; // per BVH triangle, padded so a leaf can always load 4
+};
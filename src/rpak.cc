@@ -1,17 +1,26 @@
 #include "rpak.hh"
 
+#include "decomp.hh"
+
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
 
-struct data_chunks_t {
-    uint32_t section_id;
-    uint32_t align_byte;
-    uint32_t size;
-};
-static_assert(sizeof(data_chunks_t) == 12);
+rpak_layout_t rpak_parse_layout(uint8_t* deta) {
+    rpak_layout_t layout;
 
-RPak::RPak(uint8_t* deta) {
     rpak_header_t* header = reinterpret_cast<rpak_header_t*>(deta);
     auto           data   = deta + 0x80;
+    layout.header         = header;
+
+    // patch paks have their own little header + sizes of every patch + patch numbers before everything else
+    if (header->patches_num) {
+        auto patch_numbers   = reinterpret_cast<uint16_t*>(data + sizeof(rpak_patch_header_t) + (sizeof(rpak_patch_size_t) * header->patches_num));
+        layout.patch_numbers = patch_numbers;
+
+        data = reinterpret_cast<uint8_t*>(patch_numbers + header->patches_num);
+    }
 
     // if (header->unk74 != 0) {
     //     this->succ = false;
@@ -24,16 +33,17 @@ RPak::RPak(uint8_t* deta) {
     auto sections        = starpak_skipped; // TODO: cast
 
     auto sections_skipped = starpak_skipped + (16ull * header->sections_num);
-    auto data_chunks      = reinterpret_cast<data_chunks_t*>(sections_skipped); // TODO: cast
+    layout.data_chunks    = reinterpret_cast<data_chunks_t*>(sections_skipped);
 
     auto data_chunks_skipped = sections_skipped + (12ull * header->data_chunks_num);
-    auto descriptors         = reinterpret_cast<descriptor_t*>(data_chunks_skipped); // TODO: cast
+    layout.descriptors       = reinterpret_cast<descriptor_t*>(data_chunks_skipped);
 
     auto unk54_skipped = data_chunks_skipped + (8ull * header->unk54);
-    // parsing of files is moved for pointer conversion...
+    layout.files       = reinterpret_cast<rfile_t*>(unk54_skipped);
 
     auto file_entries_skipped = unk54_skipped + (0x50ull * header->num_files);
     // unk5c (8)
+    layout.guid_descriptors = reinterpret_cast<descriptor_t*>(file_entries_skipped);
 
     auto unk5c_skipped = file_entries_skipped + (8ull * header->relationship);
 
@@ -48,10 +58,26 @@ RPak::RPak(uint8_t* deta) {
     auto unk70_skipped = unk6c_skipped + (24ull * header->unk70);
 
     // pages start here
-    std::vector<uint8_t*> pages(header->data_chunks_num);
-    pages[0] = unk70_skipped;
-    for (size_t i = 1; i < pages.size(); i++) {
-        pages[i] = pages[i - 1] + data_chunks[i - 1].size;
+    layout.pages.resize(header->data_chunks_num);
+    if (layout.pages.size())
+        layout.pages[0] = unk70_skipped;
+    for (size_t i = 1; i < layout.pages.size(); i++) {
+        layout.pages[i] = layout.pages[i - 1] + layout.data_chunks[i - 1].size;
+    }
+
+    return layout;
+}
+
+RPak::RPak(uint8_t* deta) {
+    this->layout = rpak_parse_layout(deta);
+
+    const auto  header      = this->layout.header;
+    const auto& pages       = this->layout.pages;
+    const auto  descriptors = this->layout.descriptors;
+
+    this->patches_num = header->patches_num;
+    if (header->patches_num) {
+        this->patch_numbers.assign(this->layout.patch_numbers, this->layout.patch_numbers + header->patches_num);
     }
 
     // pointer parsing...
@@ -62,7 +88,7 @@ RPak::RPak(uint8_t* deta) {
         desc->ptr = pages[desc->desc.page] + desc->desc.offset;
     }
 
-    auto files = reinterpret_cast<rfile_t*>(unk54_skipped);
+    auto files = this->layout.files;
     // this looks janky af
     for (size_t i = 0; i < header->num_files; i++) {
         auto& file           = files[i];
@@ -80,6 +106,65 @@ RPak::RPak(uint8_t* deta) {
             this->materials[name] = d;
 
             // std::cout << name << std::endl;
+        } else if (file.ext == RPAK_MDL) {
+            auto d = reinterpret_cast<mdl_t*>(file.description.ptr);
+            if (d->name)
+                this->models[std::string(d->name)] = d;
         }
     }
-}
\ No newline at end of file
+}
+
+void RPak::mount(RPak* patch) {
+    // newer file wins, that's all there is to it
+    for (const auto& file : patch->files) {
+        this->files[file.first] = file.second;
+    }
+    for (const auto& material : patch->materials) {
+        this->materials[material.first] = material.second;
+    }
+    for (const auto& model : patch->models) {
+        this->models[model.first] = model.second;
+    }
+
+    this->patches.push_back(patch);
+}
+
+bool rpak_decompress(const char* name, std::vector<uint8_t>* res_data) {
+    std::ifstream f(name, std::ifstream::binary);
+    if (f.fail())
+        return false;
+
+    rpak_header_t header;
+    f.read((char*)&header, sizeof(header));
+    std::vector<uint8_t> fd(header.size_disk);
+    f.read((char*)fd.data() + RPAK_HEADER_SIZE, fd.size() - RPAK_HEADER_SIZE);
+    memcpy(fd.data(), &header, sizeof(header));
+
+    // repacked paks are stored as is
+    if (header.size_disk == header.size_decompressed) {
+        *res_data = std::move(fd);
+        return true;
+    }
+
+    uint64_t parameters[18];
+
+    auto dsize = get_decompressed_size(uint64_t(parameters), fd.data(), int64_t(-1), fd.size(), 0, RPAK_HEADER_SIZE);
+    if (dsize < 0 || uint64_t(dsize) != header.size_decompressed) {
+        std::cerr << "Failed to load: " << name << ", DSIZE MISSMATCH!" << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> decompress_buffer(header.size_decompressed);
+    parameters[1] = uint64_t(decompress_buffer.data());
+    parameters[3] = -1;
+    auto dret     = decompress_rpak((__int64*)parameters, fd.size(), decompress_buffer.size());
+    if (dret != 1) {
+        std::cerr << "Failed to load: " << name << ", DRet was " << (+dret) << "!" << std::endl;
+        return false;
+    }
+
+    memcpy(decompress_buffer.data(), &header, sizeof(header));
+    *res_data = std::move(decompress_buffer);
+
+    return true;
+}
@@ -1,4 +1,7 @@
+#pragma once
+
 #include <cstdint>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -8,6 +11,7 @@ constexpr size_t   RPAK_HEADER_SIZE = 0x80;
 
 constexpr uint32_t RPAK_TXTR = 'rtxt';
 constexpr uint32_t RPAK_MATL = 'ltam';
+constexpr uint32_t RPAK_MDL  = '_ldm';
 
 struct descriptor_t {
     uint32_t page;
@@ -100,6 +104,31 @@ struct matl_t {
     uint64_t* guids_end;
 };
 
+struct mdl_t {
+    uint8_t*    data; // studio_hdr_t
+    const char* name; // mdl/....rmdl, same as the BSP has them
+};
+
+constexpr uint32_t STUDIO_MAGIC = 'TSDI';
+
+// Only the bit of the header that's been the same since Source
+struct studio_hdr_t {
+    uint32_t id; // STUDIO_MAGIC
+    uint32_t version;
+    uint32_t checksum;
+    uint32_t name_index;
+    char     name[64];
+    uint32_t length;
+
+    float eye_position[3];
+    float illum_position[3];
+    float hull_min[3];
+    float hull_max[3];
+    float view_min[3];
+    float view_max[3];
+};
+static_assert(sizeof(studio_hdr_t) == 0x9C);
+
 #pragma pack(push, 1)
 struct txtr_t {
     uint64_t guid;
@@ -132,12 +161,63 @@ struct txtr_t {
 //     void*   data;
 // };
 
+// Comes right after the header when patches_num != 0
+struct rpak_patch_header_t {
+    uint32_t edit_stream_size;
+    uint32_t page_count;
+};
+static_assert(sizeof(rpak_patch_header_t) == 8);
+
+struct rpak_patch_size_t {
+    uint64_t size_disk;
+    uint64_t size_decompressed;
+};
+static_assert(sizeof(rpak_patch_size_t) == 16);
+
+struct data_chunks_t {
+    uint32_t section_id;
+    uint32_t align_byte;
+    uint32_t size;
+};
+static_assert(sizeof(data_chunks_t) == 12);
+
+// Where everything lives inside of a decompressed pak, parsing it doesn't touch the data
+struct rpak_layout_t {
+    rpak_header_t* header        = nullptr;
+    uint16_t*      patch_numbers = nullptr;
+
+    data_chunks_t* data_chunks      = nullptr; // [data_chunks_num]
+    descriptor_t*  descriptors      = nullptr; // [unk54], pointers inside of pages
+    rfile_t*       files            = nullptr; // [num_files]
+    descriptor_t*  guid_descriptors = nullptr; // [relationship]
+
+    std::vector<uint8_t*> pages; // [data_chunks_num], pages[0] is where the header ends
+};
+
+rpak_layout_t rpak_parse_layout(uint8_t* deta);
+
+// Reads and decompresses the whole pak into res_data, header included
+bool rpak_decompress(const char* name, std::vector<uint8_t>* res_data);
+
 class RPak {
 public:
     // decompressed data...
     RPak(uint8_t* deta);
 
+    // Overlays a patch pak, i.e. common(01).rpak over common.rpak.
+    // Only the patch's own files get (re)indexed, base entries that weren't replaced stay as is,
+    // so files/materials keep being a single lookup no matter how many patches are mounted.
+    // Patch (and its data) must outlive us.
+    void mount(RPak* patch);
+
+    uint16_t              patches_num = 0; // non-zero for patch paks
+    std::vector<uint16_t> patch_numbers; // which versions this patch applies on top of
+    std::vector<RPak*>    patches; // mounted overlays, oldest first
+
+    rpak_layout_t layout;
+
     std::unordered_map<uint64_t, rfile_t>    files;
     std::unordered_map<std::string, matl_t*> materials; // since I'm narrow minded...
+    std::unordered_map<std::string, mdl_t*>  models;
     // std::unordered_map<uint64_t, texture_t> textures;
 };
\ No newline at end of file
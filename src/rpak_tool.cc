@@ -0,0 +1,264 @@
+#include "rpak_tool.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+constexpr uint32_t NO_PAGE = std::numeric_limits<uint32_t>::max();
+
+// matl_t::guids/guids_end, still in descriptor form since nobody patched them
+constexpr size_t MATL_TEXTURES_OFFSET     = 0x60;
+constexpr size_t MATL_TEXTURES_END_OFFSET = 0x68;
+
+struct material_pages_t {
+    descriptor_t                desc;
+    descriptor_t                textures;
+    std::vector<const rfile_t*> texture_files;
+};
+
+static uint8_t* resolve(const rpak_layout_t& layout, const descriptor_t& desc) {
+    return layout.pages[desc.page] + desc.offset;
+}
+
+// desc is a page of the pak and size bytes from it are still inside of that page
+static bool in_page(const rpak_layout_t& layout, const descriptor_t& desc, size_t size) {
+    return desc.page < layout.pages.size() && size_t(desc.offset) + size <= layout.data_chunks[desc.page].size;
+}
+
+static std::vector<material_pages_t> collect_materials(const rpak_layout_t& layout) {
+    const auto header = layout.header;
+
+    std::unordered_map<uint64_t, const rfile_t*> by_guid;
+    by_guid.reserve(header->num_files);
+    for (size_t i = 0; i < header->num_files; i++) {
+        by_guid[layout.files[i].guid] = &layout.files[i];
+    }
+
+    std::vector<material_pages_t> ret;
+    for (size_t i = 0; i < header->num_files; i++) {
+        const auto& file = layout.files[i];
+        if (file.ext != RPAK_MATL)
+            continue;
+
+        material_pages_t mat;
+        mat.desc = file.description.desc;
+        if (!in_page(layout, mat.desc, MATL_TEXTURES_END_OFFSET + sizeof(descriptor_t)))
+            continue;
+
+        auto       matl         = resolve(layout, mat.desc);
+        const auto textures     = *reinterpret_cast<descriptor_t*>(matl + MATL_TEXTURES_OFFSET);
+        const auto textures_end = *reinterpret_cast<descriptor_t*>(matl + MATL_TEXTURES_END_OFFSET);
+        mat.textures            = textures;
+
+        if (in_page(layout, textures, 0)) {
+            // both arrays sit next to each other so the difference is the count
+            size_t count = 0;
+            if (textures_end.page == textures.page && textures_end.offset > textures.offset)
+                count = (textures_end.offset - textures.offset) / sizeof(uint64_t);
+            if (!in_page(layout, textures, count * sizeof(uint64_t)))
+                count = 0;
+
+            auto guids = reinterpret_cast<uint64_t*>(resolve(layout, textures));
+            for (size_t t = 0; t < count; t++) {
+                auto elem = by_guid.find(guids[t]);
+                if (guids[t] && elem != by_guid.end())
+                    mat.texture_files.push_back(elem->second);
+            }
+        } else {
+            mat.textures.page = NO_PAGE;
+        }
+
+        ret.push_back(std::move(mat));
+    }
+
+    return ret;
+}
+
+void rpak_analyze(uint8_t* deta, std::ostream& out) {
+    const auto layout = rpak_parse_layout(deta);
+    const auto header = layout.header;
+
+    out << "Pages: " << header->data_chunks_num << " Files: " << header->num_files << " Decompressed: " << header->size_decompressed << " Disk: " << header->size_disk << std::endl;
+
+    // --- pages
+    size_t total_size    = 0;
+    size_t total_padding = 0;
+    for (size_t i = 0; i < header->data_chunks_num; i++) {
+        const auto& chunk   = layout.data_chunks[i];
+        const auto  padding = chunk.align_byte ? (chunk.align_byte - (chunk.size % chunk.align_byte)) % chunk.align_byte : 0;
+        total_size += chunk.size;
+        total_padding += padding;
+
+        out << "page " << i << ": section " << chunk.section_id << " align " << chunk.align_byte << " size " << chunk.size << " padding " << padding << std::endl;
+    }
+    out << "Total page size: " << total_size << " alignment padding: " << total_padding;
+    if (total_size)
+        out << " (" << (100.0 * total_padding / total_size) << "%)";
+    out << std::endl;
+
+    // --- materials
+    const auto materials = collect_materials(layout);
+
+    size_t total_span  = 0;
+    size_t max_span    = 0;
+    size_t scattered   = 0; // more than 2 pages away from each other
+    size_t spans_count = 0;
+    for (const auto& mat : materials) {
+        auto name = *reinterpret_cast<descriptor_t*>(resolve(layout, mat.desc) + offsetof(matl_t, name));
+
+        std::vector<std::pair<uint32_t, uint8_t*>> touched; // page, where
+        touched.push_back({mat.desc.page, resolve(layout, mat.desc)});
+        if (mat.textures.page != NO_PAGE)
+            touched.push_back({mat.textures.page, resolve(layout, mat.textures)});
+        for (const auto texture : mat.texture_files) {
+            if (in_page(layout, texture->description.desc, 0))
+                touched.push_back({texture->description.desc.page, resolve(layout, texture->description.desc)});
+            if (in_page(layout, texture->data.desc, 0))
+                touched.push_back({texture->data.desc.page, resolve(layout, texture->data.desc)});
+        }
+
+        auto [min_page, max_page] = std::minmax_element(touched.begin(), touched.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        auto [min_ptr, max_ptr]   = std::minmax_element(touched.begin(), touched.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+
+        const size_t page_span = max_page->first - min_page->first;
+        const size_t byte_span = max_ptr->second - min_ptr->second;
+
+        total_span += page_span;
+        max_span = std::max(max_span, page_span);
+        if (page_span > 2)
+            scattered++;
+        spans_count++;
+
+        out << "material ";
+        if (in_page(layout, name, 1))
+            out << reinterpret_cast<const char*>(resolve(layout, name));
+        else
+            out << "???";
+        out << ": textures " << mat.texture_files.size() << " pages " << min_page->first << "-" << max_page->first << " span " << page_span << " pages/" << byte_span << " bytes" << std::endl;
+    }
+    if (spans_count) {
+        out << "Materials: " << spans_count << " avg span " << (double(total_span) / spans_count) << " pages, max " << max_span << ", scattered " << scattered << std::endl;
+    }
+}
+
+bool rpak_repack(uint8_t* deta, std::vector<uint8_t>* res_data) {
+    const auto layout = rpak_parse_layout(deta);
+    const auto header = layout.header;
+
+    if (header->patches_num) {
+        // edit streams reference base pages by index, can't move those around
+        return false;
+    }
+    if (!layout.pages.size()) {
+        return false;
+    }
+
+    // --- everything that gets copied, followed or renumbered has to be inside of the pak
+    const size_t tables_size = layout.pages[0] - deta;
+    size_t       pages_size  = 0;
+    for (size_t i = 0; i < header->data_chunks_num; i++) {
+        pages_size += layout.data_chunks[i].size;
+    }
+    if (tables_size + pages_size > header->size_decompressed) {
+        std::cerr << "Pages of the pak end past its size" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < header->unk54; i++) {
+        const auto& d = layout.descriptors[i];
+        if (!in_page(layout, d, sizeof(descriptor_t)) || !in_page(layout, *reinterpret_cast<const descriptor_t*>(resolve(layout, d)), 0)) {
+            std::cerr << "Descriptor " << i << " points outside of the pages" << std::endl;
+            return false;
+        }
+    }
+    for (size_t i = 0; i < header->num_files; i++) {
+        const auto& file = layout.files[i];
+        if (!in_page(layout, file.description.desc, 0) || (file.data.desc.page != NO_PAGE && !in_page(layout, file.data.desc, 0))) {
+            std::cerr << "File " << i << " points outside of the pages" << std::endl;
+            return false;
+        }
+    }
+    for (size_t i = 0; i < header->relationship; i++) {
+        if (!in_page(layout, layout.guid_descriptors[i], sizeof(uint64_t))) {
+            std::cerr << "Guid descriptor " << i << " points outside of the pages" << std::endl;
+            return false;
+        }
+    }
+
+    // --- new order: every material with its textures, then everything else in file order, then leftovers
+    const auto            num_pages = layout.pages.size();
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> new_index(num_pages, NO_PAGE);
+    order.reserve(num_pages);
+
+    auto place = [&](uint32_t page) {
+        if (page < num_pages && new_index[page] == NO_PAGE) {
+            new_index[page] = uint32_t(order.size());
+            order.push_back(page);
+        }
+    };
+
+    for (const auto& mat : collect_materials(layout)) {
+        place(mat.desc.page);
+        place(mat.textures.page);
+        for (const auto texture : mat.texture_files) {
+            place(texture->description.desc.page);
+            place(texture->data.desc.page);
+        }
+    }
+    for (size_t i = 0; i < header->num_files; i++) {
+        place(layout.files[i].description.desc.page);
+        place(layout.files[i].data.desc.page);
+    }
+    for (uint32_t i = 0; i < num_pages; i++) {
+        place(i);
+    }
+
+    // --- header and tables stay where they are, pages get shuffled
+    std::vector<uint8_t> out(header->size_decompressed);
+    memcpy(out.data(), deta, tables_size);
+
+    auto out_layout = rpak_parse_layout(out.data());
+    auto out_ptr    = out.data() + tables_size;
+    for (size_t i = 0; i < num_pages; i++) {
+        const auto  old   = order[i];
+        const auto& chunk = layout.data_chunks[old];
+
+        out_layout.data_chunks[i] = chunk;
+        out_layout.pages[i]       = out_ptr;
+        memcpy(out_ptr, layout.pages[old], chunk.size);
+        out_ptr += chunk.size;
+    }
+
+    // --- page indices everywhere
+    for (size_t i = 0; i < header->unk54; i++) {
+        auto& d = out_layout.descriptors[i];
+        d.page  = new_index[d.page];
+
+        auto pointee  = reinterpret_cast<descriptor_t*>(out_layout.pages[d.page] + d.offset);
+        pointee->page = new_index[pointee->page];
+    }
+    // engine walks them in page order
+    std::sort(out_layout.descriptors, out_layout.descriptors + header->unk54, [](const descriptor_t& a, const descriptor_t& b) {
+        return a.page != b.page ? a.page < b.page : a.offset < b.offset;
+    });
+
+    for (size_t i = 0; i < header->num_files; i++) {
+        auto& file                 = out_layout.files[i];
+        file.description.desc.page = new_index[file.description.desc.page];
+        if (file.data.desc.page != NO_PAGE)
+            file.data.desc.page = new_index[file.data.desc.page];
+    }
+
+    for (size_t i = 0; i < header->relationship; i++) {
+        auto& d = out_layout.guid_descriptors[i];
+        d.page  = new_index[d.page];
+    }
+
+    out_layout.header->size_disk = out.size();
+
+    *res_data = std::move(out);
+    return true;
+}
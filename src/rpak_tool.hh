@@ -0,0 +1,15 @@
+#pragma once
+
+#include "rpak.hh"
+
+#include <ostream>
+#include <vector>
+
+// Both of these want a freshly decompressed pak, NOT one that went through RPak::RPak (it patches pointers in place)
+
+// Page sizes, alignment padding and how scattered every material's descriptor/textures are
+void rpak_analyze(uint8_t* deta, std::ostream& out);
+
+// Reorders pages so every material's descriptor, texture descriptors and texture data end up next to each other.
+// Result is stored uncompressed (size_disk == size_decompressed), we don't have a compressor.
+bool rpak_repack(uint8_t* deta, std::vector<uint8_t>* res_data);
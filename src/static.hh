@@ -36,6 +36,144 @@ void main()
   vert.UVLayer = vertUV;
 })#";
 
+// Same as above but reads the BSP vertex lumps itself, no vertex attributes
+// gl_VertexID already has base_vertex added so it's the index into the bound vertex lump
+static const std::string VERTEX_SHADER_PULLING = R"#(#version 460
+
+layout(binding = 0, std140) uniform viewInfo {
+    mat4 projection;
+    mat4 view;
+};
+layout(location = 1) uniform mat4 model;
+layout(location = 3) uniform uint vertexStride; // in uints
+
+layout(binding = 1, std430) readonly buffer positionsBuffer {
+    float positions[];
+};
+layout(binding = 2, std430) readonly buffer normalsBuffer {
+    float normals[];
+};
+// pos_index, nrm_index, uv[2] and whatever the lump has after that
+layout(binding = 3, std430) readonly buffer vertexLump {
+    uint vertices[];
+};
+
+out VS_OUTPUT {
+    vec3 Normal;
+    vec3 FragPos;
+    vec2 UVLayer;
+} vert;
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+void main()
+{
+  uint base = uint(gl_VertexID) * vertexStride;
+  uint pos_index = vertices[base + 0] * 3;
+  uint nrm_index = vertices[base + 1] * 3;
+
+  vec3 vertPos = vec3(positions[pos_index], positions[pos_index + 1], positions[pos_index + 2]);
+  vec3 vertNorm = vec3(normals[nrm_index], normals[nrm_index + 1], normals[nrm_index + 2]);
+  vec2 vertUV = vec2(uintBitsToFloat(vertices[base + 2]), uintBitsToFloat(vertices[base + 3]));
+
+  mat4 MVP = projection * view * model;
+
+  gl_Position = MVP * vec4(vertPos, 1.0);
+
+  vert.Normal = mat3(transpose(inverse(model))) * vertNorm;
+  vert.FragPos = vec3(model * vec4(vertPos, 1.0));
+  vert.UVLayer = vertUV;
+})#";
+
+// stk_vertex_compact_t: positions relative to the bounds of the model, octahedral normals
+static const std::string VERTEX_SHADER_COMPACT = R"#(#version 460
+
+layout(location = 0) in vec3 vertPos; // 0-65535
+layout(location = 1) in vec2 vertOct;
+layout(location = 3) in vec2 vertUV;
+
+layout(binding = 0, std140) uniform viewInfo {
+    mat4 projection;
+    mat4 view;
+};
+layout(location = 1) uniform mat4 model;
+layout(location = 4) uniform vec3 posOffset;
+layout(location = 5) uniform vec3 posScale;
+
+out VS_OUTPUT {
+    vec3 Normal;
+    vec3 FragPos;
+    vec2 UVLayer;
+} vert;
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+vec3 oct_decode(vec2 e)
+{
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if (n.z < 0.0) {
+    n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  }
+  return normalize(n);
+}
+
+void main()
+{
+  vec3 pos = posOffset + vertPos * posScale;
+  vec3 vertNorm = oct_decode(vertOct);
+
+  mat4 MVP = projection * view * model;
+
+  gl_Position = MVP * vec4(pos, 1.0);
+
+  vert.Normal = mat3(transpose(inverse(model))) * vertNorm;
+  vert.FragPos = vec3(model * vec4(pos, 1.0));
+  vert.UVLayer = vertUV;
+})#";
+
+// Static props, one instance per prop. Transforms come from an SSBO indexed by the instance,
+// gl_BaseInstance is the first prop of the model being drawn
+static const std::string VERTEX_SHADER_PROPS = R"#(#version 460
+
+layout(location = 0) in vec3 vertPos;
+layout(location = 1) in vec3 vertNorm;
+layout(location = 3) in vec2 vertUV;
+
+layout(binding = 0, std140) uniform viewInfo {
+    mat4 projection;
+    mat4 view;
+};
+layout(location = 1) uniform mat4 model;
+
+layout(binding = 4, std430) readonly buffer propTransforms {
+    mat4 transforms[];
+};
+
+out VS_OUTPUT {
+    vec3 Normal;
+    vec3 FragPos;
+    vec2 UVLayer;
+} vert;
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+void main()
+{
+  mat4 world = model * transforms[gl_BaseInstance + gl_InstanceID];
+
+  gl_Position = projection * view * world * vec4(vertPos, 1.0);
+
+  vert.Normal = mat3(transpose(inverse(world))) * vertNorm;
+  vert.FragPos = vec3(world * vec4(vertPos, 1.0));
+  vert.UVLayer = vertUV;
+})#";
+
 static const std::string FRAGMENT_SHADER = R"#(#version 460
 // Original by DTZxPorter
 // Tweaked to modern OGL by MrSteyk
@@ -71,6 +209,9 @@ void main()
     color = (ambient + diffuse) * texture(diffuseTexture, vert.UVLayer).rgb;
   } else if(diffuseLoaded == 2) {
     color = (ambient + diffuse) * vert.Normal;
+  } else if(diffuseLoaded == 3) {
+    // picked
+    color = (ambient + diffuse) * vec3(1.0, 0.55, 0.1);
   } else {
     color = (ambient + diffuse) * vec3(0.603, 0.603, 0.603);
   }
@@ -0,0 +1,306 @@
+#include "stream.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <tuple>
+
+static size_t stream_align(size_t size) {
+    return (size + STREAM_ALIGN - 1) & ~(STREAM_ALIGN - 1);
+}
+
+bool build_stream_grid(const stk_map_t& map, float cell_size, stream_grid_t* res) {
+    *res           = {};
+    res->cell_size = cell_size;
+    if (map.vertex_mode == VERTEX_MODE::PULLING)
+        return false;
+    res->vertex_size = map.vertex_mode == VERTEX_MODE::COMPACT ? sizeof(stk_vertex_compact_t) : sizeof(stk_vertex_t);
+
+    // every mesh goes in the cell its middle is in
+    struct placed_t {
+        int32_t  x, y;
+        uint32_t model, mesh;
+        float    mins[3], maxs[3];
+    };
+    std::vector<placed_t> placed;
+    for (uint32_t model = 0; model < map.models.size(); model++) {
+        for (uint32_t mesh = 0; mesh < map.models[model].meshes.size(); mesh++) {
+            const auto& mp = map.models[model].meshes[mesh];
+            if (!mp.dec.indices)
+                continue;
+
+            placed_t p = {0, 0, model, mesh, {}, {}};
+            for (int i = 0; i < 3; i++) {
+                p.mins[i] = std::numeric_limits<float>::max();
+                p.maxs[i] = -std::numeric_limits<float>::max();
+            }
+            for (uint32_t i = 0; i < mp.dec.indices; i++) {
+                vertex_t v;
+                if (!mesh_vertex_position(map, mp, mesh_index_at(map, mp, i), &v))
+                    continue;
+                for (int axis = 0; axis < 3; axis++) {
+                    p.mins[axis] = std::min(p.mins[axis], v.coords[axis]);
+                    p.maxs[axis] = std::max(p.maxs[axis], v.coords[axis]);
+                }
+            }
+            if (p.mins[0] > p.maxs[0])
+                continue;
+            p.x = int32_t(std::floor((p.mins[0] + p.maxs[0]) * 0.5f / cell_size));
+            p.y = int32_t(std::floor((p.mins[1] + p.maxs[1]) * 0.5f / cell_size));
+            placed.push_back(p);
+        }
+    }
+    std::stable_sort(placed.begin(), placed.end(), [](const placed_t& a, const placed_t& b) { return std::tie(a.x, a.y) < std::tie(b.x, b.y); });
+
+    std::vector<stream_range_t> ranges;
+    for (size_t begin = 0; begin < placed.size();) {
+        auto end = begin + 1;
+        while (end < placed.size() && placed[end].x == placed[begin].x && placed[end].y == placed[begin].y)
+            end++;
+
+        stream_cell_t cell = {};
+        cell.x             = placed[begin].x;
+        cell.y             = placed[begin].y;
+        cell.first_mesh    = uint32_t(res->meshes.size());
+        cell.meshes_num    = uint32_t(end - begin);
+        cell.first_range   = uint32_t(res->vertex_ranges.size());
+        memcpy(cell.mins, placed[begin].mins, sizeof(cell.mins));
+        memcpy(cell.maxs, placed[begin].maxs, sizeof(cell.maxs));
+
+        // vertex ranges of the meshes, merged where they overlap so shared vertices go in once
+        ranges.clear();
+        for (auto i = begin; i < end; i++) {
+            const auto& mp = map.models[placed[i].model].meshes[placed[i].mesh];
+            ranges.push_back({mp.dec.base_vertex, mp.vertex_end - mp.dec.base_vertex});
+            for (int axis = 0; axis < 3; axis++) {
+                cell.mins[axis] = std::min(cell.mins[axis], placed[i].mins[axis]);
+                cell.maxs[axis] = std::max(cell.maxs[axis], placed[i].maxs[axis]);
+            }
+        }
+        std::sort(ranges.begin(), ranges.end(), [](const stream_range_t& a, const stream_range_t& b) { return a.first < b.first; });
+        for (const auto& range : ranges) {
+            if (res->vertex_ranges.size() > cell.first_range) {
+                auto& last = res->vertex_ranges.back();
+                if (range.first <= last.first + last.count) {
+                    last.count = std::max(last.count, range.first + range.count - last.first);
+                    continue;
+                }
+            }
+            res->vertex_ranges.push_back(range);
+        }
+        cell.ranges_num = uint32_t(res->vertex_ranges.size() - cell.first_range);
+
+        uint32_t vertices = 0;
+        for (uint32_t r = 0; r < cell.ranges_num; r++) {
+            vertices += res->vertex_ranges[cell.first_range + r].count;
+        }
+        cell.vertex_bytes = uint32_t(stream_align(vertices * res->vertex_size));
+
+        // indices of every level after the vertices
+        uint32_t indices = 0;
+        for (auto i = begin; i < end; i++) {
+            const auto& mp = map.models[placed[i].model].meshes[placed[i].mesh];
+            for (uint32_t level = 0; level <= mp.lods_num; level++) {
+                indices += mesh_lod_dec(mp, level).indices;
+            }
+        }
+        cell.index_bytes = uint32_t(stream_align(indices * sizeof(uint16_t)));
+
+        indices = cell.vertex_bytes / sizeof(uint16_t);
+        for (auto i = begin; i < end; i++) {
+            const auto& mp = map.models[placed[i].model].meshes[placed[i].mesh];
+
+            stream_mesh_t sm = {};
+            sm.model         = placed[i].model;
+            sm.mesh          = placed[i].mesh;
+
+            // where the mesh's first vertex ended up in the block
+            uint32_t block_vertex = 0;
+            for (uint32_t r = 0; r < cell.ranges_num; r++) {
+                const auto& range = res->vertex_ranges[cell.first_range + r];
+                if (mp.dec.base_vertex >= range.first && mp.dec.base_vertex < range.first + range.count) {
+                    block_vertex += mp.dec.base_vertex - range.first;
+                    break;
+                }
+                block_vertex += range.count;
+            }
+
+            for (uint32_t level = 0; level < MAP_LODS; level++) {
+                auto& dec = sm.decs[level];
+                if (level > mp.lods_num) {
+                    dec = sm.decs[mp.lods_num];
+                    continue;
+                }
+                dec             = mesh_lod_dec(mp, level);
+                dec.base_vertex = block_vertex;
+                dec.base_index  = indices;
+                indices += dec.indices;
+            }
+            res->meshes.push_back(sm);
+        }
+
+        res->bytes += cell.bytes();
+        res->cells.push_back(cell);
+        begin = end;
+    }
+
+    return true;
+}
+
+void stream_cell_block(const stk_map_t& map, const stream_grid_t& grid, uint32_t cell, uint8_t* out) {
+    const auto& c = grid.cells[cell];
+    memset(out, 0, c.bytes());
+
+    const auto vertices = map.vertex_mode == VERTEX_MODE::COMPACT ? (const uint8_t*)map.compact_vec.data() : (const uint8_t*)map.vertex_vec.data();
+    auto       at       = out;
+    for (uint32_t r = 0; r < c.ranges_num; r++) {
+        const auto& range = grid.vertex_ranges[c.first_range + r];
+        memcpy(at, vertices + size_t(range.first) * grid.vertex_size, size_t(range.count) * grid.vertex_size);
+        at += size_t(range.count) * grid.vertex_size;
+    }
+
+    for (uint32_t m = 0; m < c.meshes_num; m++) {
+        const auto& sm = grid.meshes[c.first_mesh + m];
+        const auto& mp = map.models[sm.model].meshes[sm.mesh];
+        for (uint32_t level = 0; level <= mp.lods_num; level++) {
+            const auto src = mesh_lod_dec(mp, level);
+            const auto dst = sm.decs[level];
+            memcpy(out + size_t(dst.base_index) * sizeof(uint16_t), map.index_vec.data() + src.base_index, src.indices * sizeof(uint16_t));
+        }
+    }
+}
+
+dec_t stream_mesh_dec(const stream_grid_t& grid, const stream_mesh_t& mesh, uint32_t lod, size_t offset) {
+    auto dec = mesh.decs[std::min<size_t>(lod, MAP_LODS - 1)];
+    dec.base_vertex += uint32_t(offset / grid.vertex_size);
+    dec.base_index += uint32_t(offset / sizeof(uint16_t));
+    return dec;
+}
+
+// --- StreamArena
+
+StreamArena::StreamArena(size_t size) : total(size) {
+    if (size)
+        this->free_ranges[0] = size;
+}
+
+size_t StreamArena::alloc(size_t size) {
+    size = stream_align(size);
+    for (auto it = this->free_ranges.begin(); it != this->free_ranges.end(); ++it) {
+        if (it->second < size)
+            continue;
+
+        const auto offset = it->first;
+        const auto rest   = it->second - size;
+        this->free_ranges.erase(it);
+        if (rest)
+            this->free_ranges[offset + size] = rest;
+        this->used_bytes += size;
+        return offset;
+    }
+    return STREAM_NO_SPACE;
+}
+
+void StreamArena::free(size_t offset, size_t size) {
+    size = stream_align(size);
+    this->used_bytes -= size;
+
+    auto it = this->free_ranges.emplace(offset, size).first;
+    if (const auto next = std::next(it); next != this->free_ranges.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        this->free_ranges.erase(next);
+    }
+    if (it != this->free_ranges.begin()) {
+        const auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first) {
+            prev->second += it->second;
+            this->free_ranges.erase(it);
+        }
+    }
+}
+
+size_t StreamArena::largest_free() const {
+    size_t largest = 0;
+    for (const auto& range : this->free_ranges) {
+        largest = std::max(largest, range.second);
+    }
+    return largest;
+}
+
+// --- StreamResidency
+
+StreamResidency::StreamResidency(const stream_grid_t& grid, size_t gpu_budget) : grid(grid), heap(gpu_budget), gpu_budget(gpu_budget) {
+    this->offsets.assign(grid.cells.size(), STREAM_NO_SPACE);
+    this->distances.resize(grid.cells.size());
+    this->order.resize(grid.cells.size());
+    this->wanted.resize(grid.cells.size());
+}
+
+void StreamResidency::evict(uint32_t cell, std::vector<stream_op_t>* ops) {
+    ops->push_back({cell, false, this->offsets[cell]});
+    this->heap.free(this->offsets[cell], this->grid.cells[cell].bytes());
+    this->offsets[cell] = STREAM_NO_SPACE;
+    this->resident_cells--;
+    this->evictions++;
+}
+
+void StreamResidency::update(const float camera[3], size_t max_load_bytes, std::vector<stream_op_t>* ops) {
+    ops->clear();
+    const auto cells = this->grid.cells.size();
+
+    // distance on XY to the box of the cell's meshes
+    for (uint32_t c = 0; c < cells; c++) {
+        const auto& cell = this->grid.cells[c];
+        float       d2   = 0.f;
+        for (int axis = 0; axis < 2; axis++) {
+            const auto d = std::max({cell.mins[axis] - camera[axis], camera[axis] - cell.maxs[axis], 0.f});
+            d2 += d * d;
+        }
+        this->distances[c] = std::sqrt(d2) - (this->resident(c) ? STREAM_HYSTERESIS * this->grid.cell_size : 0.f);
+    }
+    std::iota(this->order.begin(), this->order.end(), 0);
+    std::sort(this->order.begin(), this->order.end(), [&](uint32_t a, uint32_t b) { return this->distances[a] < this->distances[b]; });
+
+    // closest ones that fit, a cell too big for what's left doesn't stop smaller ones further out
+    size_t total = 0;
+    for (const auto c : this->order) {
+        const auto bytes = stream_align(this->grid.cells[c].bytes());
+        this->wanted[c]  = total + bytes <= this->gpu_budget;
+        if (this->wanted[c])
+            total += bytes;
+    }
+
+    for (uint32_t c = 0; c < cells; c++) {
+        if (this->resident(c) && !this->wanted[c])
+            this->evict(c, ops);
+    }
+
+    size_t loaded = 0;
+    for (size_t i = 0; i < cells; i++) {
+        const auto c = this->order[i];
+        if (!this->wanted[c] || this->resident(c))
+            continue;
+        if (loaded && loaded + this->grid.cells[c].bytes() > max_load_bytes)
+            break;
+
+        auto offset = this->heap.alloc(this->grid.cells[c].bytes());
+        // everything wanted fits, just not in one piece. Whatever's further out makes room and comes back later
+        for (auto j = cells; offset == STREAM_NO_SPACE && j-- > i;) {
+            if (this->resident(this->order[j])) {
+                this->evict(this->order[j], ops);
+                offset = this->heap.alloc(this->grid.cells[c].bytes());
+            }
+        }
+        if (offset == STREAM_NO_SPACE)
+            continue;
+
+        this->offsets[c] = offset;
+        ops->push_back({c, true, offset});
+        this->resident_cells++;
+        this->loads++;
+        this->bytes_loaded += this->grid.cells[c].bytes();
+        loaded += this->grid.cells[c].bytes();
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "map.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Streaming the geometry of a map through one fixed size GPU buffer instead of keeping all of it resident on the GPU.
+// Meshes get binned into a grid of columns on XY (maps are wide, not tall), a cell's vertices and indices
+// are a self contained block that can be put anywhere in the arena, and the closest cells that fit the budget are kept in it.
+// The budget only covers video memory: blocks get built from the stk_map_t, so its vectors stay in RAM along with the BVH
+// and the ray caster, like they do without streaming.
+// Nothing in here touches GL, main.cc copies the blocks and patches the draw commands.
+
+constexpr float STREAM_CELL_SIZE = 4096.f;
+// Blocks start and their parts are aligned to this, every vertex and index size divides it so offsets convert exactly
+constexpr size_t STREAM_ALIGN = 32;
+// Resident cells count as this many cells closer, so the ones at the edge of the budget don't flip every frame
+constexpr float STREAM_HYSTERESIS = 0.5f;
+
+constexpr size_t STREAM_NO_SPACE = ~size_t(0);
+
+struct stream_mesh_t {
+    uint32_t model;
+    uint32_t mesh;
+    // base_vertex/base_index are relative to the start of the cell's block, in units of its vertex/index size
+    dec_t decs[MAP_LODS];
+};
+
+struct stream_cell_t {
+    int32_t  x, y;
+    float    mins[3], maxs[3]; // of the meshes in it, they can stick out of the cell
+    uint32_t first_mesh, meshes_num; // stream_grid_t::meshes
+    uint32_t first_range, ranges_num; // stream_grid_t::vertex_ranges
+    // block layout, vertices then indices, both sizes aligned
+    uint32_t vertex_bytes;
+    uint32_t index_bytes;
+
+    size_t bytes() const { return size_t(this->vertex_bytes) + this->index_bytes; }
+};
+
+// Vertices of the map that get copied into a block, back to back
+struct stream_range_t {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct stream_grid_t {
+    float                       cell_size   = STREAM_CELL_SIZE;
+    size_t                      vertex_size = 0; // stk_vertex_t or stk_vertex_compact_t
+    std::vector<stream_cell_t>  cells;
+    std::vector<stream_mesh_t>  meshes; // grouped by cell
+    std::vector<stream_range_t> vertex_ranges; // grouped by cell
+
+    size_t bytes = 0; // all of the blocks
+};
+
+// false for VERTEX_MODE::PULLING, that one reads the lumps as SSBOs and has nothing to split
+bool build_stream_grid(const stk_map_t& map, float cell_size, stream_grid_t* res);
+
+// The block of a cell, out has cell.bytes()
+void stream_cell_block(const stk_map_t& map, const stream_grid_t& grid, uint32_t cell, uint8_t* out);
+
+// Draw command of a streamed mesh whose cell's block is at offset bytes into the arena
+dec_t stream_mesh_dec(const stream_grid_t& grid, const stream_mesh_t& mesh, uint32_t lod, size_t offset);
+
+// First fit over [0, size), freed ranges merge with their neighbours
+class StreamArena {
+public:
+    explicit StreamArena(size_t size);
+
+    // STREAM_NO_SPACE if there's no free range that big, sizes get rounded up to STREAM_ALIGN
+    size_t alloc(size_t size);
+    void   free(size_t offset, size_t size);
+
+    size_t size() const { return this->total; }
+    size_t used() const { return this->used_bytes; }
+    size_t largest_free() const;
+
+private:
+    std::map<size_t, size_t> free_ranges; // offset -> size
+    size_t                   total;
+    size_t                   used_bytes = 0;
+};
+
+struct stream_op_t {
+    uint32_t cell;
+    bool     load; // evicted otherwise
+    size_t   offset; // of the block in the arena
+};
+
+// Which cells are in the arena. update() works out evictions and loads for where the camera is,
+// whoever owns the GPU buffer carries them out in the order they come in, a load can reuse the space of an eviction before it.
+class StreamResidency {
+public:
+    // gpu_budget - bytes of the arena
+    StreamResidency(const stream_grid_t& grid, size_t gpu_budget);
+
+    // At most max_load_bytes of loads a call, but always at least one so it can't stall on a big cell
+    void update(const float camera[3], size_t max_load_bytes, std::vector<stream_op_t>* ops);
+
+    bool   resident(uint32_t cell) const { return this->offsets[cell] != STREAM_NO_SPACE; }
+    size_t offset(uint32_t cell) const { return this->offsets[cell]; }
+
+    const StreamArena& arena() const { return this->heap; }
+
+    size_t resident_cells = 0;
+    size_t loads          = 0;
+    size_t evictions      = 0;
+    size_t bytes_loaded   = 0;
+
+private:
+    void evict(uint32_t cell, std::vector<stream_op_t>* ops);
+
+    const stream_grid_t&  grid;
+    StreamArena           heap;
+    size_t                gpu_budget;
+    std::vector<size_t>   offsets; // per cell, STREAM_NO_SPACE when it isn't in
+    std::vector<float>    distances;
+    std::vector<uint32_t> order;
+    std::vector<bool>     wanted;
+};